@@ -8,6 +8,8 @@
 #ifndef RVIZ_CINEMATOGRAPHER_GUI_H
 #define RVIZ_CINEMATOGRAPHER_GUI_H
 
+#include <algorithm>
+#include <deque>
 #include <fstream>
 #include <sstream>
 #include <string>
@@ -29,6 +31,7 @@
 #include <rviz_cinematographer_msgs/Finished.h>
 
 #include <std_msgs/Empty.h>
+#include <std_msgs/String.h>
 
 #include <nav_msgs/Path.h>
 
@@ -39,6 +42,7 @@
 
 #include <QWidget>
 #include <QFileDialog>
+#include <QTimer>
 
 #include <rviz_cinematographer_gui/utils.h>
 #include <ui_rviz_cinematographer_gui.h>
@@ -85,6 +89,16 @@ public:
   typedef std::list<TimedMarker> MarkerList;
   typedef typename MarkerList::iterator MarkerIterator;
 
+  /** @brief Recording of one trajectory within a batch. */
+  struct BatchJob
+  {
+    std::string trajectory_path;
+    std::string output_path;
+    int frames_per_second;
+    bool compress;
+    bool add_watermark;
+  };
+
   enum
   {
     RISING_INTERPOLATION_SPEED = rviz_cinematographer_msgs::CameraMovement::RISING,
@@ -137,6 +151,10 @@ public:
 
 Q_SIGNALS:
   void updateRequested();
+  /** @brief Hands a batch file received via ROS over to the main thread. */
+  void batchRequested(const QString& file_path);
+  /** @brief Hands the end of a recording received via ROS over to the main thread. */
+  void recordingFinished(int frame_count, int dropped_frames, unsigned int recording_id);
 
 public slots:
   /** @brief Moves rviz camera to currently selected pose.*/
@@ -173,6 +191,20 @@ public slots:
   void loadTrajectoryFromFile();
   /** @brief Saves poses and transition durations of interactive markers to a file.*/
   void saveTrajectoryToFile();
+  /** @brief Opens file explorer to select a batch file and records all of its trajectories.*/
+  void renderBatchFromFile();
+  /** @brief Records all trajectories listed in the batch file.*/
+  void renderBatch(const QString& file_path);
+  /** @brief Loads the next trajectory of the batch and moves the camera to its first pose.*/
+  void startNextBatchJob();
+  /** @brief Records the loaded trajectory of the batch from its first to its last pose.*/
+  void recordBatchJob();
+  /** @brief Reports the throughput of the finished job and starts the next one.*/
+  void finishBatchJob(int frame_count, int dropped_frames, unsigned int recording_id);
+  /** @brief Skips the current job of the batch if its recording didn't finish in time.*/
+  void timeOutBatchJob();
+  /** @brief Stops the running batch - the current recording is not waited for.*/
+  void cancelBatch();
   /** @brief Opens file explorer to specify the path of the recorded video.*/
   void setVideoOutputPath();
   /** @brief Adds a marker between the currently selected marker and the one before in the trajectory.*/
@@ -440,9 +472,9 @@ private:
                              bool duplicate_ends = true);
 
   /**
-   * @brief Interpolate markers using a spline and safe that spline as the points of a CameraTrajectory.
+   * @brief Converts markers to the control points of a spline CameraTrajectory.
    *
-   * @param[in]     markers         markers to be interpolated.
+   * @param[in]     markers         markers to be interpolated - the first and the last one only define the spline's ends.
    * @param[out]    trajectory      resulting trajectory.
    */
   void markersToSplinedCamTrajectory(const MarkerList& markers,
@@ -462,36 +494,21 @@ private:
                      std::vector<Vector3>& input_up_directions);
 
   /**
-   * @brief Computes transition durations for each step within the spline.
+   * @brief Computes the transition duration and speed profile of each movement along the spline.
    *
-   * @param[in]     markers                     markers defining trajectory.
-   * @param[out]    transition_durations        transition durations between spline points.
-   * @param[out]    wait_durations              wait durations at spline points.
-   * @param[out]    total_transition_duration   sum of all transition durations.
-   */
-  void computeDurations(const MarkerList& markers,
-                        std::vector<double>& transition_durations,
-                        std::vector<double>& wait_durations,
-                        double& total_transition_duration);
-
-  /**
-   * @brief Convert spline to CameraTrajectory.
+   * With smooth velocity, the total transition duration is distributed by the length of the spline between the
+   * markers, so the camera moves at constant speed after accelerating along the first and before decelerating along the
+   * last segment. Otherwise the camera stops at every marker.
    *
-   * @param[in]     eye_spline                  spline of camera positions.
-   * @param[in]     focus_spline                spline of camera focus points.
-   * @param[in]     up_spline                   spline of camera up positions.
-   * @param[in]     transition_durations        transition duration between spline points.
-   * @param[in]     wait_durations              wait duration at spline points.
-   * @param[in]     total_transition_duration   overall transition duration.
-   * @param[out]    trajectory                  resulting camera trajectory.
+   * @param[in]     markers                 markers defining the spline - the first and the last one only define its ends.
+   * @param[in]     eye_spline              spline of camera positions.
+   * @param[out]    transition_durations    durations of the movements to the markers after the start of the spline.
+   * @param[out]    interpolation_speeds    speed profiles of these movements.
    */
-  void splineToCamTrajectory(const UniformCRSpline<Vector3>& eye_spline,
-                             const UniformCRSpline<Vector3>& focus_spline,
-                             const UniformCRSpline<Vector3>& up_spline,
-                             const std::vector<double>& transition_durations,
-                             const std::vector<double>& wait_durations,
-                             const double total_transition_duration,
-                             rviz_cinematographer_msgs::CameraTrajectoryPtr trajectory);
+  void computeSplineTimings(const MarkerList& markers,
+                            const UniformCRSpline<Vector3>& eye_spline,
+                            std::vector<double>& transition_durations,
+                            std::vector<uint8_t>& interpolation_speeds);
 
   /** @brief Call service to record current trajectory. */
   void publishRecordParams();
@@ -499,6 +516,29 @@ private:
   /** @brief Listen to the message that the recording is over. */
   void recordFinishedCallback(const rviz_cinematographer_msgs::Finished::ConstPtr& record_finished);
 
+  /** @brief Listen to requests to record all trajectories of a batch file. */
+  void renderBatchCallback(const std_msgs::String::ConstPtr& file_path);
+
+  /**
+   * @brief Loads markers from a .yaml or .txt trajectory file.
+   *
+   * @param[in] file_path   path to the file.
+   * @return false if the file type is not supported.
+   */
+  bool loadTrajectory(const std::string& file_path);
+
+  /**
+   * @brief Reads the jobs of a batch file - relative paths are relative to the batch file.
+   *
+   * Recording parameters that are not specified by a job are taken from the GUI.
+   *
+   * @param[in]     file_path   path to the batch file.
+   * @param[out]    jobs        jobs of the batch.
+   * @return false if the file could not be parsed.
+   */
+  bool loadBatch(const std::string& file_path,
+                 std::deque<BatchJob>& jobs);
+
   /** @brief Starts video recorder nodelet. */
   void videoRecorderThread();
 
@@ -529,6 +569,8 @@ private:
   ros::Subscriber record_finished_sub_;
   /** @brief Subscribes to delete marker msgs. */
   ros::Subscriber delete_marker_sub_;
+  /** @brief Subscribes to requests to render a batch file. */
+  ros::Subscriber render_batch_sub_;
 
   /** @brief Starts video recorder nodelet. */
   boost::shared_ptr<boost::thread> video_recorder_thread_;
@@ -549,6 +591,29 @@ private:
 
   /** @brief True if recorder was destructed. */
   bool recorder_running_;
+  /** @brief Identifies the latest recording - counted up from the start time, so it differs across restarts. */
+  uint32_t recording_id_;
+
+  /** @brief Jobs of the running batch that were not started yet. */
+  std::deque<BatchJob> batch_jobs_;
+  /** @brief Number of jobs of the running batch, zero if no batch is running. */
+  size_t batch_size_;
+  /** @brief Number of the currently running job of the batch. */
+  size_t batch_job_number_;
+  /** @brief True while the current job of the batch is recorded. */
+  bool is_recording_batch_job_;
+  /** @brief recording_id of the Record message of the current job. */
+  uint32_t batch_job_recording_id_;
+  /** @brief Fails the current job if its recording doesn't finish in time. */
+  QTimer* batch_job_timer_;
+  /** @brief Start of the recording of the current job. */
+  ros::WallTime batch_job_start_;
+  /** @brief Start of the batch. */
+  ros::WallTime batch_start_;
+  /** @brief Frames written by all finished jobs of the batch. */
+  uint64_t batch_frames_;
+  /** @brief Number of jobs of the batch that could not be recorded. */
+  size_t failed_batch_jobs_;
 };
 
 } // namespace
@@ -12,11 +12,27 @@ namespace rviz_cinematographer_gui
 
 template<typename T> inline void ignoreResult(T){}
 
+/** @brief Time in milliseconds rviz gets to jump to the first pose of a batch job before the recording starts. */
+static const int BATCH_SETTLE_TIME_MS = 500;
+
+/** @brief A batch job fails if its recording didn't finish within this multiple of the trajectory's duration... */
+static const double BATCH_JOB_TIMEOUT_FACTOR = 10.0;
+/** @brief ... or this number of milliseconds, whichever is longer. */
+static const int BATCH_JOB_MIN_TIMEOUT_MS = 60000;
+
 RvizCinematographerGUI::RvizCinematographerGUI()
   : rqt_gui_cpp::Plugin()
     , widget_(0)
     , current_marker_name_("")
     , recorder_running_(true)
+    , recording_id_(static_cast<uint32_t>(ros::WallTime::now().sec))
+    , batch_size_(0)
+    , batch_job_number_(0)
+    , is_recording_batch_job_(false)
+    , batch_job_recording_id_(0)
+    , batch_job_timer_(0)
+    , batch_frames_(0)
+    , failed_batch_jobs_(0)
 {
   //cam_pose_.orientation.w = 1.0;
 
@@ -72,6 +88,16 @@ void RvizCinematographerGUI::initPlugin(qt_gui_cpp::PluginContext& context)
 
   connect(ui_.open_file_push_button, SIGNAL(clicked(bool)), this, SLOT(loadTrajectoryFromFile()));
   connect(ui_.save_file_push_button, SIGNAL(clicked(bool)), this, SLOT(saveTrajectoryToFile()));
+  connect(ui_.render_batch_push_button, SIGNAL(clicked(bool)), this, SLOT(renderBatchFromFile()));
+
+  batch_job_timer_ = new QTimer(this);
+  batch_job_timer_->setSingleShot(true);
+  connect(batch_job_timer_, SIGNAL(timeout()), this, SLOT(timeOutBatchJob()));
+
+  // ROS callbacks run in another thread - the GUI is only touched from the main thread
+  connect(this, SIGNAL(batchRequested(QString)), this, SLOT(renderBatch(QString)), Qt::QueuedConnection);
+  connect(this, SIGNAL(recordingFinished(int, int, unsigned int)),
+          this, SLOT(finishBatchJob(int, int, unsigned int)), Qt::QueuedConnection);
   
   // add widget to the user interface
   context.addWidget(widget_);
@@ -114,6 +140,7 @@ void RvizCinematographerGUI::initPlugin(qt_gui_cpp::PluginContext& context)
   camera_pose_sub_ = ph.subscribe("/rviz/current_camera_pose", 1, &RvizCinematographerGUI::camPoseCallback, this);
   record_finished_sub_ = ph.subscribe("/video_recorder/record_finished", 1, &RvizCinematographerGUI::recordFinishedCallback, this);
   delete_marker_sub_ = ph.subscribe("/rviz/delete", 1, &RvizCinematographerGUI::removeCurrentMarker, this);
+  render_batch_sub_ = ph.subscribe("/rviz_cinematographer_gui/render_batch", 1, &RvizCinematographerGUI::renderBatchCallback, this);
 
   bool start_recorder = true;
   ph.getParam("start_recorder", start_recorder);
@@ -211,6 +238,7 @@ void RvizCinematographerGUI::shutdownPlugin()
   server_->clear();
 
   camera_pose_sub_.shutdown();
+  render_batch_sub_.shutdown();
   camera_trajectory_pub_.shutdown();
 
   view_poses_array_pub_.publish(path);
@@ -783,11 +811,16 @@ void RvizCinematographerGUI::loadTrajectoryFromFile()
     return;
   }
 
-  std::string extension = boost::filesystem::extension(file_name.toStdString());
+  loadTrajectory(file_name.toStdString());
+}
+
+bool RvizCinematographerGUI::loadTrajectory(const std::string& file_path)
+{
+  std::string extension = boost::filesystem::extension(file_path);
 
   if(extension == ".yaml")
   {
-    YAML::Node trajectory = YAML::LoadFile(file_name.toStdString());
+    YAML::Node trajectory = YAML::LoadFile(file_path);
     int count = 0;
     markers_.clear();
     for(const auto& pose : trajectory["rviz_cinematographer_camera_poses"])
@@ -816,7 +849,7 @@ void RvizCinematographerGUI::loadTrajectoryFromFile()
   {
     int count = 0;
     markers_.clear();
-    std::ifstream infile(file_name.toStdString());
+    std::ifstream infile(file_path);
     std::string line;
     double prev_pose_duration = 0.0;
     while(std::getline(infile, line))
@@ -862,8 +895,8 @@ void RvizCinematographerGUI::loadTrajectoryFromFile()
   }
   else
   {
-    ROS_ERROR_STREAM("Specified file is neither .yaml nor .txt file.\n File name is: " << file_name.toStdString());
-    return;
+    ROS_ERROR_STREAM("Specified file is neither .yaml nor .txt file.\n File name is: " << file_path);
+    return false;
   }
 
   // first marker is current marker
@@ -878,6 +911,7 @@ void RvizCinematographerGUI::loadTrajectoryFromFile()
   
   updateGUIValues(markers_.front());
   updateTrajectory();
+  return true;
 }
 
 void RvizCinematographerGUI::saveTrajectoryToFile()
@@ -1064,6 +1098,7 @@ void RvizCinematographerGUI::publishRecordParams()
   record_params.frames_per_second = ui_.video_fps_spin_box->value();
   record_params.compress = ui_.video_compressed_check_box->isChecked();
   record_params.add_watermark = ui_.watermark_check_box->isChecked();
+  record_params.recording_id = ++recording_id_;
   record_params_pub_.publish(record_params);
 }
 
@@ -1071,7 +1106,232 @@ void
 RvizCinematographerGUI::recordFinishedCallback(const rviz_cinematographer_msgs::Finished::ConstPtr& record_finished)
 {
   if(record_finished->is_finished > 0)
+  {
     ui_.record_radio_button->setChecked(false);
+    Q_EMIT recordingFinished(static_cast<int>(record_finished->frame_count),
+                             static_cast<int>(record_finished->dropped_frames),
+                             record_finished->recording_id);
+  }
+}
+
+void RvizCinematographerGUI::renderBatchFromFile()
+{
+  // the button cancels the running batch
+  if(batch_size_ > 0)
+  {
+    cancelBatch();
+    return;
+  }
+
+  std::string directory_path = ros::package::getPath("rviz_cinematographer_gui") + "/trajectories/";
+
+  QString file_name = QFileDialog::getOpenFileName(widget_, "Open Batch", QString(directory_path.c_str()),
+                                                   ".yaml files (*.yaml);;All Files (*)");
+  if(file_name == "")
+  {
+    ROS_ERROR_STREAM("No file specified.");
+    return;
+  }
+
+  renderBatch(file_name);
+}
+
+void RvizCinematographerGUI::renderBatchCallback(const std_msgs::String::ConstPtr& file_path)
+{
+  Q_EMIT batchRequested(QString::fromStdString(file_path->data));
+}
+
+bool RvizCinematographerGUI::loadBatch(const std::string& file_path,
+                                       std::deque<BatchJob>& jobs)
+{
+  boost::filesystem::path directory = boost::filesystem::path(file_path).parent_path();
+
+  try
+  {
+    YAML::Node batch = YAML::LoadFile(file_path);
+    for(const auto& job_node : batch["jobs"])
+    {
+      BatchJob job;
+      job.trajectory_path = boost::filesystem::absolute(job_node["trajectory"].as<std::string>(), directory).string();
+      job.output_path = boost::filesystem::absolute(job_node["output"].as<std::string>(), directory).string();
+      job.frames_per_second = job_node["frames_per_second"].as<int>(ui_.video_fps_spin_box->value());
+      job.compress = job_node["compress"].as<bool>(ui_.video_compressed_check_box->isChecked());
+      job.add_watermark = job_node["add_watermark"].as<bool>(ui_.watermark_check_box->isChecked());
+      jobs.push_back(job);
+    }
+  }
+  catch(const YAML::Exception& e)
+  {
+    ROS_ERROR_STREAM("Could not read batch file " << file_path << ": " << e.what());
+    return false;
+  }
+
+  return true;
+}
+
+void RvizCinematographerGUI::renderBatch(const QString& file_path)
+{
+  if(batch_size_ > 0)
+  {
+    ROS_ERROR_STREAM("A batch is already running. Ignoring " << file_path.toStdString());
+    return;
+  }
+
+  std::deque<BatchJob> jobs;
+  if(!loadBatch(file_path.toStdString(), jobs))
+    return;
+
+  if(jobs.empty())
+  {
+    ROS_ERROR_STREAM("Batch file " << file_path.toStdString() << " contains no jobs.");
+    return;
+  }
+
+  if(!recorder_running_)
+    ROS_WARN("Video recorder is not running. The batch only proceeds if rviz records in-process.");
+
+  batch_jobs_ = std::move(jobs);
+  batch_size_ = batch_jobs_.size();
+  batch_job_number_ = 0;
+  batch_frames_ = 0;
+  failed_batch_jobs_ = 0;
+  batch_start_ = ros::WallTime::now();
+  ui_.render_batch_push_button->setText("Cancel Batch");
+
+  ROS_INFO_STREAM("Rendering " << batch_size_ << " trajectories of " << file_path.toStdString());
+  startNextBatchJob();
+}
+
+void RvizCinematographerGUI::startNextBatchJob()
+{
+  // the batch was canceled
+  if(batch_size_ == 0)
+    return;
+
+  if(batch_jobs_.empty())
+  {
+    double duration = (ros::WallTime::now() - batch_start_).toSec();
+    ROS_INFO_STREAM("Batch finished: recorded " << batch_size_ - failed_batch_jobs_ << " of " << batch_size_
+                    << " trajectories with " << batch_frames_ << " frames in " << duration << " s - "
+                    << (duration > 0.0 ? batch_frames_ / duration : 0.0) << " frames/s.");
+    batch_size_ = 0;
+    ui_.render_batch_push_button->setText("Render Batch...");
+    return;
+  }
+
+  BatchJob job = batch_jobs_.front();
+  batch_jobs_.pop_front();
+  batch_job_number_++;
+
+  bool is_loaded = false;
+  try
+  {
+    is_loaded = boost::filesystem::exists(job.trajectory_path) && loadTrajectory(job.trajectory_path);
+  }
+  catch(const YAML::Exception& e)
+  {
+    ROS_ERROR_STREAM("Could not read trajectory " << job.trajectory_path << ": " << e.what());
+  }
+
+  if(!is_loaded || markers_.size() < 2)
+  {
+    ROS_ERROR_STREAM("Skipping job " << batch_job_number_ << "/" << batch_size_ << ": " << job.trajectory_path
+                     << " is no trajectory of at least two poses.");
+    failed_batch_jobs_++;
+    // continue from the event loop to not recurse over a series of broken jobs
+    QTimer::singleShot(0, this, SLOT(startNextBatchJob()));
+    return;
+  }
+
+  ui_.video_output_path_line_edit->setText(QString::fromStdString(job.output_path));
+  ui_.video_fps_spin_box->setValue(job.frames_per_second);
+  ui_.video_compressed_check_box->setChecked(job.compress);
+  ui_.watermark_check_box->setChecked(job.add_watermark);
+
+  ROS_INFO_STREAM("Starting job " << batch_job_number_ << "/" << batch_size_ << ": " << job.trajectory_path
+                  << " -> " << job.output_path);
+
+  // jump to the first pose without recording, so the video doesn't start where the previous job ended
+  rviz_cinematographer_msgs::CameraTrajectoryPtr cam_trajectory(new rviz_cinematographer_msgs::CameraTrajectory());
+  cam_trajectory->target_frame = ui_.frame_line_edit->text().toStdString();
+  cam_trajectory->allow_free_yaw_axis = !ui_.use_up_of_world_check_box->isChecked();
+
+  rviz_cinematographer_msgs::CameraMovement cam_movement;
+  convertMarkerToCamMovement(markers_.front(), cam_movement);
+  cam_movement.transition_duration = ros::Duration(0.0);
+  cam_trajectory->trajectory.push_back(cam_movement);
+  camera_trajectory_pub_.publish(cam_trajectory);
+
+  QTimer::singleShot(BATCH_SETTLE_TIME_MS, this, SLOT(recordBatchJob()));
+}
+
+void RvizCinematographerGUI::recordBatchJob()
+{
+  // the batch was canceled while rviz jumped to the first pose
+  if(batch_size_ == 0)
+    return;
+
+  ui_.record_radio_button->setChecked(true);
+  is_recording_batch_job_ = true;
+  batch_job_start_ = ros::WallTime::now();
+
+  // the loaded trajectory starts at its first marker - publishes the Record message of the job
+  moveCamToLast();
+  batch_job_recording_id_ = recording_id_;
+
+  // the recording may render slower than real time, but not arbitrarily slower
+  double trajectory_duration = 0.0;
+  for(const auto& marker : markers_)
+    trajectory_duration += marker.transition_duration + marker.wait_duration;
+  batch_job_timer_->start(std::max(BATCH_JOB_MIN_TIMEOUT_MS,
+                                   static_cast<int>(trajectory_duration * BATCH_JOB_TIMEOUT_FACTOR * 1000.0)));
+}
+
+void RvizCinematographerGUI::timeOutBatchJob()
+{
+  if(!is_recording_batch_job_)
+    return;
+  is_recording_batch_job_ = false;
+
+  ROS_ERROR_STREAM("Job " << batch_job_number_ << "/" << batch_size_ << " didn't finish within "
+                   << batch_job_timer_->interval() / 1000 << " s. Is the video recorder running? Skipping it.");
+  ui_.record_radio_button->setChecked(false);
+  failed_batch_jobs_++;
+  startNextBatchJob();
+}
+
+void RvizCinematographerGUI::cancelBatch()
+{
+  ROS_WARN_STREAM("Canceling the batch at job " << batch_job_number_ << "/" << batch_size_ << ".");
+  batch_job_timer_->stop();
+  ui_.record_radio_button->setChecked(false);
+
+  // the current job and all jobs not started yet are not recorded
+  failed_batch_jobs_ += batch_jobs_.size() + 1;
+  batch_jobs_.clear();
+  is_recording_batch_job_ = false;
+  startNextBatchJob();
+}
+
+void RvizCinematographerGUI::finishBatchJob(int frame_count,
+                                            int dropped_frames,
+                                            unsigned int recording_id)
+{
+  // ignore recordings that were not started by the batch, e.g. one that timed out earlier
+  if(!is_recording_batch_job_ || recording_id != batch_job_recording_id_)
+    return;
+  is_recording_batch_job_ = false;
+  batch_job_timer_->stop();
+
+  double duration = (ros::WallTime::now() - batch_job_start_).toSec();
+  double frames_per_second = duration > 0.0 ? frame_count / duration : 0.0;
+  ROS_INFO_STREAM("Finished job " << batch_job_number_ << "/" << batch_size_ << ": "
+                  << frame_count << " frames" << (dropped_frames > 0 ? " (" + std::to_string(dropped_frames) + " dropped)" : "")
+                  << " in " << duration << " s - " << frames_per_second << " frames/s, "
+                  << frames_per_second / ui_.video_fps_spin_box->value() << "x real time.");
+
+  batch_frames_ += frame_count;
+  startNextBatchJob();
 }
 
 void RvizCinematographerGUI::moveCamToCurrent()
@@ -1435,23 +1695,40 @@ void RvizCinematographerGUI::markersToSplinedCamTrajectory(const MarkerList& mar
   std::vector<Vector3> input_up_directions;
   prepareSpline(markers, input_eye_positions, input_focus_positions, input_up_directions);
 
-  // Generate splines
+  // only needed to distribute the durations - the view controller interpolates the spline itself
   UniformCRSpline<Vector3> eye_spline(input_eye_positions);
-  UniformCRSpline<Vector3> focus_spline(input_focus_positions);
-  UniformCRSpline<Vector3> up_spline(input_up_directions);
 
   std::vector<double> transition_durations;
-  std::vector<double> wait_durations;
-  double total_transition_duration = 0.0;
-  computeDurations(markers, transition_durations, wait_durations, total_transition_duration);
+  std::vector<uint8_t> interpolation_speeds;
+  computeSplineTimings(markers, eye_spline, transition_durations, interpolation_speeds);
+
+  const bool smooth_velocity = ui_.smooth_velocity_check_box->isChecked();
+
+  // the markers are the control points of the spline - the first and the last one only define its ends
+  trajectory->interpolation = rviz_cinematographer_msgs::CameraTrajectory::SPLINE;
+  size_t id = 0;
+  for(auto marker = markers.begin(); marker != markers.end(); ++marker, ++id)
+  {
+    rviz_cinematographer_msgs::CameraMovement cam_movement;
+    convertMarkerToCamMovement(*marker, cam_movement);
 
-  splineToCamTrajectory(input_eye_positions,
-                        input_focus_positions,
-                        input_up_directions,
-                        transition_durations,
-                        wait_durations,
-                        total_transition_duration,
-                        trajectory);
+    // the camera is expected to be at the start of the spline already
+    if(id == 1)
+      cam_movement.transition_duration = ros::Duration(0.0);
+    else if(id > 1 && id + 1 < markers.size())
+    {
+      cam_movement.transition_duration = ros::Duration(transition_durations[id - 2]);
+      cam_movement.interpolation_speed = interpolation_speeds[id - 2];
+    }
+    trajectory->trajectory.push_back(cam_movement);
+
+    // wait at markers between start and end by moving to the same pose again
+    if(!smooth_velocity && id > 1 && id + 2 < markers.size() && marker->wait_duration > 0.01)
+    {
+      cam_movement.transition_duration = ros::Duration(marker->wait_duration);
+      trajectory->trajectory.push_back(cam_movement);
+    }
+  }
 }
 
 void RvizCinematographerGUI::prepareSpline(const MarkerList& markers,
@@ -1492,132 +1769,64 @@ void RvizCinematographerGUI::prepareSpline(const MarkerList& markers,
   }
 }
 
-void RvizCinematographerGUI::computeDurations(const MarkerList& markers,
-                                              std::vector<double>& transition_durations,
-                                              std::vector<double>& wait_durations,
-                                              double& total_transition_duration)
+void RvizCinematographerGUI::computeSplineTimings(const MarkerList& markers,
+                                                  const UniformCRSpline<Vector3>& eye_spline,
+                                                  std::vector<double>& transition_durations,
+                                                  std::vector<uint8_t>& interpolation_speeds)
 {
-  const double frequency = ui_.publish_rate_spin_box->value();
-  const bool smooth_velocity = ui_.smooth_velocity_check_box->isChecked();
+  // the spline passes through all but the first and the last marker
+  if(markers.size() < 4)
+    return;
+  const size_t segment_count = markers.size() - 3;
 
-  bool first = true;
-  std::string prev_marker_name;
-  for(const auto& marker : markers)
+  if(!ui_.smooth_velocity_check_box->isChecked())
   {
-    // first because - when moving from marker A to B we only consider the transition duration of B
-    // check for equal names because - UniformCRSpline needs to be fed with start marker two times (end as well)
-    // this case needs to be handled to prevent errors
-    if(!first && prev_marker_name != marker.marker.name)
+    // stop at every marker, taking the transition duration of the marker that is moved to
+    for(auto marker = std::next(markers.begin(), 2); marker != std::prev(markers.end()); ++marker)
     {
-      if(smooth_velocity)
-        total_transition_duration += marker.transition_duration;
-      else
-      {
-        transition_durations.push_back(marker.transition_duration / frequency);
-        wait_durations.push_back(marker.wait_duration);
-      }
+      transition_durations.push_back(marker->transition_duration);
+      interpolation_speeds.push_back(WAVE_INTERPOLATION_SPEED);
     }
-
-    first = false;
-    prev_marker_name = marker.marker.name;
+    return;
   }
-}
 
-void RvizCinematographerGUI::splineToCamTrajectory(const UniformCRSpline<Vector3>& eye_spline,
-                                                   const UniformCRSpline<Vector3>& focus_spline,
-                                                   const UniformCRSpline<Vector3>& up_spline,
-                                                   const std::vector<double>& transition_durations,
-                                                   const std::vector<double>& wait_durations,
-                                                   const double total_transition_duration,
-                                                   rviz_cinematographer_msgs::CameraTrajectoryPtr trajectory)
-{
-  const double frequency = ui_.publish_rate_spin_box->value();
-  const bool smooth_velocity = ui_.smooth_velocity_check_box->isChecked();
+  double total_transition_duration = 0.0;
+  for(auto marker = std::next(markers.begin(), 2); marker != std::prev(markers.end()); ++marker)
+    total_transition_duration += marker->transition_duration;
 
-  // rate to sample from spline and get points
-  rviz_cinematographer_msgs::CameraMovement cam_movement = makeCameraMovement();
-  double rate = 1.0 / frequency;
-  float max_t = eye_spline.getMaxT();
-  double total_length = eye_spline.totalLength();
-  bool first = true;
-  bool last_run = false;
-  int current_transition_id = 0;
-  int previous_transition_id = 0;
-  for(double t = 0.f; t <= max_t;)
+  if(segment_count == 1)
   {
-    // get position in spline
-    auto interpolated_position = eye_spline.getPosition(t);
-    auto interpolated_focus = focus_spline.getPosition(t);
-    auto interpolated_up = up_spline.getPosition(t);
-
-    cam_movement.eye.point.x = interpolated_position[0];
-    cam_movement.eye.point.y = interpolated_position[1];
-    cam_movement.eye.point.z = interpolated_position[2];
-    cam_movement.focus.point.x = interpolated_focus[0];
-    cam_movement.focus.point.y = interpolated_focus[1];
-    cam_movement.focus.point.z = interpolated_focus[2];
-
-    if(!ui_.use_up_of_world_check_box->isChecked())
-    {
-      cam_movement.up.vector.x = interpolated_up[0];
-      cam_movement.up.vector.y = interpolated_up[1];
-      cam_movement.up.vector.z = interpolated_up[2];
-    }
-    // else is not necessary - up is already set to default in makeCameraMovement
-
-    bool accelerate = false;
-    if(!trajectory->trajectory.empty())
-      accelerate = trajectory->trajectory.back().interpolation_speed == DECLINING_INTERPOLATION_SPEED;
-    
-    cam_movement.interpolation_speed = (first || accelerate) ? RISING_INTERPOLATION_SPEED
-                                                             : FULL_INTERPOLATION_SPEED;
+    transition_durations.push_back(total_transition_duration);
+    interpolation_speeds.push_back(WAVE_INTERPOLATION_SPEED);
+    return;
+  }
 
-    // decline at end of trajectory and when reaching next position and velocity is not smoothed 
-    if((!smooth_velocity && current_transition_id != previous_transition_id) || last_run)
-      cam_movement.interpolation_speed = DECLINING_INTERPOLATION_SPEED;
+  // move at constant speed, accelerating along the first and decelerating along the last segment
+  // the rising and declining profiles reach pi/2 times their average speed, so these segments take longer
+  std::vector<double> weights;
+  double total_weight = 0.0;
+  for(size_t segment = 0; segment < segment_count; ++segment)
+  {
+    double weight = eye_spline.arcLength(static_cast<float>(segment), static_cast<float>(segment + 1));
+    if(segment == 0 || segment + 1 == segment_count)
+      weight *= M_PI_2;
+    weights.push_back(weight);
+    total_weight += weight;
+  }
 
-    double transition_duration = 0.0;
-    if(smooth_velocity)
-    {
-      double local_length = eye_spline.arcLength(std::max(t - rate, 0.0), t);
-      transition_duration = total_transition_duration * local_length / total_length;
-    }
+  for(size_t segment = 0; segment < segment_count; ++segment)
+  {
+    if(total_weight > 0.0)
+      transition_durations.push_back(total_transition_duration * weights[segment] / total_weight);
     else
-      transition_duration = transition_durations[(int)std::floor(std::max(t - rate, 0.0))];
-
-    cam_movement.transition_duration = ros::Duration(transition_duration);
-
+      transition_durations.push_back(total_transition_duration / segment_count);
 
-    // recreate movement/marker id to wait after transition if waiting time specified
-    current_transition_id = (int)std::floor(t + 0.00001); // magic number needed due to arithmetic imprecision with doubles
-    if(!smooth_velocity && current_transition_id != previous_transition_id &&
-       wait_durations[previous_transition_id] > 0.01)
-    {
-      cam_movement.interpolation_speed = DECLINING_INTERPOLATION_SPEED;
-      trajectory->trajectory.push_back(cam_movement);
-
-      cam_movement.transition_duration = ros::Duration(wait_durations[previous_transition_id]);
-      trajectory->trajectory.push_back(cam_movement);
-    }
+    if(segment == 0)
+      interpolation_speeds.push_back(RISING_INTERPOLATION_SPEED);
+    else if(segment + 1 == segment_count)
+      interpolation_speeds.push_back(DECLINING_INTERPOLATION_SPEED);
     else
-    {
-      trajectory->trajectory.push_back(cam_movement);
-    }
-    previous_transition_id = current_transition_id;
-
-    ROS_DEBUG_STREAM("t " << t << " max_t " << max_t);
-
-    if(last_run)
-      break;
-
-    t += rate;
-    if(t > max_t)
-    {
-      last_run = true;
-      t = max_t;
-    }
-
-    first = false;
+      interpolation_speeds.push_back(FULL_INTERPOLATION_SPEED);
   }
 }
 
@@ -0,0 +1,134 @@
+/** @file
+ *
+ * Asynchronous readback of rendered frames through a ring of OpenGL pixel buffer objects.
+ *
+ * @author Jan Razlaw
+ */
+
+#ifndef RVIZ_CINEMATOGRAPHER_VIEW_CONTROLLER_ASYNC_FRAME_READER_H
+#define RVIZ_CINEMATOGRAPHER_VIEW_CONTROLLER_ASYNC_FRAME_READER_H
+
+#include <string>
+#include <vector>
+
+#include <sensor_msgs/Image.h>
+
+namespace rviz_cinematographer_view_controller
+{
+
+/** @brief Reads frames from the framebuffer of the current OpenGL context without stalling the render thread.
+ *
+ * A request only starts the transfer of the framebuffer into the next pixel buffer object of a ring and returns
+ * immediately. A frame is mapped not before the ring is full - at least one rendered frame later, when its transfer
+ * is finished - so frame N is copied to the CPU while frame N+1 renders.
+ *
+ * All methods have to be called from the render thread with the render context current.
+ */
+class AsyncFrameReader
+{
+public:
+  /** @brief Constructor.
+   *
+   * @param[in] ring_size   number of pixel buffer objects - frames are returned with a delay of ring_size - 1 requests.
+   */
+  explicit AsyncFrameReader(size_t ring_size = 2);
+  ~AsyncFrameReader();
+
+  /** @brief Checks if the current OpenGL context supports asynchronous readback and allocates the ring.
+   *
+   * Software renderers like llvmpipe implement pixel buffer objects as plain memory copies on the render thread,
+   * so they are rejected in favor of the synchronous path.
+   *
+   * @return true if requestFrame can be used.
+   */
+  bool initialize();
+
+  /** @brief Returns true if initialize succeeded. */
+  bool isAvailable() const { return available_; }
+
+  /** @brief Returns the name of the OpenGL renderer - available after initialize. */
+  const std::string& renderer() const { return renderer_; }
+
+  /** @brief Returns the number of requested frames that were not retrieved yet. */
+  size_t pending() const { return pending_; }
+
+  /** @brief Starts the transfer of the back buffer of the current framebuffer into the next buffer of the ring.
+   *
+   * @param[in] width   width of the framebuffer in pixels.
+   * @param[in] height  height of the framebuffer in pixels.
+   *
+   * @return false if not available or if the ring is full - retrieve a frame first.
+   */
+  bool requestFrame(unsigned int width, unsigned int height);
+
+  /** @brief Starts the transfer of a texture into the next buffer of the ring.
+   *
+   * @param[in] texture_id  name of the OpenGL texture, e.g. of an Ogre render texture.
+   * @param[in] width       width of the texture in pixels.
+   * @param[in] height      height of the texture in pixels.
+   *
+   * @return false if not available or if the ring is full - retrieve a frame first.
+   */
+  bool requestTexture(unsigned int texture_id, unsigned int width, unsigned int height);
+
+  /** @brief Returns the size of the frame the next call to retrieveFrame returns.
+   *
+   * @param[out] width    width of the frame in pixels.
+   * @param[out] height   height of the frame in pixels.
+   * @param[in]  flush    if false, a frame is only returned if the ring is full.
+   *
+   * @return false if retrieveFrame would not return a frame.
+   */
+  bool nextFrameSize(unsigned int& width, unsigned int& height, bool flush = false) const;
+
+  /** @brief Copies the oldest requested frame into data as top-down BGR8.
+   *
+   * @param[out] data   memory for the frame of the size returned by nextFrameSize, with rows of width * 3 bytes.
+   * @param[in] flush   if false, a frame is only returned if the ring is full.
+   *
+   * @return true if a frame was copied to data.
+   */
+  bool retrieveFrame(unsigned char* data, bool flush = false);
+
+  /** @brief Copies the oldest requested frame into image as top-down BGR8.
+   *
+   * @param[out] image  filled with size, encoding and pixels of the frame - header is left untouched.
+   * @param[in] flush   if false, a frame is only returned if the ring is full.
+   *
+   * @return true if a frame was copied to image.
+   */
+  bool retrieveFrame(sensor_msgs::Image& image, bool flush = false);
+
+  /** @brief Drops all requested frames without reading them. */
+  void clear();
+
+private:
+  struct Buffer
+  {
+    Buffer() : id(0), width(0), height(0), is_bottom_up(false) {}
+
+    unsigned int id;
+    unsigned int width;
+    unsigned int height;
+    bool is_bottom_up;    ///< True for framebuffer reads, whose first row is the bottom one.
+  };
+
+  /** @brief Binds the next buffer of the ring and resizes it if needed - returns nullptr if the ring is full. */
+  Buffer* beginRequest(unsigned int width, unsigned int height);
+
+  /** @brief Unbinds the buffer and advances the ring. */
+  void endRequest();
+
+  /** @brief Returns true if the renderer name belongs to a software rasterizer. */
+  static bool isSoftwareRenderer(const std::string& renderer);
+
+  std::vector<Buffer> buffers_;
+  size_t next_request_;
+  size_t pending_;
+  bool available_;
+  std::string renderer_;
+};
+
+}  // namespace rviz_cinematographer_view_controller
+
+#endif // RVIZ_CINEMATOGRAPHER_VIEW_CONTROLLER_ASYNC_FRAME_READER_H
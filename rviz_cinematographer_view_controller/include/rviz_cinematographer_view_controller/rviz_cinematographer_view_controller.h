@@ -46,23 +46,30 @@
 #include "rviz/properties/float_property.h"
 #include "rviz/properties/vector_property.h"
 #include "rviz/properties/bool_property.h"
+#include "rviz/properties/int_property.h"
+#include "rviz/properties/string_property.h"
 #include "rviz/properties/tf_frame_property.h"
 #include "rviz/properties/editable_enum_property.h"
 #include "rviz/properties/ros_topic_property.h"
 
 #include <ros/subscriber.h>
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <ros/package.h>
 
 #include <rviz_cinematographer_msgs/CameraMovement.h>
 #include <rviz_cinematographer_msgs/CameraTrajectory.h>
 #include <rviz_cinematographer_msgs/Record.h>
 #include <rviz_cinematographer_msgs/Finished.h>
-#include <rviz_cinematographer_msgs/Wait.h>
+#include <rviz_cinematographer_msgs/FrameAck.h>
+#include <rviz_cinematographer_msgs/ViewImage.h>
 #include <std_msgs/Empty.h>
 
 #include <nav_msgs/Odometry.h>
 
+#include <tf2_ros/buffer.h>
+#include <tf2_ros/transform_listener.h>
+
 #include <OGRE/OgreVector3.h>
 #include <OGRE/OgreQuaternion.h>
 #include <OGRE/OgreRenderWindow.h>
@@ -70,19 +77,34 @@
 #include <OGRE/OgreSceneNode.h>
 #include <OGRE/OgreSceneManager.h>
 #include <OGRE/OgreCamera.h>
+#include <OGRE/OgreTextureManager.h>
+#include <OGRE/OgreHardwarePixelBuffer.h>
+#include <OGRE/OgreRenderTexture.h>
+
+#include <map>
+#include <string>
 
-#include <boost/circular_buffer.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
 
 #include <cv.hpp>
 
 #include <image_transport/image_transport.h>
 #include <cv_bridge/cv_bridge.h>
 
+#include "rviz_cinematographer_view_controller/async_frame_reader.h"
+#include "rviz_cinematographer_view_controller/trajectory_player.h"
+
+#include <video_recorder/encoding_pipeline.h>
+#include <video_recorder/shared_frame_ring.h>
+
 namespace rviz {
   class SceneNode;
   class Shape;
   class BoolProperty;
   class FloatProperty;
+  class IntProperty;
+  class StringProperty;
   class VectorProperty;
   class TfFrameProperty;
   class EditableEnumProperty;
@@ -92,46 +114,43 @@ namespace rviz {
 namespace rviz_cinematographer_view_controller
 {
 
+/** @brief Rigid transform from a frame into the attached frame. */
+struct AttachedFrameTransform
+{
+  Ogre::Vector3 position;
+  Ogre::Quaternion orientation;
+};
+
+/** @brief Transforms into the attached frame by the id of their source frame. */
+struct AttachedFrameTransformCache
+{
+  std::string attached_frame;               ///< Frame the transforms lead into.
+  std::map<std::string, AttachedFrameTransform> transforms;
+};
+
+/** @brief Camera trajectory that was received and transformed into the attached frame, ready to be played back. */
+struct TrajectoryBlock
+{
+  bool interaction_disabled;
+  bool allow_free_yaw_axis;
+  uint8_t mouse_interaction_mode;
+  std::string attached_frame;               ///< Frame the movements were transformed into.
+  TrajectoryPlayer trajectory;              ///< Movements with an open start.
+};
+
 /** @brief An un-constrained "flying" camera, specified by an eye point, focus point, and up vector. */
 class CinematographerViewController : public rviz::ViewController
 {
 Q_OBJECT
 public:
 
-  struct OgreCameraMovement
-  {
-    OgreCameraMovement(){};
-
-    OgreCameraMovement(const Ogre::Vector3& eye,
-                       const Ogre::Vector3& focus,
-                       const Ogre::Vector3& up,
-                       const ros::Duration& transition_duration,
-                       const uint8_t interpolation_speed)
-      : eye(eye)
-        , focus(focus)
-        , up(up)
-        , transition_duration(transition_duration)
-        , interpolation_speed(interpolation_speed)
-    {
-    }
-
-    Ogre::Vector3 eye;
-    Ogre::Vector3 focus;
-    Ogre::Vector3 up;
-
-    ros::Duration transition_duration;
-    uint8_t interpolation_speed;
-  };
-
-  typedef boost::circular_buffer<OgreCameraMovement> BufferCamMovements;
-
   CinematographerViewController();
   virtual ~CinematographerViewController();
 
   /** @brief Do subclass-specific initialization. Called by
    * ViewController::initialize after context_ and camera_ are set.
    *
-   * This version sets up the attached_scene_node, focus shape, and camera movements buffer. */
+   * This version sets up the attached_scene_node and focus shape. */
   void onInitialize() override;
 
   /** @brief Called by activate(). */
@@ -268,17 +287,42 @@ protected:  //methods
   /** @brief Update the position of the attached_scene_node_ in the current frame. */
   void updateAttachedSceneNode();
 
-  /** @brief Initiate camera motion from incoming CameraTrajectory.
+  /** @brief Prepares camera motion from incoming CameraTrajectory - called by #trajectory_spinner_, not the render thread.
    *
    * @param[in] ct_ptr  incoming CameraTrajectory msg.
    */
   void cameraTrajectoryCallback(const rviz_cinematographer_msgs::CameraTrajectoryConstPtr& ct_ptr);
 
-  /** @brief Transforms the camera movement into the attached frame.
+  /** @brief Initiates camera motion for all trajectories prepared since the last update. */
+  void beginPendingTrajectories();
+
+  /** @brief Applies the control parameters of the trajectory and appends its movements to the current animation.
+   *
+   * @param[in] block   trajectory prepared by cameraTrajectoryCallback().
+   */
+  void beginTrajectory(const TrajectoryBlock& block);
+
+  /** @brief Starts a new animation at the current camera pose if there is none. */
+  void startTrajectoryIfIdle();
+
+  /** @brief Returns the transform from the frame into the attached frame, looking it up only once per cache.
+   *
+   * Looks the transform up in #tf_buffer_, so it can be called from the trajectory thread.
+   * Throws a tf2::TransformException if the transform is not available.
+   *
+   * @param[in] frame_id      source frame.
+   * @param[in,out] cache     transforms that were already looked up.
+   */
+  const AttachedFrameTransform& transformToAttachedFrame(const std::string& frame_id,
+                                                         AttachedFrameTransformCache& cache) const;
+
+  /** @brief Returns the pose of the camera movement in the attached frame.
    *
-   * @param[in,out] cm  camera movement that should be transformed into attached frame.
+   * @param[in] cm          camera movement that should be transformed into attached frame.
+   * @param[in,out] cache   transforms that were already looked up for the current trajectory.
    */
-  void transformCameraMovementToAttachedFrame(rviz_cinematographer_msgs::CameraMovement& cm);
+  TrajectoryPlayer::Pose transformCameraMovementToAttachedFrame(const rviz_cinematographer_msgs::CameraMovement& cm,
+                                                                AttachedFrameTransformCache& cache) const;
 
   /** @brief Set eye, focus and up property from provided source_camera.
    *
@@ -293,12 +337,14 @@ protected:  //methods
    * @param[in] up                      vector of camera pointing up
    * @param[in] transition_duration     duration needed for transition
    * @param[in] interpolation_speed     the interpolation speed profile
+   * @param[in] is_spline               if true, the camera follows a spline through consecutive spline movements
    */
   void beginNewTransition(const Ogre::Vector3& eye,
                           const Ogre::Vector3& focus,
                           const Ogre::Vector3& up,
                           ros::Duration transition_duration,
-                          uint8_t interpolation_speed = rviz_cinematographer_msgs::CameraMovement::WAVE);
+                          uint8_t interpolation_speed = rviz_cinematographer_msgs::CameraMovement::WAVE,
+                          bool is_spline = false);
 
   /** @brief Cancels any currently active camera movement. */
   void cancelTransition();
@@ -315,11 +361,22 @@ protected:  //methods
    */
   void setRecord(const rviz_cinematographer_msgs::Record::ConstPtr& record_params);
 
-  /** @brief Sets the duration the rendering has to wait for.
+  /** @brief Stores the latest frame the recorder consumed and wakes up the rendering if it waits for credit.
+   *
+   * Called by a separate spinner, as the rendering blocks the callback queue of rviz while it waits. Acknowledgements
+   * of other recordings are ignored.
+   *
+   * @params[in] ack  index of the consumed frame, the number of frames the recorder accepts beyond it and the recording.
+   */
+  void frameAckCallback(const rviz_cinematographer_msgs::FrameAck::ConstPtr& ack);
+
+  /** @brief Blocks until the recorder acknowledged enough frames to publish the frame with the given sequence number.
+   *
+   * Gives up on flow control for the rest of the recording if the recorder doesn't acknowledge frames at all.
    *
-   * @params[in] wait_duration  duration to wait for.
+   * @params[in] seq  sequence number of the frame about to be published.
    */
-  void setWaitDuration(const rviz_cinematographer_msgs::Wait::ConstPtr& wait_duration);
+  void waitForFrameCredit(uint32_t seq);
 
   Ogre::Vector3 fixedFrameToAttachedLocal(const Ogre::Vector3& v) { return reference_orientation_.Inverse() * (v - reference_position_); }
   Ogre::Vector3 attachedLocalToFixedFrame(const Ogre::Vector3& v) { return reference_position_ + (reference_orientation_ * v); }
@@ -327,16 +384,98 @@ protected:  //methods
   /** @brief Return the distance between camera and focal point. */
   float getDistanceFromCameraToFocalPoint();
 
-  /** @brief Convert the relative progress in time to the corresponding relative progress in space wrt. the interpolation speed profile.
+  /** @brief Advances the recording timeline by one frame and returns the time of the frame in the trajectory.
    *
-   * @params[in] relative_progress_in_time  the relative progress in time.
-   * @params[in] interpolation_speed        speed profile.
+   * Frame k of a trajectory is sampled at exactly k / fps seconds after its start, across movement boundaries.
+   * The last frame shows the final pose and is the one closest to the planned end, so the recording is as long as
+   * the sum of the transition durations, rounded to a whole frame.
+   *
+   * @return nanoseconds since the start of the trajectory - its duration only for the last frame.
    */
-  float computeRelativeProgressInSpace(double relative_progress_in_time, uint8_t interpolation_speed);
+  int64_t advanceRecordingTimeline();
 
-  /** @brief Publish the rendered image that is visible to the user in rviz. */
+  /** @brief Publish the rendered image that is visible to the user in rviz.
+   *
+   * With asynchronous readback the image of the previous call is published while the current one is transferred.
+   */
   void publishViewImage();
 
+  /** @brief Publishes the oldest frame of the asynchronous readback.
+   *
+   * @param[in] flush   if false, a frame is only published if the readback's ring is full.
+   *
+   * @return true if a frame was retrieved.
+   */
+  bool publishRetrievedFrame(bool flush);
+
+  /** @brief Downscales a supersampled image to the recording size and publishes it.
+   *
+   * @param[in] supersampled    the image as it was read back.
+   */
+  void publishDownscaledViewImage(sensor_msgs::Image& supersampled);
+
+  /** @brief Returns the buffer supersampled images are read into. */
+  sensor_msgs::Image& supersampledImage();
+
+  /** @brief Returns memory to write the next published BGR8 frame into.
+   *
+   * That's a slot in the recorder's shared memory if available, otherwise the data of a pooled image message.
+   *
+   * @param[in] width   width of the frame.
+   * @param[in] height  height of the frame.
+   */
+  unsigned char* beginViewImage(unsigned int width, unsigned int height);
+
+  /** @brief Publishes the frame written into the memory returned by beginViewImage. */
+  void endViewImage();
+
+  /** @brief Discards the frame begun with beginViewImage. */
+  void cancelViewImage();
+
+  /** @brief Opens the recorder's shared memory for a new recording if the transport is enabled. */
+  void openSharedFrames();
+
+  /** @brief Starts a recording in the encoding pipeline hosted by this view controller.
+   *
+   * Creates the pipeline on first use or if its settings changed.
+   *
+   * @params[in] record_params  parameters of the recording.
+   */
+  void startInProcessRecording(const rviz_cinematographer_msgs::Record& record_params);
+
+  /** @brief Lets a separate thread write the remaining frames of an in-process recording and close the video. */
+  void finishInProcessRecording();
+
+  /** @brief Waits until the pipeline wrote all frames and publishes that the recording is finished.
+   *
+   * @params[in] recording_id   identifies the finished recording.
+   */
+  void writeRemainingFrames(uint32_t recording_id);
+
+  /** @brief Loads the watermark of the video_recorder package for in-process recordings. */
+  void loadWatermark();
+
+  /** @brief (Re)creates or destroys the offscreen render target according to the recording properties. */
+  void updateRecordingTarget();
+
+  /** @brief Renders the current camera pose into the offscreen render target. */
+  void renderRecordingTarget();
+
+  /** @brief Releases the offscreen render target. */
+  void destroyRecordingTarget();
+
+  /** @brief Returns a view image message to read the next view image into.
+   *
+   * Recycles a previously published image that no one holds on to anymore, so its data buffer is not allocated again.
+   */
+  rviz_cinematographer_msgs::ViewImagePtr acquireViewImage();
+
+  /** @brief Publishes all frames that are still transferred by the asynchronous readback. */
+  void publishPendingViewImages();
+
+  /** @brief Returns true if frames are read back asynchronously - initializes the readback on first use. */
+  bool useAsyncReadback();
+
 protected:    //members
 
   ros::NodeHandle nh_;
@@ -357,6 +496,17 @@ protected:    //members
   
   rviz::FloatProperty* window_width_property_;            ///< The width of the rviz visualization window in pixels.
   rviz::FloatProperty* window_height_property_;           ///< The height of the rviz visualization window in pixels.
+  rviz::BoolProperty* async_readback_property_;           ///< If True, recorded frames are read back while the next one renders.
+  rviz::BoolProperty* offscreen_recording_property_;      ///< If True, recordings are rendered into an offscreen target.
+  rviz::IntProperty* recording_width_property_;           ///< The width of offscreen recordings in pixels.
+  rviz::IntProperty* recording_height_property_;          ///< The height of offscreen recordings in pixels.
+  rviz::IntProperty* supersampling_property_;             ///< Factor by which offscreen recordings are rendered larger.
+  rviz::BoolProperty* shared_memory_property_;            ///< If True, recorded frames are passed through shared memory.
+  rviz::StringProperty* shared_memory_name_property_;     ///< Name of the recorder's shared memory segment.
+  rviz::BoolProperty* in_process_recording_property_;     ///< If True, videos are encoded within rviz.
+  rviz::IntProperty* recording_queue_size_property_;      ///< Number of frames the in-process pipeline queues.
+  rviz::IntProperty* recording_workers_property_;         ///< Number of worker threads of the in-process pipeline.
+  rviz::IntProperty* frames_in_flight_property_;          ///< Maximum number of published frames not acknowledged yet.
     
   rviz::TfFrameProperty* attached_frame_property_;
   Ogre::SceneNode* attached_scene_node_;
@@ -367,7 +517,7 @@ protected:    //members
   // Variables used during animation
   bool animate_;
   ros::WallTime transition_start_time_;
-  BufferCamMovements cam_movements_buffer_;
+  TrajectoryPlayer trajectory_;               ///< Movements of the current animation, played back by time.
 
   std::shared_ptr<rviz::Shape> focal_shape_;    ///< A small ellipsoid to show the focus point.
   bool dragging_;         ///< A flag indicating the dragging state of the mouse.
@@ -375,21 +525,56 @@ protected:    //members
   QCursor interaction_disabled_cursor_;         ///< A cursor for indicating mouse interaction is disabled.
 
   ros::Subscriber trajectory_sub_;
+  ros::CallbackQueue trajectory_queue_;       ///< Serves #trajectory_sub_ so trajectories are prepared off the render thread.
+  ros::AsyncSpinner trajectory_spinner_;
+  tf2_ros::Buffer tf_buffer_;                 ///< Transforms for the trajectory thread - rviz' FrameManager is not thread-safe.
+  tf2_ros::TransformListener tf_listener_;
+  boost::mutex pending_trajectories_mutex_;   ///< Guards the pending trajectories and the attached frame below.
+  std::vector<boost::shared_ptr<TrajectoryBlock>> pending_trajectories_; ///< Prepared, but not played back yet.
+  std::string attached_frame_;                ///< Name of the attached frame for the trajectory thread.
   ros::Subscriber record_params_sub_;
-  ros::Subscriber wait_duration_sub_;
+  ros::Subscriber frame_ack_sub_;
 
   ros::Publisher placement_pub_;
   ros::Publisher odometry_pub_;
   ros::Publisher finished_rendering_trajectory_pub_;
   ros::Publisher delete_pub_;
-  image_transport::Publisher image_pub_;
+  ros::Publisher record_finished_pub_;
+  ros::Publisher image_pub_;                  ///< Publishes rendered images with their index in the recording.
 
   bool render_frame_by_frame_;
   int target_fps_;
-  int recorded_frames_counter_;
-
-  bool do_wait_;
-  float wait_duration_;
+  int64_t recorded_frames_counter_;          ///< Number of frames recorded since the trajectory started.
+
+  ros::CallbackQueue frame_ack_queue_;        ///< Serves #frame_ack_sub_ while the rendering blocks rviz's queue.
+  ros::AsyncSpinner frame_ack_spinner_;
+  boost::mutex frame_ack_mutex_;              ///< Guards the acknowledgement state below.
+  boost::condition_variable frame_acked_;     ///< Signals a new acknowledgement.
+  int64_t acked_seq_;                         ///< Sequence number of the latest acknowledged frame, -1 if none.
+  uint32_t ack_window_;                       ///< Number of frames the recorder accepts beyond #acked_seq_.
+  bool use_frame_acks_;                       ///< False if the recorder stopped acknowledging frames.
+  uint32_t recording_id_;                     ///< Identifies the current recording in acknowledgements.
+  uint32_t next_frame_seq_;                   ///< Index of the next frame of the recording, on any transport.
+
+  AsyncFrameReader frame_reader_;
+  bool frame_reader_initialized_;
+  std::vector<rviz_cinematographer_msgs::ViewImagePtr> view_image_pool_;
+
+  bool is_new_recording_;                     ///< True until the first frame of a recording applied the recording settings.
+  Ogre::TexturePtr recording_texture_;        ///< Offscreen render target - null if the render window is recorded.
+  unsigned int recording_texture_id_;         ///< OpenGL name of the offscreen render target's texture.
+  unsigned int recording_supersampling_;      ///< Supersampling factor of the current recording.
+  sensor_msgs::ImagePtr supersampled_image_;  ///< Buffer supersampled images are read into before downscaling.
+
+  video_recorder::SharedFrameRing shared_frames_; ///< Shared memory of the recorder.
+  bool use_shared_frames_;                        ///< True if the current recording is passed through shared memory.
+  rviz_cinematographer_msgs::ViewImagePtr current_view_image_; ///< Image between beginViewImage and endViewImage, if published.
+
+  bool record_in_process_;                                  ///< True if the current recording is encoded within rviz.
+  boost::shared_ptr<video_recorder::EncodingPipeline> pipeline_; ///< Encodes in-process recordings on its own threads.
+  unsigned int pipeline_num_workers_;                       ///< Number of worker threads requested for #pipeline_.
+  video_recorder::RecordingParameters recording_params_;    ///< Parameters of in-process recordings.
+  boost::thread recording_finisher_;                        ///< Writes the remaining frames of an in-process recording.
 };
 
 }  // namespace rviz_cinematographer_view_controller
@@ -0,0 +1,161 @@
+/** @file
+ *
+ * Continuous representation of a camera trajectory that can be evaluated at any point in time.
+ *
+ * @author Jan Razlaw
+ */
+
+#ifndef RVIZ_CINEMATOGRAPHER_VIEW_CONTROLLER_TRAJECTORY_PLAYER_H
+#define RVIZ_CINEMATOGRAPHER_VIEW_CONTROLLER_TRAJECTORY_PLAYER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include <OGRE/OgreVector3.h>
+
+namespace rviz_cinematographer_view_controller
+{
+
+/** @brief Plays back a camera trajectory made of linear movements and Catmull-Rom splines.
+ *
+ * Movements are appended once with their goal pose, duration and speed profile. Each one starts where the previous
+ * one ended and is stored with its end time, so the pose at any time since the start of the trajectory is found with
+ * a binary search - independent of how many movements the trajectory has or which of them were already played.
+ *
+ * Consecutive spline movements form one uniform Catmull-Rom spline through their goal poses. A movement to (nearly)
+ * the pose it starts at holds the camera without interrupting the spline, so the camera can wait at a control point.
+ */
+class TrajectoryPlayer
+{
+public:
+
+  /** @brief Pose of the camera. */
+  struct Pose
+  {
+    Pose() {}
+
+    Pose(const Ogre::Vector3& eye,
+         const Ogre::Vector3& focus,
+         const Ogre::Vector3& up)
+      : eye(eye)
+        , focus(focus)
+        , up(up)
+    {
+    }
+
+    /** @brief Returns true if all vectors are within Ogre's default tolerance of the other pose's. */
+    bool positionEquals(const Pose& other) const
+    {
+      return eye.positionEquals(other.eye) && focus.positionEquals(other.focus) && up.positionEquals(other.up);
+    }
+
+    Ogre::Vector3 eye;
+    Ogre::Vector3 focus;
+    Ogre::Vector3 up;
+  };
+
+  TrajectoryPlayer();
+
+  /** @brief Removes all poses and movements - keeps the allocated memory for the next trajectory. */
+  void clear();
+
+  /** @brief Makes room for the given number of movements on top of the existing ones.
+   *
+   * Grows the memory at least by a factor, so reserving before each appended trajectory stays linear overall.
+   *
+   * @param[in] movement_count  number of movements that are going to be appended.
+   */
+  void reserve(size_t movement_count);
+
+  /** @brief Returns true if the trajectory has no movements. */
+  bool empty() const { return movements_.empty(); }
+
+  /** @brief Returns the number of movements. */
+  size_t size() const { return movements_.size(); }
+
+  /** @brief Returns the duration of the whole trajectory in nanoseconds. */
+  int64_t duration() const { return movements_.empty() ? 0 : movements_.back().end_time; }
+
+  /** @brief Sets the pose the trajectory starts at - has to be called before the first movement is appended.
+   *
+   * @param[in] start   pose of the camera at time zero.
+   */
+  void setStart(const Pose& start);
+
+  /** @brief Begins a trajectory whose start is only known once it is appended to another trajectory.
+   *
+   * Used to prepare a trajectory away from the thread that plays it back. The first movement always moves the camera.
+   *
+   * @see append(const TrajectoryPlayer&)
+   */
+  void setOpenStart();
+
+  /** @brief Appends a movement from the end of the trajectory to the goal.
+   *
+   * @param[in] goal                  pose at the end of the movement.
+   * @param[in] duration              duration of the movement in nanoseconds.
+   * @param[in] interpolation_speed   speed profile of the movement.
+   * @param[in] is_spline             if true, the movement is part of a spline through the goals of all consecutive
+   *                                  spline movements, otherwise the poses are interpolated linearly.
+   */
+  void append(const Pose& goal,
+              int64_t duration,
+              uint8_t interpolation_speed,
+              bool is_spline = false);
+
+  /** @brief Appends all movements of the other trajectory - O(n) in its number of movements.
+   *
+   * @param[in] other   trajectory with an open start that continues from the end of this one.
+   */
+  void append(const TrajectoryPlayer& other);
+
+  /** @brief Adds a pose the spline doesn't pass through, but that defines its direction at one end.
+   *
+   * Added before the first movement of a spline, it takes the place of the pose before the spline's start.
+   * Added after the last movement, it takes the place of the pose after the spline's end and ends the spline.
+   * Without handles, the spline leaves its start towards the first goal and arrives from the previous goal.
+   *
+   * @param[in] handle  pose next to the end of the spline.
+   */
+  void addSplineHandle(const Pose& handle);
+
+  /** @brief Returns the pose of the camera at the given time - O(log n) in the number of movements.
+   *
+   * @param[in] time    nanoseconds since the start of the trajectory - clamped to the trajectory.
+   */
+  Pose poseAt(int64_t time) const;
+
+  /** @brief Convert the relative progress in time to the corresponding relative progress in space wrt. the interpolation speed profile.
+   *
+   * @param[in] relative_progress_in_time   the relative progress in time.
+   * @param[in] interpolation_speed         speed profile.
+   */
+  static float computeRelativeProgressInSpace(double relative_progress_in_time,
+                                              uint8_t interpolation_speed);
+
+private:
+
+  struct Movement
+  {
+    int64_t end_time;               ///< End of the movement in nanoseconds since the start of the trajectory.
+    int64_t duration;               ///< Duration of the movement in nanoseconds - at least one.
+    uint32_t before;                ///< Pose before the start, shaping the spline.
+    uint32_t start;                 ///< Pose at the start.
+    uint32_t goal;                  ///< Pose at the end.
+    uint32_t after;                 ///< Pose after the goal, shaping the spline.
+    uint8_t interpolation_speed;
+    bool is_spline;
+  };
+
+  std::vector<Pose> poses_;         ///< Start of the trajectory, goals of all movements and spline handles.
+  std::vector<Movement> movements_; ///< Movements ordered by their end time.
+  uint32_t end_pose_;               ///< Pose the trajectory currently ends at.
+  int64_t last_spline_;             ///< Last movement of a spline that is still extended, -1 if there is none.
+  int64_t spline_handle_;           ///< Handle for the start of the next spline, -1 if there is none.
+  bool is_start_open_;              ///< True if the start pose is a placeholder replaced when appending.
+};
+
+}  // namespace rviz_cinematographer_view_controller
+
+#endif // RVIZ_CINEMATOGRAPHER_VIEW_CONTROLLER_TRAJECTORY_PLAYER_H
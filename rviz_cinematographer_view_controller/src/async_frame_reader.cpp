@@ -0,0 +1,215 @@
+/** @file
+ *
+ * Asynchronous readback of rendered frames through a ring of OpenGL pixel buffer objects.
+ *
+ * @author Jan Razlaw
+ */
+
+#include "rviz_cinematographer_view_controller/async_frame_reader.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+#include <sensor_msgs/image_encodings.h>
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+namespace rviz_cinematographer_view_controller
+{
+
+AsyncFrameReader::AsyncFrameReader(size_t ring_size)
+  : buffers_(std::max<size_t>(1, ring_size))
+    , next_request_(0)
+    , pending_(0)
+    , available_(false)
+{
+}
+
+AsyncFrameReader::~AsyncFrameReader()
+{
+  for(auto& buffer : buffers_)
+    if(buffer.id != 0)
+      glDeleteBuffers(1, &buffer.id);
+}
+
+bool AsyncFrameReader::initialize()
+{
+  if(available_)
+    return true;
+
+  const char* renderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+  const char* version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+  const char* extensions = reinterpret_cast<const char*>(glGetString(GL_EXTENSIONS));
+  // no current context
+  if(!renderer || !version)
+    return false;
+
+  renderer_ = renderer;
+  if(isSoftwareRenderer(renderer_))
+    return false;
+
+  // pixel buffer objects are core since OpenGL 2.1
+  int major = 0, minor = 0;
+  bool has_pbo = std::sscanf(version, "%d.%d", &major, &minor) == 2 && (major > 2 || (major == 2 && minor >= 1));
+  if(!has_pbo && extensions)
+    has_pbo = std::strstr(extensions, "GL_ARB_pixel_buffer_object") != nullptr;
+  if(!has_pbo)
+    return false;
+
+  for(auto& buffer : buffers_)
+    glGenBuffers(1, &buffer.id);
+
+  available_ = glGetError() == GL_NO_ERROR;
+  return available_;
+}
+
+bool AsyncFrameReader::requestFrame(unsigned int width, unsigned int height)
+{
+  GLint previous_alignment = 4, previous_read_buffer = GL_BACK;
+  glGetIntegerv(GL_PACK_ALIGNMENT, &previous_alignment);
+  glGetIntegerv(GL_READ_BUFFER, &previous_read_buffer);
+
+  Buffer* buffer = beginRequest(width, height);
+  if(!buffer)
+    return false;
+  buffer->is_bottom_up = true;
+
+  // same buffer Ogre's synchronous copyContentsToMemory reads for windowed render targets
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadBuffer(GL_BACK);
+  // returns immediately - with a pack buffer bound the last argument is an offset into it
+  glReadPixels(0, 0, width, height, GL_BGR, GL_UNSIGNED_BYTE, nullptr);
+
+  glPixelStorei(GL_PACK_ALIGNMENT, previous_alignment);
+  glReadBuffer(static_cast<GLenum>(previous_read_buffer));
+  endRequest();
+  return true;
+}
+
+bool AsyncFrameReader::requestTexture(unsigned int texture_id, unsigned int width, unsigned int height)
+{
+  GLint previous_alignment = 4, previous_texture = 0;
+  glGetIntegerv(GL_PACK_ALIGNMENT, &previous_alignment);
+  glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous_texture);
+
+  Buffer* buffer = beginRequest(width, height);
+  if(!buffer)
+    return false;
+  // Ogre flips the projection when rendering to textures, so their first row is the top one
+  buffer->is_bottom_up = false;
+
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glBindTexture(GL_TEXTURE_2D, texture_id);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_BGR, GL_UNSIGNED_BYTE, nullptr);
+
+  glBindTexture(GL_TEXTURE_2D, static_cast<GLuint>(previous_texture));
+  glPixelStorei(GL_PACK_ALIGNMENT, previous_alignment);
+  endRequest();
+  return true;
+}
+
+AsyncFrameReader::Buffer* AsyncFrameReader::beginRequest(unsigned int width, unsigned int height)
+{
+  if(!available_ || pending_ == buffers_.size())
+    return nullptr;
+
+  Buffer& buffer = buffers_[next_request_];
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.id);
+  if(buffer.width != width || buffer.height != height)
+  {
+    glBufferData(GL_PIXEL_PACK_BUFFER, static_cast<GLsizeiptr>(width) * height * 3, nullptr, GL_STREAM_READ);
+    buffer.width = width;
+    buffer.height = height;
+  }
+  return &buffer;
+}
+
+void AsyncFrameReader::endRequest()
+{
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  next_request_ = (next_request_ + 1) % buffers_.size();
+  pending_++;
+}
+
+bool AsyncFrameReader::nextFrameSize(unsigned int& width, unsigned int& height, bool flush) const
+{
+  if(pending_ == 0 || (!flush && pending_ < buffers_.size()))
+    return false;
+
+  const Buffer& buffer = buffers_[(next_request_ + buffers_.size() - pending_) % buffers_.size()];
+  width = buffer.width;
+  height = buffer.height;
+  return true;
+}
+
+bool AsyncFrameReader::retrieveFrame(unsigned char* data, bool flush)
+{
+  if(pending_ == 0 || (!flush && pending_ < buffers_.size()))
+    return false;
+
+  size_t oldest = (next_request_ + buffers_.size() - pending_) % buffers_.size();
+  pending_--;
+
+  const Buffer& buffer = buffers_[oldest];
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.id);
+  auto pixels = static_cast<const unsigned char*>(glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY));
+  if(!pixels)
+  {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return false;
+  }
+
+  size_t step = static_cast<size_t>(buffer.width) * 3;
+  if(buffer.is_bottom_up)
+  {
+    // OpenGL's origin is the bottom left corner - flip while copying out of the mapped buffer
+    for(unsigned int row = 0; row < buffer.height; ++row)
+      std::memcpy(data + row * step, pixels + (buffer.height - 1 - row) * step, step);
+  }
+  else
+  {
+    std::memcpy(data, pixels, step * buffer.height);
+  }
+
+  glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  return true;
+}
+
+bool AsyncFrameReader::retrieveFrame(sensor_msgs::Image& image, bool flush)
+{
+  unsigned int width = 0, height = 0;
+  if(!nextFrameSize(width, height, flush))
+    return false;
+
+  image.height = height;
+  image.width = width;
+  image.encoding = sensor_msgs::image_encodings::BGR8;
+  image.is_bigendian = false;
+  image.step = width * 3;
+  image.data.resize(static_cast<size_t>(image.step) * image.height);
+  return retrieveFrame(image.data.data(), flush);
+}
+
+void AsyncFrameReader::clear()
+{
+  pending_ = 0;
+}
+
+bool AsyncFrameReader::isSoftwareRenderer(const std::string& renderer)
+{
+  std::string name = renderer;
+  std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+
+  const char* software_renderers[] = {"llvmpipe", "softpipe", "swrast", "software rasterizer", "swr"};
+  for(const char* software_renderer : software_renderers)
+    if(name.find(software_renderer) != std::string::npos)
+      return true;
+  return false;
+}
+
+}  // namespace rviz_cinematographer_view_controller
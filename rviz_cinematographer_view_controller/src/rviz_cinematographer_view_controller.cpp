@@ -29,6 +29,11 @@
 
 #include "rviz_cinematographer_view_controller/rviz_cinematographer_view_controller.h"
 
+#include <sstream>
+
+#include <OGRE/OgreRoot.h>
+#include <OGRE/OgreRenderSystem.h>
+
 namespace rviz_cinematographer_view_controller
 {
 using namespace rviz;
@@ -41,6 +46,21 @@ static const std::string MODE_FPS = "FPS";
 static const Ogre::Radian PITCH_LIMIT_LOW  = Ogre::Radian(0.02);
 static const Ogre::Radian PITCH_LIMIT_HIGH = Ogre::Radian(Ogre::Math::PI - 0.02);
 
+// Maximum number of view images that are recycled - more are allocated only if subscribers hold on to all of them
+static const size_t VIEW_IMAGE_POOL_SIZE = 4;
+
+// Queue of the view image publisher - bounds the number of frames in flight
+static const int VIEW_IMAGE_QUEUE_SIZE = 100;
+
+// Time without acknowledgement after which the recorder is assumed to not acknowledge frames
+static const double FRAME_ACK_TIMEOUT = 10.0;
+
+// Frames published before the recorder announced its window - covers opening the encoder and preparing the watermark
+static const uint32_t INITIAL_FRAME_ACK_WINDOW = 10;
+
+/** @brief Time in seconds the trajectory thread waits for the transforms of a trajectory. */
+static const double TRANSFORM_TIMEOUT = 1.0;
+
 // Some convenience functions for Ogre / geometry_msgs conversions
 static inline Ogre::Vector3 vectorFromMsg(const geometry_msgs::Point& m) { return Ogre::Vector3(m.x, m.y, m.z); }
 static inline Ogre::Vector3 vectorFromMsg(const geometry_msgs::Vector3& m) { return Ogre::Vector3(m.x, m.y, m.z); }
@@ -66,11 +86,24 @@ CinematographerViewController::CinematographerViewController()
   : nh_("")
     , animate_(false)
     , dragging_(false)
+    , trajectory_spinner_(1, &trajectory_queue_)
+    , tf_listener_(tf_buffer_)
     , render_frame_by_frame_(false)
     , target_fps_(60)
     , recorded_frames_counter_(0)
-    , do_wait_(false)
-    , wait_duration_(-1.f)
+    , frame_ack_spinner_(1, &frame_ack_queue_)
+    , acked_seq_(-1)
+    , ack_window_(0)
+    , use_frame_acks_(false)
+    , recording_id_(0)
+    , next_frame_seq_(0)
+    , frame_reader_initialized_(false)
+    , is_new_recording_(false)
+    , recording_texture_id_(0)
+    , recording_supersampling_(1)
+    , use_shared_frames_(false)
+    , record_in_process_(false)
+    , pipeline_num_workers_(0)
 {
   interaction_disabled_cursor_ = makeIconCursor("package://rviz/icons/forbidden.svg");
 
@@ -102,6 +135,52 @@ CinematographerViewController::CinematographerViewController()
   
   window_width_property_        = new FloatProperty("Window Width", 1000, "The width of the rviz visualization window in pixels.", this);
   window_height_property_       = new FloatProperty("Window Height", 1000, "The height of the rviz visualization window in pixels.", this);
+  async_readback_property_      = new BoolProperty("Asynchronous Readback", false,
+                                                   "Experimental - reads recorded frames back from the GPU while the next frame renders. "
+                                                   "Falls back to synchronous readback on software renderers.", this);
+
+  offscreen_recording_property_ = new BoolProperty("Offscreen Recording", false,
+                                                   "Records into an offscreen render target of the recording size "
+                                                   "instead of the render window.", this);
+  recording_width_property_     = new IntProperty("Recording Width", 1920, "Width of recorded images in pixels.",
+                                                  offscreen_recording_property_);
+  recording_width_property_->setMin(16);
+  recording_height_property_    = new IntProperty("Recording Height", 1080, "Height of recorded images in pixels.",
+                                                  offscreen_recording_property_);
+  recording_height_property_->setMin(16);
+  supersampling_property_       = new IntProperty("Supersampling", 1,
+                                                  "Renders recorded images this many times larger in each dimension "
+                                                  "and downscales them to the recording size.",
+                                                  offscreen_recording_property_);
+  supersampling_property_->setMin(1);
+  supersampling_property_->setMax(4);
+
+  shared_memory_property_       = new BoolProperty("Shared Memory Transport", false,
+                                                   "Writes recorded frames into the shared memory of a video_recorder "
+                                                   "on the same machine instead of publishing them.", this);
+  shared_memory_name_property_  = new StringProperty("Name", "/video_recorder_frames",
+                                                     "Name of the shared memory segment - ~shm_name of the "
+                                                     "video_recorder.", shared_memory_property_);
+
+  in_process_recording_property_ = new BoolProperty("In-Process Recording", false,
+                                                    "Encodes recorded frames within rviz instead of passing them to a "
+                                                    "video_recorder. Publishes /video_recorder/record_finished itself.",
+                                                    this);
+  recording_queue_size_property_ = new IntProperty("Queue Size", 50,
+                                                   "Number of frames queued for encoding before rendering blocks.",
+                                                   in_process_recording_property_);
+  recording_queue_size_property_->setMin(1);
+  recording_workers_property_    = new IntProperty("Worker Threads", 0,
+                                                   "Number of threads preparing frames for the encoder - 0 uses one "
+                                                   "per core.", in_process_recording_property_);
+  recording_workers_property_->setMin(0);
+
+  frames_in_flight_property_     = new IntProperty("Max Frames In Flight", 50,
+                                                   "Maximum number of published frames the recorder didn't "
+                                                   "acknowledge yet. Rendering blocks until the recorder catches up.",
+                                                   this);
+  frames_in_flight_property_->setMin(1);
+  frames_in_flight_property_->setMax(VIEW_IMAGE_QUEUE_SIZE);
   
   // TODO: latch?
   placement_pub_ = nh_.advertise<geometry_msgs::Pose>("/rviz/current_camera_pose", 1);
@@ -109,41 +188,99 @@ CinematographerViewController::CinematographerViewController()
   finished_rendering_trajectory_pub_ = nh_.advertise<rviz_cinematographer_msgs::Finished>("/rviz/finished_rendering_trajectory", 1);
   delete_pub_ = nh_.advertise<std_msgs::Empty>("/rviz/delete", 1);
 
-  image_transport::ImageTransport it(nh_);
-  image_pub_ = it.advertise("/rviz/view_image", 1);
+  image_pub_ = nh_.advertise<rviz_cinematographer_msgs::ViewImage>("/rviz/view_image", VIEW_IMAGE_QUEUE_SIZE);
 
   record_params_sub_ = nh_.subscribe("/rviz/record", 1, &CinematographerViewController::setRecord, this);
-  wait_duration_sub_ = nh_.subscribe("/video_recorder/wait_duration", 1,
-                                     &CinematographerViewController::setWaitDuration, this);
+
+  ros::SubscribeOptions frame_ack_options =
+    ros::SubscribeOptions::create<rviz_cinematographer_msgs::FrameAck>(
+      "/video_recorder/frame_ack", VIEW_IMAGE_QUEUE_SIZE,
+      boost::bind(&CinematographerViewController::frameAckCallback, this, _1), ros::VoidPtr(), &frame_ack_queue_);
+  frame_ack_sub_ = nh_.subscribe(frame_ack_options);
+  frame_ack_spinner_.start();
+  trajectory_spinner_.start();
 }
 
 CinematographerViewController::~CinematographerViewController()
 {
+  frame_ack_spinner_.stop();
+  frame_ack_sub_.shutdown();
+  trajectory_spinner_.stop();
+  trajectory_sub_.shutdown();
+
+  // let an in-process recording finish writing its video before the pipeline's threads are joined
+  if(recording_finisher_.joinable())
+    recording_finisher_.join();
+  pipeline_.reset();
+
+  destroyRecordingTarget();
   context_->getSceneManager()->destroySceneNode(attached_scene_node_);
 }
 
 void CinematographerViewController::setRecord(const rviz_cinematographer_msgs::Record::ConstPtr& record_params)
 {
   render_frame_by_frame_ = record_params->do_record > 0;
+  if(render_frame_by_frame_)
+  {
+    is_new_recording_ = true;
+    record_in_process_ = in_process_recording_property_->getBool();
+    if(record_in_process_)
+    {
+      use_shared_frames_ = false;
+      startInProcessRecording(*record_params);
+    }
+    else
+      openSharedFrames();
+
+    boost::mutex::scoped_lock lock(frame_ack_mutex_);
+    acked_seq_ = -1;
+    // conservative until the recorder announces its window with the first acknowledgement
+    ack_window_ = INITIAL_FRAME_ACK_WINDOW;
+    use_frame_acks_ = true;
+    recording_id_ = record_params->recording_id;
+    next_frame_seq_ = 0;
+  }
+
+  // the recorder encodes at the same rate
+  target_fps_ = video_recorder::recordingFps(*record_params);
+}
 
-  int max_fps = 120;
-  if(record_params->compress == 0)
-    max_fps = 60;
+void CinematographerViewController::frameAckCallback(const rviz_cinematographer_msgs::FrameAck::ConstPtr& ack)
+{
+  boost::mutex::scoped_lock lock(frame_ack_mutex_);
+  // acknowledgements left over from a previous recording don't grant credit
+  if(ack->recording_id != recording_id_ || !use_frame_acks_)
+    return;
 
-  target_fps_ = std::max(1, std::min(max_fps, (int)record_params->frames_per_second));
+  // acknowledgements may overtake each other - only move forward
+  if(static_cast<int64_t>(ack->seq) > acked_seq_)
+    acked_seq_ = ack->seq;
+  ack_window_ = ack->window;
+  frame_acked_.notify_all();
 }
 
-void CinematographerViewController::setWaitDuration(const rviz_cinematographer_msgs::Wait::ConstPtr& wait_duration)
+void CinematographerViewController::waitForFrameCredit(uint32_t seq)
 {
-  wait_duration_ = wait_duration->seconds;
-  do_wait_ = true;
+  boost::mutex::scoped_lock lock(frame_ack_mutex_);
+  uint32_t max_frames_in_flight = static_cast<uint32_t>(frames_in_flight_property_->getInt());
+  while(use_frame_acks_ && static_cast<int64_t>(seq) - acked_seq_ > std::min(ack_window_, max_frames_in_flight))
+  {
+    if(!frame_acked_.timed_wait(lock, boost::posix_time::milliseconds(static_cast<int>(FRAME_ACK_TIMEOUT * 1000))))
+    {
+      ROS_WARN_STREAM("The recorder didn't acknowledge a frame for " << FRAME_ACK_TIMEOUT << "s. Publishing the rest "
+                      << "of the recording without flow control.");
+      use_frame_acks_ = false;
+    }
+  }
 }
 
 void CinematographerViewController::updateTopics()
 {
-  trajectory_sub_ = nh_.subscribe<rviz_cinematographer_msgs::CameraTrajectory>
-                         (camera_trajectory_topic_property_->getStdString(), 1,
-                          boost::bind(&CinematographerViewController::cameraTrajectoryCallback, this, _1));
+  ros::SubscribeOptions trajectory_options =
+    ros::SubscribeOptions::create<rviz_cinematographer_msgs::CameraTrajectory>(
+      camera_trajectory_topic_property_->getStdString(), 1,
+      boost::bind(&CinematographerViewController::cameraTrajectoryCallback, this, _1), ros::VoidPtr(), &trajectory_queue_);
+  trajectory_sub_ = nh_.subscribe(trajectory_options);
 }
 
 void CinematographerViewController::onInitialize()
@@ -160,9 +297,6 @@ void CinematographerViewController::onInitialize()
   focal_shape_->setColor(1.0f, 1.0f, 0.0f, 0.5f);
   focal_shape_->getRootNode()->setVisible(false);
 
-  const unsigned long buffer_capacity = 100;
-  cam_movements_buffer_ = BufferCamMovements(buffer_capacity);
-  
   window_width_property_->setFloat(context_->getViewManager()->getRenderPanel()->getRenderWindow()->getWidth());
   window_height_property_->setFloat(context_->getViewManager()->getRenderPanel()->getRenderWindow()->getHeight());
 }
@@ -251,10 +385,16 @@ void CinematographerViewController::updateAttachedFrame()
 
 void CinematographerViewController::updateAttachedSceneNode()
 {
+  std::string attached_frame = attached_frame_property_->getFrameStd();
+  {
+    boost::mutex::scoped_lock lock(pending_trajectories_mutex_);
+    attached_frame_ = attached_frame;
+  }
+
   std::string error_msg;
-  if(!context_->getFrameManager()->transformHasProblems(attached_frame_property_->getFrameStd(), ros::Time(), error_msg))
+  if(!context_->getFrameManager()->transformHasProblems(attached_frame, ros::Time(), error_msg))
   {
-    context_->getFrameManager()->getTransform(attached_frame_property_->getFrameStd(), ros::Time(), reference_position_,
+    context_->getFrameManager()->getTransform(attached_frame, ros::Time(), reference_position_,
                                               reference_orientation_);
     attached_scene_node_->setPosition(reference_position_);
     attached_scene_node_->setOrientation(reference_orientation_);
@@ -499,42 +639,49 @@ void CinematographerViewController::beginNewTransition(const Ogre::Vector3& eye,
                                                        const Ogre::Vector3& focus,
                                                        const Ogre::Vector3& up,
                                                        ros::Duration transition_duration,
-                                                       uint8_t interpolation_speed)
+                                                       uint8_t interpolation_speed,
+                                                       bool is_spline)
 {
   // if jump was requested, perform as usual but prevent division by zero
   if(ros::Duration(transition_duration).isZero())
     transition_duration = ros::Duration(0.001);
 
-  // if the buffer is empty we set the first element in it to the current camera pose
-  if(cam_movements_buffer_.empty())
-  {
-    transition_start_time_ = ros::WallTime::now();
+  startTrajectoryIfIdle();
+  trajectory_.append(TrajectoryPlayer::Pose(eye, focus, up), transition_duration.toNSec(), interpolation_speed,
+                     is_spline);
 
-    cam_movements_buffer_.push_back(std::move(OgreCameraMovement(eye_point_property_->getVector(),
-                                                                 focus_point_property_->getVector(),
-                                                                 up_vector_property_->getVector(),
-                                                                 ros::Duration(0.001),
-                                                                 interpolation_speed))); // interpolation_speed doesn't make a difference for very short times
-  }
+  animate_ = true;
+}
 
-  if(cam_movements_buffer_.full())
-    cam_movements_buffer_.set_capacity(cam_movements_buffer_.capacity() + 20);
+void CinematographerViewController::startTrajectoryIfIdle()
+{
+  // if there is no movement yet, the trajectory starts at the current camera pose
+  if(!trajectory_.empty())
+    return;
 
-  cam_movements_buffer_.push_back(std::move(OgreCameraMovement(eye, focus, up, transition_duration, interpolation_speed)));
+  transition_start_time_ = ros::WallTime::now();
+  recorded_frames_counter_ = 0;
 
-  animate_ = true;
+  trajectory_.setStart(TrajectoryPlayer::Pose(eye_point_property_->getVector(),
+                                              focus_point_property_->getVector(),
+                                              up_vector_property_->getVector()));
 }
 
 void CinematographerViewController::cancelTransition()
 {
   animate_ = false;
-  cam_movements_buffer_.clear();
+  trajectory_.clear();
   recorded_frames_counter_ = 0;
 
   if(render_frame_by_frame_)
   {
+    publishPendingViewImages();
+    finishInProcessRecording();
+
     rviz_cinematographer_msgs::Finished finished;
     finished.is_finished = true;
+    finished.frame_count = next_frame_seq_;
+    finished.recording_id = recording_id_;
     finished_rendering_trajectory_pub_.publish(finished);
     render_frame_by_frame_ = false;
   }
@@ -542,64 +689,162 @@ void CinematographerViewController::cancelTransition()
 
 void CinematographerViewController::cameraTrajectoryCallback(const rviz_cinematographer_msgs::CameraTrajectoryConstPtr& ct_ptr)
 {
-  rviz_cinematographer_msgs::CameraTrajectory ct = *ct_ptr;
+  // the movements are read from the shared message and written straight into the trajectory, without copying it
+  const rviz_cinematographer_msgs::CameraTrajectory& ct = *ct_ptr;
 
   if(ct.trajectory.empty())
     return;
 
-  // Handle control parameters
-  mouse_enabled_property_->setBool(!ct.interaction_disabled);
-  fixed_up_property_->setBool(!ct.allow_free_yaw_axis);
-  if(ct.mouse_interaction_mode != rviz_cinematographer_msgs::CameraTrajectory::NO_CHANGE)
+  // a spline needs a pose to start at and the poses defining its direction at both ends
+  bool is_spline = ct.interpolation == rviz_cinematographer_msgs::CameraTrajectory::SPLINE;
+  if(is_spline && ct.trajectory.size() < 3)
   {
-    std::string name = "";
-    if(ct.mouse_interaction_mode == rviz_cinematographer_msgs::CameraTrajectory::ORBIT)
-      name = MODE_ORBIT;
-    else if(ct.mouse_interaction_mode == rviz_cinematographer_msgs::CameraTrajectory::FPS)
-      name = MODE_FPS;
-    interaction_mode_property_->setStdString(name);
+    ROS_WARN_STREAM("A spline needs at least three camera movements but the trajectory has "
+                    << ct.trajectory.size() << ". Ignoring it.");
+    return;
   }
 
-  for(auto& cam_movement : ct.trajectory)
+  auto block = boost::make_shared<TrajectoryBlock>();
+  block->interaction_disabled = ct.interaction_disabled;
+  block->allow_free_yaw_axis = ct.allow_free_yaw_axis;
+  block->mouse_interaction_mode = ct.mouse_interaction_mode;
+  block->attached_frame = ct.target_frame;
+  if(block->attached_frame.empty())
   {
-    transformCameraMovementToAttachedFrame(cam_movement);
+    boost::mutex::scoped_lock lock(pending_trajectories_mutex_);
+    block->attached_frame = attached_frame_;
+  }
+
+  // the movements of a trajectory usually share one frame, so it is looked up only once
+  AttachedFrameTransformCache transform_cache;
+  transform_cache.attached_frame = block->attached_frame;
 
-    if(ct.target_frame != "")
+  TrajectoryPlayer::Pose start_handle;
+
+  // the trajectory continues from wherever the camera is when it is played back
+  TrajectoryPlayer& trajectory = block->trajectory;
+  trajectory.reserve(ct.trajectory.size());
+  trajectory.setOpenStart();
+  for(size_t i = 0; i < ct.trajectory.size(); ++i)
+  {
+    const auto& cam_movement = ct.trajectory[i];
+
+    TrajectoryPlayer::Pose pose;
+    try
     {
-      attached_frame_property_->setStdString(ct.target_frame);
-      updateAttachedFrame();
+      pose = transformCameraMovementToAttachedFrame(cam_movement, transform_cache);
     }
+    catch(const tf2::TransformException& e)
+    {
+      ROS_ERROR_STREAM("Can't transform the camera trajectory into " << block->attached_frame << ": " << e.what()
+                       << ". Ignoring it.");
+      return;
+    }
+    int64_t duration = cam_movement.transition_duration.toNSec();
 
-    Ogre::Vector3 eye = vectorFromMsg(cam_movement.eye.point);
-    Ogre::Vector3 focus = vectorFromMsg(cam_movement.focus.point);
-    Ogre::Vector3 up = vectorFromMsg(cam_movement.up.vector);
-    beginNewTransition(eye, focus, up, cam_movement.transition_duration, cam_movement.interpolation_speed);
+    if(!is_spline)
+    {
+      trajectory.append(pose, duration, cam_movement.interpolation_speed);
+    }
+    else if(i == 0)
+    {
+      start_handle = pose;
+    }
+    else if(i == 1)
+    {
+      // move linearly to the start of the spline
+      trajectory.append(pose, duration, cam_movement.interpolation_speed);
+      trajectory.addSplineHandle(start_handle);
+    }
+    else if(i + 1 < ct.trajectory.size())
+    {
+      trajectory.append(pose, duration, cam_movement.interpolation_speed, true);
+    }
+    else
+    {
+      trajectory.addSplineHandle(pose);
+    }
   }
+
+  // the render thread only has to take the prepared trajectory
+  boost::mutex::scoped_lock lock(pending_trajectories_mutex_);
+  pending_trajectories_.push_back(block);
 }
 
-void CinematographerViewController::transformCameraMovementToAttachedFrame(rviz_cinematographer_msgs::CameraMovement& cm)
+void CinematographerViewController::beginPendingTrajectories()
 {
-  Ogre::Vector3 position_fixed_eye, position_fixed_focus, position_fixed_up;
-  Ogre::Quaternion rotation_fixed_eye, rotation_fixed_focus, rotation_fixed_up;
+  std::vector<boost::shared_ptr<TrajectoryBlock>> blocks;
+  {
+    boost::mutex::scoped_lock lock(pending_trajectories_mutex_);
+    blocks.swap(pending_trajectories_);
+  }
 
-  context_->getFrameManager()->getTransform(cm.eye.header.frame_id,   ros::Time(0), position_fixed_eye,   rotation_fixed_eye);
-  context_->getFrameManager()->getTransform(cm.focus.header.frame_id, ros::Time(0), position_fixed_focus, rotation_fixed_focus);
-  context_->getFrameManager()->getTransform(cm.up.header.frame_id,    ros::Time(0), position_fixed_up,    rotation_fixed_up);
+  for(const auto& block : blocks)
+    beginTrajectory(*block);
+}
 
-  Ogre::Vector3 eye = vectorFromMsg(cm.eye.point);
-  Ogre::Vector3 focus = vectorFromMsg(cm.focus.point);
-  Ogre::Vector3 up = vectorFromMsg(cm.up.vector);
+void CinematographerViewController::beginTrajectory(const TrajectoryBlock& block)
+{
+  // Handle control parameters
+  mouse_enabled_property_->setBool(!block.interaction_disabled);
+  fixed_up_property_->setBool(!block.allow_free_yaw_axis);
+  if(block.mouse_interaction_mode != rviz_cinematographer_msgs::CameraTrajectory::NO_CHANGE)
+  {
+    std::string name = "";
+    if(block.mouse_interaction_mode == rviz_cinematographer_msgs::CameraTrajectory::ORBIT)
+      name = MODE_ORBIT;
+    else if(block.mouse_interaction_mode == rviz_cinematographer_msgs::CameraTrajectory::FPS)
+      name = MODE_FPS;
+    interaction_mode_property_->setStdString(name);
+  }
 
-  eye = fixedFrameToAttachedLocal(position_fixed_eye + rotation_fixed_eye * eye);
-  focus = fixedFrameToAttachedLocal(position_fixed_focus + rotation_fixed_focus * focus);
-  up = reference_orientation_.Inverse() * rotation_fixed_up * up;
+  // switch to the target frame or back to the frame the movements were transformed into, if it changed meanwhile
+  if(block.attached_frame != attached_frame_property_->getFrameStd())
+  {
+    attached_frame_property_->setStdString(block.attached_frame);
+    updateAttachedFrame();
+  }
+
+  startTrajectoryIfIdle();
+  trajectory_.append(block.trajectory);
+
+  animate_ = true;
+}
+
+const AttachedFrameTransform&
+CinematographerViewController::transformToAttachedFrame(const std::string& frame_id,
+                                                       AttachedFrameTransformCache& cache) const
+{
+  auto cached = cache.transforms.find(frame_id);
+  if(cached != cache.transforms.end())
+    return cached->second;
+
+  // the latest transform, like rviz' FrameManager with ros::Time(0)
+  geometry_msgs::TransformStamped transform_msg =
+    tf_buffer_.lookupTransform(cache.attached_frame, frame_id, ros::Time(0), ros::Duration(TRANSFORM_TIMEOUT));
+
+  AttachedFrameTransform& transform = cache.transforms[frame_id];
+  transform.position = Ogre::Vector3(static_cast<float>(transform_msg.transform.translation.x),
+                                     static_cast<float>(transform_msg.transform.translation.y),
+                                     static_cast<float>(transform_msg.transform.translation.z));
+  transform.orientation = Ogre::Quaternion(static_cast<float>(transform_msg.transform.rotation.w),
+                                           static_cast<float>(transform_msg.transform.rotation.x),
+                                           static_cast<float>(transform_msg.transform.rotation.y),
+                                           static_cast<float>(transform_msg.transform.rotation.z));
+  return transform;
+}
+
+TrajectoryPlayer::Pose
+CinematographerViewController::transformCameraMovementToAttachedFrame(const rviz_cinematographer_msgs::CameraMovement& cm,
+                                                                      AttachedFrameTransformCache& cache) const
+{
+  const AttachedFrameTransform& eye_transform = transformToAttachedFrame(cm.eye.header.frame_id, cache);
+  const AttachedFrameTransform& focus_transform = transformToAttachedFrame(cm.focus.header.frame_id, cache);
+  const AttachedFrameTransform& up_transform = transformToAttachedFrame(cm.up.header.frame_id, cache);
 
-  cm.eye.point = pointOgreToMsg(eye);
-  cm.focus.point = pointOgreToMsg(focus);
-  cm.up.vector = vectorOgreToMsg(up);
-  cm.eye.header.frame_id = attached_frame_property_->getStdString();
-  cm.focus.header.frame_id = attached_frame_property_->getStdString();
-  cm.up.header.frame_id = attached_frame_property_->getStdString();
+  return TrajectoryPlayer::Pose(eye_transform.position + eye_transform.orientation * vectorFromMsg(cm.eye.point),
+                                focus_transform.position + focus_transform.orientation * vectorFromMsg(cm.focus.point),
+                                up_transform.orientation * vectorFromMsg(cm.up.vector));
 }
 
 // We must assume that this point is in the Rviz Fixed frame since it came from Rviz...
@@ -638,58 +883,45 @@ void CinematographerViewController::publishOdometry(const Ogre::Vector3& positio
   odometry_pub_.publish(odometry);
 }
 
-float CinematographerViewController::computeRelativeProgressInSpace(double relative_progress_in_time,
-                                                                    uint8_t interpolation_speed)
+int64_t CinematographerViewController::advanceRecordingTimeline()
 {
-  switch(interpolation_speed)
-  {
-    case rviz_cinematographer_msgs::CameraMovement::RISING:
-      return 1.f - static_cast<float>(cos(relative_progress_in_time * M_PI_2));
-    case rviz_cinematographer_msgs::CameraMovement::DECLINING:
-      return static_cast<float>(-cos(relative_progress_in_time * M_PI_2 + M_PI_2));
-    case rviz_cinematographer_msgs::CameraMovement::FULL:
-      return static_cast<float>(relative_progress_in_time);
-    case rviz_cinematographer_msgs::CameraMovement::WAVE:
-    default:
-      return 0.5f * (1.f - static_cast<float>(cos(relative_progress_in_time * M_PI)));
-  }
+  // frame times are computed from the frame index, so rounding errors don't add up over many movements
+  recorded_frames_counter_++;
+  int64_t frame_time = recorded_frames_counter_ * 1000000000 / target_fps_;
+
+  // the last frame is the one closest to the planned end of the trajectory
+  int64_t end_time = trajectory_.duration();
+  int64_t last_frame = (end_time * target_fps_ + 500000000) / 1000000000;
+  if(recorded_frames_counter_ >= last_frame)
+    return end_time;
+
+  return std::min(frame_time, end_time);
 }
 
 void CinematographerViewController::update(float dt, float ros_dt)
 {
   updateAttachedSceneNode();
+  beginPendingTrajectories();
 
-  // there has to be at least two positions in the buffer - start and goal
-  if(animate_ && cam_movements_buffer_.size() > 1)
+  if(animate_ && !trajectory_.empty())
   {
-    auto start = cam_movements_buffer_.begin();
-    auto goal = ++(cam_movements_buffer_.begin());
-
-    double relative_progress_in_time = 0.0;
+    int64_t time = 0;
     if(render_frame_by_frame_)
-    {
-      relative_progress_in_time = recorded_frames_counter_ / (target_fps_ * goal->transition_duration.toSec());
-      recorded_frames_counter_++;
-    }
+      time = advanceRecordingTimeline();
     else
-    {
-      ros::WallDuration duration_from_start = ros::WallTime::now() - transition_start_time_;
-      relative_progress_in_time = duration_from_start.toSec() / goal->transition_duration.toSec();
-    }
+      time = (ros::WallTime::now() - transition_start_time_).toNSec();
 
     // make sure we get all the way there before turning off
-    if(relative_progress_in_time >= 1.0)
+    if(time >= trajectory_.duration())
     {
-      relative_progress_in_time = 1.0;
+      time = trajectory_.duration();
       animate_ = false;
     }
 
-    float relative_progress_in_space = computeRelativeProgressInSpace(relative_progress_in_time,
-                                                                      goal->interpolation_speed);
-
-    Ogre::Vector3 new_position = start->eye + relative_progress_in_space * (goal->eye - start->eye);
-    Ogre::Vector3 new_focus = start->focus + relative_progress_in_space * (goal->focus - start->focus);
-    Ogre::Vector3 new_up = start->up + relative_progress_in_space * (goal->up - start->up);
+    TrajectoryPlayer::Pose pose = trajectory_.poseAt(time);
+    Ogre::Vector3 new_position = pose.eye;
+    Ogre::Vector3 new_focus = pose.focus;
+    Ogre::Vector3 new_up = pose.up;
 
     Ogre::Vector3 velocity = (new_position - eye_point_property_->getVector()) / ros_dt;
     transition_velocity_property_->setFloat(velocity.normalise());
@@ -710,39 +942,28 @@ void CinematographerViewController::update(float dt, float ros_dt)
 
     publishCameraPose();
 
-    if(render_frame_by_frame_ && image_pub_.getNumSubscribers() > 0)
+    if(render_frame_by_frame_ && (record_in_process_ || image_pub_.getNumSubscribers() > 0))
       publishViewImage();
 
-    // if current movement is over
+    // if the trajectory is over
     if(!animate_)
     {
-      // delete current start element in buffer
-      cam_movements_buffer_.pop_front();
-      recorded_frames_counter_ = 0;
+      // clean up
+      trajectory_.clear();
 
-      // if there are still movements to perform
-      if(cam_movements_buffer_.size() > 1)
-      {
-        // reset animate to perform the next movement
-        animate_ = true;
-        // update the transition start time with the duration the transition should have taken
-        transition_start_time_ += ros::WallDuration(cam_movements_buffer_.front().transition_duration.toSec());
-      }
-      else
+      // publish that the rendering is finished 
+      if(render_frame_by_frame_)
       {
-        // clean up
-        cam_movements_buffer_.clear();
-
-        // publish that the rendering is finished 
-        if(render_frame_by_frame_)
-        {
-          rviz_cinematographer_msgs::Finished finished;
-          finished.is_finished = true;
-          // wait a little so last image is send before this "finished"-message 
-          ros::WallRate r(1); r.sleep();
-          finished_rendering_trajectory_pub_.publish(finished);
-          render_frame_by_frame_ = false;
-        }
+        publishPendingViewImages();
+        finishInProcessRecording();
+
+        rviz_cinematographer_msgs::Finished finished;
+        finished.is_finished = true;
+        // the recorder waits for this number of frames - no need to delay the message until the last one arrived
+        finished.frame_count = next_frame_seq_;
+        finished.recording_id = recording_id_;
+        finished_rendering_trajectory_pub_.publish(finished);
+        render_frame_by_frame_ = false;
       }
     }
   }
@@ -757,41 +978,403 @@ void CinematographerViewController::update(float dt, float ros_dt)
 
 void CinematographerViewController::publishViewImage()
 {
-  // wait for specified duration - e.g. if recorder is not fast enough
-  if(do_wait_)
+  // settings of the recording target are only applied between recordings
+  if(is_new_recording_)
   {
-    ros::WallRate r(1.f / wait_duration_);
-    r.sleep();
-    do_wait_ = false;
+    publishPendingViewImages();
+    updateRecordingTarget();
+    is_new_recording_ = false;
   }
 
-  unsigned int height = context_->getViewManager()->getRenderPanel()->getRenderWindow()->getHeight();
-  unsigned int width = context_->getViewManager()->getRenderPanel()->getRenderWindow()->getWidth();
+  Ogre::RenderTarget* target = context_->getViewManager()->getRenderPanel()->getRenderWindow();
+  if(!recording_texture_.isNull())
+  {
+    target = recording_texture_->getBuffer()->getRenderTarget();
+    renderRecordingTarget();
+  }
+
+  unsigned int height = target->getHeight();
+  unsigned int width = target->getWidth();
+
+  if(useAsyncReadback())
+  {
+    // start transferring the current frame and publish the oldest one once the ring is full
+    if(!recording_texture_.isNull())
+      frame_reader_.requestTexture(recording_texture_id_, width, height);
+    else
+      frame_reader_.requestFrame(width, height);
+
+    publishRetrievedFrame(false);
+    return;
+  }
+
+  // keep the order of frames if asynchronous readback was just switched off
+  publishPendingViewImages();
 
-  // create a PixelBox of the needed size to store the rendered image
   Ogre::PixelFormat format = Ogre::PF_BYTE_BGR;
-  auto outBytesPerPixel = Ogre::PixelUtil::getNumElemBytes(format);
-  auto data = new unsigned char[width * height * outBytesPerPixel];
   Ogre::Box extents(0, 0, width, height);
+  if(recording_supersampling_ > 1)
+  {
+    sensor_msgs::Image& supersampled = supersampledImage();
+    supersampled.height = height;
+    supersampled.width = width;
+    supersampled.step = width * 3;
+    supersampled.data.resize(static_cast<size_t>(supersampled.step) * height);
+
+    Ogre::PixelBox pb(extents, format, supersampled.data.data());
+    target->copyContentsToMemory(pb, Ogre::RenderTarget::FB_AUTO);
+    publishDownscaledViewImage(supersampled);
+    return;
+  }
+
+  // read the rendered image directly into the published memory
+  unsigned char* data = beginViewImage(width, height);
   Ogre::PixelBox pb(extents, format, data);
-  context_->getViewManager()->getRenderPanel()->getRenderWindow()->copyContentsToMemory(pb, Ogre::RenderTarget::FB_AUTO);
-
-  // convert the image in the PixelBox to a sensor_msgs::Image and publish
-  sensor_msgs::ImagePtr ros_image = sensor_msgs::ImagePtr(new sensor_msgs::Image());;
-  ros_image->header.frame_id = attached_frame_property_->getStdString();
-  ros_image->header.stamp = ros::Time::now();
-  ros_image->height = height;
-  ros_image->width = width;
-  ros_image->encoding = sensor_msgs::image_encodings::BGR8;
-  ros_image->is_bigendian = false;
-  ros_image->step = static_cast<unsigned int>(width * outBytesPerPixel);
-  size_t size = width * outBytesPerPixel * height;
-  ros_image->data.resize(size);
-  memcpy((char*)(&ros_image->data[0]), data, size);
-
-  image_pub_.publish(ros_image);
-
-  delete[] data;
+  target->copyContentsToMemory(pb, Ogre::RenderTarget::FB_AUTO);
+  endViewImage();
+}
+
+bool CinematographerViewController::publishRetrievedFrame(bool flush)
+{
+  unsigned int width = 0, height = 0;
+  if(!frame_reader_.nextFrameSize(width, height, flush))
+    return false;
+
+  if(recording_supersampling_ > 1)
+  {
+    sensor_msgs::Image& supersampled = supersampledImage();
+    if(frame_reader_.retrieveFrame(supersampled, flush))
+      publishDownscaledViewImage(supersampled);
+    return true;
+  }
+
+  unsigned char* data = beginViewImage(width, height);
+  if(frame_reader_.retrieveFrame(data, flush))
+    endViewImage();
+  else
+    cancelViewImage();
+  return true;
+}
+
+void CinematographerViewController::publishDownscaledViewImage(sensor_msgs::Image& supersampled)
+{
+  unsigned int width = supersampled.width / recording_supersampling_;
+  unsigned int height = supersampled.height / recording_supersampling_;
+  unsigned char* data = beginViewImage(width, height);
+
+  // area interpolation averages all samples belonging to an output pixel
+  cv::Mat source(supersampled.height, supersampled.width, CV_8UC3, supersampled.data.data(), supersampled.step);
+  cv::Mat downscaled(height, width, CV_8UC3, data, width * 3);
+  cv::resize(source, downscaled, downscaled.size(), 0, 0, cv::INTER_AREA);
+
+  endViewImage();
+}
+
+sensor_msgs::Image& CinematographerViewController::supersampledImage()
+{
+  // supersampled images are never published - read them into the same buffer every time
+  if(!supersampled_image_)
+    supersampled_image_.reset(new sensor_msgs::Image());
+  return *supersampled_image_;
+}
+
+unsigned char* CinematographerViewController::beginViewImage(unsigned int width, unsigned int height)
+{
+  if(use_shared_frames_)
+  {
+    size_t frame_bytes = static_cast<size_t>(width) * height * 3;
+    // blocks while the recorder holds all slots - that's the flow control of the shared memory transport
+    while(frame_bytes <= shared_frames_.maxFrameBytes())
+    {
+      unsigned char* data = shared_frames_.beginWrite(width, height, ros::WallDuration(1.0));
+      if(data)
+        return data;
+      if(!shared_frames_.isReaderAlive())
+        break;
+    }
+
+    ROS_WARN_STREAM("Can't write " << width << "x" << height << " frame into shared memory. Publishing the rest of "
+                    << "the recording on " << image_pub_.getTopic() << ".");
+    use_shared_frames_ = false;
+
+    // frames passed through shared memory don't need credit
+    boost::mutex::scoped_lock lock(frame_ack_mutex_);
+    acked_seq_ = static_cast<int64_t>(next_frame_seq_) - 1;
+  }
+
+  current_view_image_ = acquireViewImage();
+  sensor_msgs::Image& image = current_view_image_->image;
+  image.height = height;
+  image.width = width;
+  image.encoding = sensor_msgs::image_encodings::BGR8;
+  image.is_bigendian = false;
+  image.step = width * 3;
+  // doesn't allocate if a recycled image of the same size is used
+  image.data.resize(static_cast<size_t>(image.step) * height);
+  return image.data.data();
+}
+
+void CinematographerViewController::endViewImage()
+{
+  // frames are numbered across all transports, so the recorder notices missing ones
+  uint32_t seq = next_frame_seq_++;
+
+  if(!current_view_image_)
+  {
+    shared_frames_.endWrite(ros::Time::now(), seq);
+    return;
+  }
+
+  if(record_in_process_)
+  {
+    video_recorder::Frame frame;
+    sensor_msgs::Image& image = current_view_image_->image;
+    frame.image = cv::Mat(image.height, image.width, CV_8UC3, image.data.data(), image.step);
+    // the pooled image isn't reused before the pipeline dropped it, so the watermark is drawn into it in place
+    frame.image_owner = current_view_image_;
+    frame.is_writable = true;
+    current_view_image_.reset();
+
+    // blocks while the intake queue is full
+    if(!pipeline_->push(std::move(frame)))
+      ROS_WARN("Encoding pipeline is shutting down. Dropping image.");
+    return;
+  }
+
+  // keep at most the recorder's window of frames in flight
+  waitForFrameCredit(seq);
+
+  // roscpp overwrites header.seq with its own counter - the message carries the index within the recording
+  current_view_image_->seq = seq;
+  current_view_image_->recording_id = recording_id_;
+  current_view_image_->image.header.frame_id = attached_frame_property_->getStdString();
+  current_view_image_->image.header.stamp = ros::Time::now();
+  image_pub_.publish(current_view_image_);
+  current_view_image_.reset();
+}
+
+void CinematographerViewController::cancelViewImage()
+{
+  if(!current_view_image_)
+    shared_frames_.cancelWrite();
+  current_view_image_.reset();
+}
+
+void CinematographerViewController::openSharedFrames()
+{
+  use_shared_frames_ = false;
+  if(!shared_memory_property_->getBool())
+    return;
+
+  // the recorder creates the segment - reopen it for every recording in case the recorder was restarted
+  use_shared_frames_ = shared_frames_.open(shared_memory_name_property_->getStdString()) &&
+                       shared_frames_.isReaderAlive();
+  if(use_shared_frames_)
+    ROS_INFO_STREAM("Passing recorded frames through shared memory " << shared_memory_name_property_->getStdString()
+                    << ".");
+  else
+    ROS_INFO_STREAM("No recorder is reading shared memory " << shared_memory_name_property_->getStdString()
+                    << ". Publishing recorded frames on " << image_pub_.getTopic() << ".");
+}
+
+void CinematographerViewController::startInProcessRecording(const rviz_cinematographer_msgs::Record& record_params)
+{
+  // the pipeline starts the next recording only after the previous one is written completely
+  if(recording_finisher_.joinable())
+  {
+    ROS_INFO("Waiting until the previous recording is written.");
+    recording_finisher_.join();
+  }
+
+  size_t queue_size = static_cast<size_t>(recording_queue_size_property_->getInt());
+  unsigned int num_workers = static_cast<unsigned int>(recording_workers_property_->getInt());
+  if(!pipeline_ || pipeline_->queueCapacity() != queue_size || pipeline_num_workers_ != num_workers)
+  {
+    pipeline_.reset();
+    pipeline_.reset(new video_recorder::EncodingPipeline(queue_size, num_workers));
+    pipeline_num_workers_ = num_workers;
+    ROS_INFO_STREAM("In-process encoding pipeline uses " << pipeline_->numWorkers() << " worker threads.");
+  }
+
+  if(!recording_params_.watermarks)
+  {
+    loadWatermark();
+    record_finished_pub_ = nh_.advertise<rviz_cinematographer_msgs::Finished>("/video_recorder/record_finished", 1);
+  }
+
+  // compressed recordings use the recorder's default codec
+  video_recorder::setRecordingParameters(record_params, video_recorder::EncoderParameters().codec, recording_params_);
+  if(recording_params_.add_watermark && recording_params_.watermarks->empty())
+    ROS_WARN("No watermark loaded. Recording without watermark.");
+
+  pipeline_->start(recording_params_);
+}
+
+void CinematographerViewController::finishInProcessRecording()
+{
+  if(!record_in_process_)
+    return;
+  record_in_process_ = false;
+
+  // encoding the queued frames may take a while - keep rendering meanwhile
+  recording_finisher_ = boost::thread(boost::bind(&CinematographerViewController::writeRemainingFrames, this,
+                                                  recording_id_));
+}
+
+void CinematographerViewController::writeRemainingFrames(uint32_t recording_id)
+{
+  video_recorder::PipelineStats stats = pipeline_->finish();
+  ROS_INFO_STREAM("Recorded " << stats.frames_written << " frames in " << stats.duration << "s ("
+                  << (stats.duration > 0.0 ? stats.frames_written / stats.duration : 0.0) << " fps) to "
+                  << recording_params_.path_to_output << ".");
+
+  rviz_cinematographer_msgs::Finished record_finished;
+  record_finished.is_finished = true;
+  record_finished.frame_count = static_cast<uint32_t>(stats.frames_written);
+  record_finished.recording_id = recording_id;
+  record_finished_pub_.publish(record_finished);
+}
+
+void CinematographerViewController::loadWatermark()
+{
+  recording_params_.watermarks = boost::make_shared<video_recorder::WatermarkCache>();
+
+  std::string path_to_watermark = ros::package::getPath("video_recorder");
+  if(path_to_watermark.empty())
+  {
+    ROS_ERROR("Can't find path to video_recorder to load watermark.");
+    return;
+  }
+  path_to_watermark += "/watermark/watermark.png";
+
+  if(!recording_params_.watermarks->load(path_to_watermark))
+    ROS_ERROR_STREAM("Could not load watermark from " << path_to_watermark << ". Expected a BGRA image.");
+}
+
+void CinematographerViewController::updateRecordingTarget()
+{
+  recording_supersampling_ = 1;
+  if(!offscreen_recording_property_->getBool())
+  {
+    destroyRecordingTarget();
+    return;
+  }
+
+  unsigned int supersampling = static_cast<unsigned int>(supersampling_property_->getInt());
+  unsigned int width = static_cast<unsigned int>(recording_width_property_->getInt()) * supersampling;
+  unsigned int height = static_cast<unsigned int>(recording_height_property_->getInt()) * supersampling;
+
+  if(recording_texture_.isNull() || recording_texture_->getWidth() != width || recording_texture_->getHeight() != height)
+  {
+    destroyRecordingTarget();
+
+    std::stringstream texture_name;
+    texture_name << "CinematographerRecordingTexture" << this;
+    try
+    {
+      recording_texture_ = Ogre::TextureManager::getSingleton().createManual(
+        texture_name.str(), Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME, Ogre::TEX_TYPE_2D,
+        width, height, 0, Ogre::PF_R8G8B8, Ogre::TU_RENDERTARGET);
+    }
+    catch(const Ogre::Exception& e)
+    {
+      ROS_ERROR_STREAM("Could not create offscreen render target of size " << width << "x" << height << " : "
+                       << e.what() << " Recording the render window instead.");
+      recording_texture_.setNull();
+      return;
+    }
+
+    Ogre::RenderTexture* target = recording_texture_->getBuffer()->getRenderTarget();
+    target->setAutoUpdated(false);
+    Ogre::Viewport* window_viewport = context_->getViewManager()->getRenderPanel()->getRenderWindow()->getViewport(0);
+    Ogre::Viewport* viewport = target->addViewport(camera_);
+    viewport->setClearEveryFrame(true);
+    viewport->setVisibilityMask(window_viewport->getVisibilityMask());
+    viewport->setOverlaysEnabled(false);
+
+    recording_texture_id_ = 0;
+    recording_texture_->getCustomAttribute("GLID", &recording_texture_id_);
+  }
+
+  recording_supersampling_ = supersampling;
+}
+
+void CinematographerViewController::renderRecordingTarget()
+{
+  Ogre::RenderTexture* target = recording_texture_->getBuffer()->getRenderTarget();
+  Ogre::Viewport* window_viewport = context_->getViewManager()->getRenderPanel()->getRenderWindow()->getViewport(0);
+  target->getViewport(0)->setBackgroundColour(window_viewport->getBackgroundColour());
+
+  // the camera is only moved at the end of update() - render the current pose
+  updateCamera();
+
+  // the camera's aspect ratio belongs to the render window
+  Ogre::Real aspect_ratio = camera_->getAspectRatio();
+  camera_->setAspectRatio(static_cast<Ogre::Real>(target->getWidth()) / static_cast<Ogre::Real>(target->getHeight()));
+  target->update();
+  camera_->setAspectRatio(aspect_ratio);
+}
+
+void CinematographerViewController::destroyRecordingTarget()
+{
+  if(recording_texture_.isNull())
+    return;
+
+  Ogre::TextureManager::getSingleton().remove(recording_texture_->getHandle());
+  recording_texture_.setNull();
+  recording_texture_id_ = 0;
+}
+
+rviz_cinematographer_msgs::ViewImagePtr CinematographerViewController::acquireViewImage()
+{
+  // an image is free again once the publisher and all intra-process subscribers released it
+  for(const auto& image : view_image_pool_)
+    if(image.use_count() == 1)
+      return image;
+
+  // in-process recordings hold on to as many images as the pipeline queues
+  size_t max_pool_size = VIEW_IMAGE_POOL_SIZE;
+  if(record_in_process_)
+    max_pool_size += pipeline_->queueCapacity() + pipeline_->numWorkers();
+
+  rviz_cinematographer_msgs::ViewImagePtr image(new rviz_cinematographer_msgs::ViewImage());
+  if(view_image_pool_.size() < max_pool_size)
+    view_image_pool_.push_back(image);
+  return image;
+}
+
+void CinematographerViewController::publishPendingViewImages()
+{
+  if(frame_reader_.pending() == 0)
+    return;
+
+  Ogre::RenderWindow* window = context_->getViewManager()->getRenderPanel()->getRenderWindow();
+  Ogre::Root::getSingleton().getRenderSystem()->_setViewport(window->getViewport(0));
+
+  while(publishRetrievedFrame(true))
+    ;
+}
+
+bool CinematographerViewController::useAsyncReadback()
+{
+  if(!async_readback_property_->getBool())
+    return false;
+
+  // rviz may render several windows - make sure the GL calls address the context of the render panel
+  Ogre::RenderWindow* window = context_->getViewManager()->getRenderPanel()->getRenderWindow();
+  Ogre::Root::getSingleton().getRenderSystem()->_setViewport(window->getViewport(0));
+
+  if(!frame_reader_initialized_)
+  {
+    frame_reader_initialized_ = true;
+    if(frame_reader_.initialize())
+      ROS_INFO_STREAM("Reading recorded frames back asynchronously from renderer " << frame_reader_.renderer() << ".");
+    else
+      ROS_WARN_STREAM("Asynchronous readback is not available with renderer '" << frame_reader_.renderer()
+                      << "'. Falling back to synchronous readback.");
+  }
+
+  return frame_reader_.isAvailable();
 }
 
 void CinematographerViewController::updateCamera()
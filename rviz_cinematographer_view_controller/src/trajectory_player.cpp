@@ -0,0 +1,229 @@
+/** @file
+ *
+ * Continuous representation of a camera trajectory that can be evaluated at any point in time.
+ *
+ * @author Jan Razlaw
+ */
+
+#include "rviz_cinematographer_view_controller/trajectory_player.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <rviz_cinematographer_msgs/CameraMovement.h>
+
+namespace rviz_cinematographer_view_controller
+{
+
+/** @brief Evaluates the uniform Catmull-Rom segment between p1 and p2. */
+static Ogre::Vector3 catmullRom(const Ogre::Vector3& p0,
+                                const Ogre::Vector3& p1,
+                                const Ogre::Vector3& p2,
+                                const Ogre::Vector3& p3,
+                                float t)
+{
+  float t2 = t * t;
+  float t3 = t2 * t;
+  return 0.5f * (2.f * p1 +
+                 (p2 - p0) * t +
+                 (2.f * p0 - 5.f * p1 + 4.f * p2 - p3) * t2 +
+                 (3.f * p1 - p0 - 3.f * p2 + p3) * t3);
+}
+
+/** @brief Makes room for at least size elements, at least doubling the capacity if it has to grow.
+ *
+ * Reserving the exact size for each appended trajectory would reallocate every time - quadratic in total.
+ */
+template<typename T>
+static void reserveGrowing(std::vector<T>& elements, size_t size)
+{
+  if(size > elements.capacity())
+    elements.reserve(std::max(size, 2 * elements.capacity()));
+}
+
+TrajectoryPlayer::TrajectoryPlayer()
+  : end_pose_(0)
+    , last_spline_(-1)
+    , spline_handle_(-1)
+    , is_start_open_(false)
+{
+}
+
+void TrajectoryPlayer::clear()
+{
+  poses_.clear();
+  movements_.clear();
+  end_pose_ = 0;
+  last_spline_ = -1;
+  spline_handle_ = -1;
+  is_start_open_ = false;
+}
+
+void TrajectoryPlayer::reserve(size_t movement_count)
+{
+  // besides the goals, a trajectory message adds at most its start and the two handles of its spline
+  reserveGrowing(movements_, movements_.size() + movement_count);
+  reserveGrowing(poses_, poses_.size() + movement_count + 3);
+}
+
+void TrajectoryPlayer::setStart(const Pose& start)
+{
+  clear();
+  poses_.push_back(start);
+}
+
+void TrajectoryPlayer::setOpenStart()
+{
+  clear();
+  poses_.push_back(Pose(Ogre::Vector3::ZERO, Ogre::Vector3::ZERO, Ogre::Vector3::UNIT_Z));
+  is_start_open_ = true;
+}
+
+void TrajectoryPlayer::append(const Pose& goal,
+                              int64_t duration,
+                              uint8_t interpolation_speed,
+                              bool is_spline)
+{
+  if(poses_.empty())
+    poses_.push_back(goal);
+
+  Movement movement;
+  movement.duration = std::max<int64_t>(1, duration);
+  movement.end_time = this->duration() + movement.duration;
+  movement.start = end_pose_;
+  movement.interpolation_speed = interpolation_speed;
+
+  // waiting at a pose keeps the spline open, so it continues smoothly afterwards
+  // the placeholder of an open start can't be held at
+  bool is_hold = !(is_start_open_ && movements_.empty()) && goal.positionEquals(poses_[end_pose_]);
+  movement.is_spline = is_spline && !is_hold;
+
+  if(!is_hold)
+  {
+    poses_.push_back(goal);
+    end_pose_ = static_cast<uint32_t>(poses_.size() - 1);
+  }
+  movement.goal = end_pose_;
+  movement.before = movement.start;
+  movement.after = movement.goal;
+
+  if(movement.is_spline)
+  {
+    if(last_spline_ >= 0)
+    {
+      movement.before = movements_[last_spline_].start;
+      movements_[last_spline_].after = movement.goal;
+    }
+    else if(spline_handle_ >= 0)
+    {
+      movement.before = static_cast<uint32_t>(spline_handle_);
+    }
+    last_spline_ = static_cast<int64_t>(movements_.size());
+    spline_handle_ = -1;
+  }
+  else if(!is_hold)
+  {
+    last_spline_ = -1;
+    spline_handle_ = -1;
+  }
+
+  movements_.push_back(movement);
+}
+
+void TrajectoryPlayer::append(const TrajectoryPlayer& other)
+{
+  if(other.empty())
+    return;
+
+  if(poses_.empty())
+    poses_.push_back(other.poses_.front());
+
+  // the open start of the other trajectory becomes the end of this one
+  uint32_t start = end_pose_;
+  uint32_t pose_offset = static_cast<uint32_t>(poses_.size() - 1);
+  auto poseIndex = [start, pose_offset](uint32_t index) { return index == 0 ? start : index + pose_offset; };
+  int64_t time_offset = duration();
+  int64_t movement_offset = static_cast<int64_t>(movements_.size());
+
+  reserveGrowing(poses_, poses_.size() + other.poses_.size() - 1);
+  poses_.insert(poses_.end(), other.poses_.begin() + 1, other.poses_.end());
+  reserveGrowing(movements_, movements_.size() + other.movements_.size());
+  for(Movement movement : other.movements_)
+  {
+    movement.end_time += time_offset;
+    movement.before = poseIndex(movement.before);
+    movement.start = poseIndex(movement.start);
+    movement.goal = poseIndex(movement.goal);
+    movement.after = poseIndex(movement.after);
+    movements_.push_back(movement);
+  }
+
+  end_pose_ = poseIndex(other.end_pose_);
+  last_spline_ = other.last_spline_ >= 0 ? other.last_spline_ + movement_offset : -1;
+  spline_handle_ = other.spline_handle_ >= 0 ? poseIndex(static_cast<uint32_t>(other.spline_handle_)) : -1;
+}
+
+void TrajectoryPlayer::addSplineHandle(const Pose& handle)
+{
+  poses_.push_back(handle);
+  uint32_t handle_index = static_cast<uint32_t>(poses_.size() - 1);
+
+  if(last_spline_ >= 0)
+  {
+    movements_[last_spline_].after = handle_index;
+    last_spline_ = -1;
+  }
+  else
+  {
+    spline_handle_ = handle_index;
+  }
+}
+
+TrajectoryPlayer::Pose TrajectoryPlayer::poseAt(int64_t time) const
+{
+  if(movements_.empty())
+    return poses_.empty() ? Pose() : poses_[end_pose_];
+
+  // first movement that ends after the given time
+  auto movement = std::upper_bound(movements_.begin(), movements_.end(), time,
+                                   [](int64_t t, const Movement& m) { return t < m.end_time; });
+  if(movement == movements_.end())
+    return poses_[movements_.back().goal];
+
+  double relative_progress_in_time = static_cast<double>(time - (movement->end_time - movement->duration)) /
+                                     movement->duration;
+  relative_progress_in_time = std::max(0.0, relative_progress_in_time);
+  float progress = computeRelativeProgressInSpace(relative_progress_in_time, movement->interpolation_speed);
+
+  const Pose& start = poses_[movement->start];
+  const Pose& goal = poses_[movement->goal];
+  if(!movement->is_spline)
+    return Pose(start.eye + progress * (goal.eye - start.eye),
+                start.focus + progress * (goal.focus - start.focus),
+                start.up + progress * (goal.up - start.up));
+
+  const Pose& before = poses_[movement->before];
+  const Pose& after = poses_[movement->after];
+  return Pose(catmullRom(before.eye, start.eye, goal.eye, after.eye, progress),
+              catmullRom(before.focus, start.focus, goal.focus, after.focus, progress),
+              catmullRom(before.up, start.up, goal.up, after.up, progress));
+}
+
+float TrajectoryPlayer::computeRelativeProgressInSpace(double relative_progress_in_time,
+                                                       uint8_t interpolation_speed)
+{
+  switch(interpolation_speed)
+  {
+    case rviz_cinematographer_msgs::CameraMovement::RISING:
+      return 1.f - static_cast<float>(cos(relative_progress_in_time * M_PI_2));
+    case rviz_cinematographer_msgs::CameraMovement::DECLINING:
+      return static_cast<float>(-cos(relative_progress_in_time * M_PI_2 + M_PI_2));
+    case rviz_cinematographer_msgs::CameraMovement::FULL:
+      return static_cast<float>(relative_progress_in_time);
+    case rviz_cinematographer_msgs::CameraMovement::WAVE:
+    default:
+      return 0.5f * (1.f - static_cast<float>(cos(relative_progress_in_time * M_PI)));
+  }
+}
+
+}  // namespace rviz_cinematographer_view_controller
@@ -0,0 +1,275 @@
+/** @file
+ *
+ * Checks the poses a TrajectoryPlayer returns for linear movements, splines, holds and appended trajectories.
+ *
+ * @author Jan Razlaw
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include <gtest/gtest.h>
+
+#include <rviz_cinematographer_msgs/CameraMovement.h>
+
+#include "rviz_cinematographer_view_controller/trajectory_player.h"
+
+using namespace rviz_cinematographer_view_controller;
+
+typedef TrajectoryPlayer::Pose Pose;
+
+static const uint8_t FULL = rviz_cinematographer_msgs::CameraMovement::FULL;
+static const uint8_t WAVE = rviz_cinematographer_msgs::CameraMovement::WAVE;
+
+/** @brief Pose looking along y from x on the x axis. */
+static Pose poseAtX(float x)
+{
+  return Pose(Ogre::Vector3(x, 0.f, 0.f), Ogre::Vector3(x, 1.f, 0.f), Ogre::Vector3::UNIT_Z);
+}
+
+/** @brief Expects the poses of both trajectories to match every step nanoseconds over the longer one. */
+static void expectSamePoses(const TrajectoryPlayer& expected, const TrajectoryPlayer& actual, int64_t step)
+{
+  int64_t duration = std::max(expected.duration(), actual.duration());
+  for(int64_t time = 0; time <= duration; time += step)
+  {
+    Pose expected_pose = expected.poseAt(time);
+    Pose actual_pose = actual.poseAt(time);
+    ASSERT_NEAR(expected_pose.eye.x, actual_pose.eye.x, 1e-5) << "at " << time;
+    ASSERT_NEAR(expected_pose.focus.x, actual_pose.focus.x, 1e-5) << "at " << time;
+  }
+}
+
+TEST(TrajectoryPlayer, linearAtAndBetweenBoundaries)
+{
+  TrajectoryPlayer player;
+  player.setStart(poseAtX(0.f));
+  player.append(poseAtX(10.f), 100, FULL);
+  player.append(poseAtX(20.f), 200, FULL);
+
+  EXPECT_EQ(2u, player.size());
+  EXPECT_EQ(300, player.duration());
+
+  EXPECT_FLOAT_EQ(0.f, player.poseAt(0).eye.x);
+  EXPECT_FLOAT_EQ(5.f, player.poseAt(50).eye.x);
+  EXPECT_FLOAT_EQ(10.f, player.poseAt(100).eye.x);
+  EXPECT_FLOAT_EQ(15.f, player.poseAt(200).eye.x);
+  EXPECT_FLOAT_EQ(20.f, player.poseAt(300).eye.x);
+
+  // clamped to the trajectory
+  EXPECT_FLOAT_EQ(0.f, player.poseAt(-10).eye.x);
+  EXPECT_FLOAT_EQ(20.f, player.poseAt(1000).eye.x);
+
+  // the speed profile only changes the progress between the boundaries
+  TrajectoryPlayer wave;
+  wave.setStart(poseAtX(0.f));
+  wave.append(poseAtX(10.f), 100, WAVE);
+  EXPECT_FLOAT_EQ(0.f, wave.poseAt(0).eye.x);
+  EXPECT_NEAR(5.f, wave.poseAt(50).eye.x, 1e-5);
+  EXPECT_LT(wave.poseAt(25).eye.x, 2.5f);
+  EXPECT_FLOAT_EQ(10.f, wave.poseAt(100).eye.x);
+}
+
+TEST(TrajectoryPlayer, splinePassesThroughGoals)
+{
+  TrajectoryPlayer player;
+  player.setStart(poseAtX(0.f));
+  player.append(poseAtX(5.f), 10, FULL, true);
+  player.append(poseAtX(6.f), 10, FULL, true);
+  player.append(poseAtX(20.f), 10, FULL, true);
+
+  EXPECT_FLOAT_EQ(0.f, player.poseAt(0).eye.x);
+  EXPECT_FLOAT_EQ(5.f, player.poseAt(10).eye.x);
+  EXPECT_FLOAT_EQ(6.f, player.poseAt(20).eye.x);
+  EXPECT_FLOAT_EQ(20.f, player.poseAt(30).eye.x);
+
+  // unlike a linear movement, the spline overshoots towards the far goal
+  TrajectoryPlayer linear;
+  linear.setStart(poseAtX(0.f));
+  linear.append(poseAtX(5.f), 10, FULL);
+  linear.append(poseAtX(6.f), 10, FULL);
+  EXPECT_FLOAT_EQ(5.5f, linear.poseAt(15).eye.x);
+  EXPECT_GT(std::fabs(player.poseAt(15).eye.x - 5.5f), 0.1f);
+}
+
+TEST(TrajectoryPlayer, splineHandles)
+{
+  // equally spaced goals with handles continuing the spacing make the uniform spline a straight, even movement
+  TrajectoryPlayer player;
+  player.setStart(poseAtX(0.f));
+  player.addSplineHandle(poseAtX(-1.f));
+  player.append(poseAtX(1.f), 1000, FULL, true);
+  player.append(poseAtX(2.f), 1000, FULL, true);
+  player.addSplineHandle(poseAtX(3.f));
+
+  EXPECT_NEAR(0.25f, player.poseAt(250).eye.x, 1e-5);
+  EXPECT_NEAR(0.5f, player.poseAt(500).eye.x, 1e-5);
+  EXPECT_NEAR(1.5f, player.poseAt(1500).eye.x, 1e-5);
+  EXPECT_NEAR(1.75f, player.poseAt(1750).eye.x, 1e-5);
+
+  // without handles, the spline leaves its start and arrives at its end more slowly
+  TrajectoryPlayer no_handles;
+  no_handles.setStart(poseAtX(0.f));
+  no_handles.append(poseAtX(1.f), 1000, FULL, true);
+  no_handles.append(poseAtX(2.f), 1000, FULL, true);
+
+  EXPECT_LT(no_handles.poseAt(250).eye.x, 0.24f);
+  EXPECT_GT(no_handles.poseAt(1750).eye.x, 1.76f);
+  EXPECT_FLOAT_EQ(1.f, no_handles.poseAt(1000).eye.x);
+}
+
+TEST(TrajectoryPlayer, holdKeepsSplineOpen)
+{
+  TrajectoryPlayer player;
+  player.setStart(poseAtX(0.f));
+  player.append(poseAtX(0.f), 0, FULL);
+  player.addSplineHandle(poseAtX(-1.f));
+  player.append(poseAtX(1.f), 1000, FULL, true);
+  player.append(poseAtX(1.f), 500, FULL, true);
+  player.append(poseAtX(2.f), 1000, FULL, true);
+  player.append(poseAtX(3.f), 1000, FULL, true);
+  player.addSplineHandle(poseAtX(4.f));
+
+  // the hold of duration zero at the start still takes one nanosecond
+  EXPECT_EQ(5u, player.size());
+  EXPECT_EQ(3501, player.duration());
+
+  // the camera waits at the goal it reached
+  for(int64_t time = 1001; time <= 1501; time += 50)
+    EXPECT_FLOAT_EQ(1.f, player.poseAt(time).eye.x) << "at " << time;
+
+  // the spline continues as if there was no hold
+  TrajectoryPlayer without_hold;
+  without_hold.setStart(poseAtX(0.f));
+  without_hold.addSplineHandle(poseAtX(-1.f));
+  without_hold.append(poseAtX(1.f), 1000, FULL, true);
+  without_hold.append(poseAtX(2.f), 1000, FULL, true);
+  without_hold.append(poseAtX(3.f), 1000, FULL, true);
+  without_hold.addSplineHandle(poseAtX(4.f));
+
+  for(int64_t time = 0; time <= 1000; time += 50)
+    EXPECT_NEAR(without_hold.poseAt(time).eye.x, player.poseAt(time + 1).eye.x, 1e-5) << "at " << time;
+  for(int64_t time = 1000; time <= 3000; time += 50)
+    EXPECT_NEAR(without_hold.poseAt(time).eye.x, player.poseAt(time + 501).eye.x, 1e-5) << "at " << time;
+}
+
+TEST(TrajectoryPlayer, openStartMovesFromEndOfTrajectory)
+{
+  TrajectoryPlayer block;
+  block.setOpenStart();
+  block.append(poseAtX(8.f), 100, FULL);
+
+  TrajectoryPlayer player;
+  player.setStart(poseAtX(3.f));
+  player.append(block);
+
+  EXPECT_EQ(1u, player.size());
+  EXPECT_FLOAT_EQ(3.f, player.poseAt(0).eye.x);
+  EXPECT_FLOAT_EQ(5.5f, player.poseAt(50).eye.x);
+  EXPECT_FLOAT_EQ(8.f, player.poseAt(100).eye.x);
+
+  // a block starting with a movement to the placeholder still moves the camera
+  TrajectoryPlayer to_origin;
+  to_origin.setOpenStart();
+  to_origin.append(Pose(Ogre::Vector3::ZERO, Ogre::Vector3::ZERO, Ogre::Vector3::UNIT_Z), 100, FULL);
+
+  TrajectoryPlayer moved;
+  moved.setStart(poseAtX(4.f));
+  moved.append(to_origin);
+  EXPECT_FLOAT_EQ(2.f, moved.poseAt(50).eye.x);
+  EXPECT_FLOAT_EQ(0.f, moved.poseAt(100).eye.x);
+}
+
+TEST(TrajectoryPlayer, appendRemapsIndices)
+{
+  // the same movements appended directly and as blocks with open starts
+  TrajectoryPlayer direct;
+  direct.setStart(poseAtX(7.f));
+  direct.append(poseAtX(8.f), 100, WAVE);
+  for(int i = 0; i < 3; ++i)
+  {
+    float offset = 10.f * i;
+    direct.append(poseAtX(offset), 50, FULL);
+    direct.addSplineHandle(poseAtX(offset - 1.f));
+    direct.append(poseAtX(offset + 1.f), 1000, FULL, true);
+    direct.append(poseAtX(offset + 1.f), 300, FULL, true);
+    direct.append(poseAtX(offset + 4.f), 1000, WAVE, true);
+    direct.addSplineHandle(poseAtX(offset + 5.f));
+  }
+
+  TrajectoryPlayer joined;
+  joined.setStart(poseAtX(7.f));
+  joined.append(poseAtX(8.f), 100, WAVE);
+  for(int i = 0; i < 3; ++i)
+  {
+    float offset = 10.f * i;
+    TrajectoryPlayer block;
+    block.setOpenStart();
+    block.reserve(4);
+    block.append(poseAtX(offset), 50, FULL);
+    block.addSplineHandle(poseAtX(offset - 1.f));
+    block.append(poseAtX(offset + 1.f), 1000, FULL, true);
+    block.append(poseAtX(offset + 1.f), 300, FULL, true);
+    block.append(poseAtX(offset + 4.f), 1000, WAVE, true);
+    block.addSplineHandle(poseAtX(offset + 5.f));
+    joined.reserve(block.size());
+    joined.append(block);
+  }
+
+  EXPECT_EQ(direct.size(), joined.size());
+  EXPECT_EQ(direct.duration(), joined.duration());
+  expectSamePoses(direct, joined, 7);
+}
+
+TEST(TrajectoryPlayer, lookupAfterManyAppends)
+{
+  const int movement_count = 100000;
+  const int lookup_count = 200000;
+
+  TrajectoryPlayer small;
+  small.setStart(poseAtX(0.f));
+  for(int i = 1; i <= 100; ++i)
+    small.append(poseAtX(static_cast<float>(i)), 10, FULL);
+
+  TrajectoryPlayer player;
+  player.setStart(poseAtX(0.f));
+  for(int i = 1; i <= movement_count; ++i)
+  {
+    TrajectoryPlayer block;
+    block.setOpenStart();
+    block.append(poseAtX(static_cast<float>(i)), 10, FULL);
+    player.reserve(block.size());
+    player.append(block);
+  }
+
+  ASSERT_EQ(static_cast<size_t>(movement_count), player.size());
+  ASSERT_EQ(10 * movement_count, player.duration());
+  for(int i = 0; i < movement_count; i += 997)
+  {
+    EXPECT_NEAR(i + 0.5f, player.poseAt(10 * i + 5).eye.x, 1e-2) << "in movement " << i;
+    EXPECT_FLOAT_EQ(static_cast<float>(i), player.poseAt(10 * i).eye.x) << "at the start of movement " << i;
+  }
+
+  auto measure = [lookup_count](const TrajectoryPlayer& trajectory)
+  {
+    float sum = 0.f;
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < lookup_count; ++i)
+      sum += trajectory.poseAt((static_cast<int64_t>(i) * 7919) % trajectory.duration()).eye.x;
+    auto end = std::chrono::steady_clock::now();
+    EXPECT_GE(sum, 0.f);
+    return std::chrono::duration<double>(end - start).count();
+  };
+
+  // a linear search would be a thousand times slower than on the small trajectory, a binary search about three times
+  double small_seconds = measure(small);
+  double seconds = measure(player);
+  EXPECT_LT(seconds, 50.0 * small_seconds + 0.01);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
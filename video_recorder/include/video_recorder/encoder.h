@@ -0,0 +1,98 @@
+/** @file
+ *
+ * Interface of the video encoders the encoding pipeline writes frames with.
+ *
+ * @author Jan Razlaw
+ */
+
+#ifndef VIDEO_RECORDER_ENCODER_H
+#define VIDEO_RECORDER_ENCODER_H
+
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+
+#include <cv.hpp>
+
+namespace video_recorder
+{
+
+/** @brief Parameters selecting and configuring an encoder backend. */
+struct EncoderParameters
+{
+  EncoderParameters()
+    : backend("opencv")
+      , fourcc(cv::VideoWriter::fourcc('D', 'I', 'V', 'X'))
+      , codec("h264")
+      , preset("veryfast")
+      , crf(23)
+      , gop_size(0)
+      , threads(0)
+      , image_format("png")
+      , compression_level(1)
+      , max_in_flight_bytes(512 * 1024 * 1024)
+  {
+  }
+
+  std::string backend;  ///< "opencv", "libav" or "images".
+  int fourcc;           ///< Fourcc of the codec used by the OpenCV backend.
+  std::string codec;    ///< Codec used by the libav backend: "h264", "h265" or "ffv1".
+  std::string preset;   ///< Speed versus file size trade-off of H.264 and H.265, from "ultrafast" to "veryslow".
+  int crf;              ///< Constant rate factor of H.264 and H.265 - lower values mean better quality.
+  int gop_size;         ///< Maximum number of frames between two keyframes; 0 selects ten seconds of video.
+  int threads;          ///< Number of threads of the encoder; 0 lets the encoder decide.
+  std::string image_format;   ///< Format of the images backend: "png", "tiff" or "raw".
+  int compression_level;      ///< PNG compression level of the images backend from 0 (none) to 9.
+  size_t max_in_flight_bytes; ///< Image bytes the images backend holds while they wait to be written.
+};
+
+/** @brief Writes BGR8 images to a video file. */
+class Encoder
+{
+public:
+
+  virtual ~Encoder() {}
+
+  /** @brief Creates the video file.
+   *
+   * @param[in] path    path of the video file.
+   * @param[in] fps     frame rate of the video.
+   * @param[in] size    size of all images written to the video.
+   * @return false if the file could not be created.
+   */
+  virtual bool open(const std::string& path, int fps, const cv::Size& size) = 0;
+
+  /** @brief Encodes the image and appends it to the video.
+   *
+   * Encoders writing asynchronously keep a reference to the image until it is written.
+   *
+   * @param[in] image         BGR8 image of the size the video was opened with.
+   * @param[in] image_owner   keeps the memory of the image alive if the image does not own it.
+   * @return false if the image could not be encoded.
+   */
+  virtual bool write(const cv::Mat& image,
+                     const boost::shared_ptr<const void>& image_owner = boost::shared_ptr<const void>()) = 0;
+
+  /** @brief Flushes the encoder and closes the video file. Blocks until all images are written. */
+  virtual void close() = 0;
+
+  /** @brief Returns true if the video file is open. */
+  virtual bool isOpened() const = 0;
+};
+
+typedef boost::shared_ptr<Encoder> EncoderPtr;
+
+/** @brief Creates the encoder of the requested backend.
+ *
+ * Falls back to the OpenCV backend if the requested one is unknown or was not built.
+ *
+ * @param[in] params  parameters of the encoder.
+ */
+EncoderPtr createEncoder(const EncoderParameters& params);
+
+/** @brief Returns true if the libav backend was built. */
+bool isLibavAvailable();
+
+}  // namespace video_recorder
+
+#endif // VIDEO_RECORDER_ENCODER_H
@@ -0,0 +1,199 @@
+/** @file
+ *
+ * Multi-threaded pipeline that converts, watermarks and encodes frames into a video.
+ *
+ * @author Jan Razlaw
+ */
+
+#ifndef VIDEO_RECORDER_ENCODING_PIPELINE_H
+#define VIDEO_RECORDER_ENCODING_PIPELINE_H
+
+#include <map>
+#include <string>
+
+#include <ros/ros.h>
+
+#include <sensor_msgs/Image.h>
+
+#include <rviz_cinematographer_msgs/Record.h>
+
+#include <boost/thread.hpp>
+
+#include <cv.hpp>
+
+#include <cv_bridge/cv_bridge.h>
+
+#include <video_recorder/encoder.h>
+#include <video_recorder/frame_queue.h>
+#include <video_recorder/latency_histogram.h>
+#include <video_recorder/watermark.h>
+
+namespace video_recorder
+{
+
+/** @brief A frame travelling through the pipeline. */
+struct Frame
+{
+  Frame()
+    : seq(0)
+      , is_writable(false)
+  {
+  }
+
+  uint64_t seq;                           ///< Position of the frame in the video, assigned on intake.
+  sensor_msgs::ImageConstPtr message;     ///< Image message that still has to be converted, if any.
+  cv::Mat image;                          ///< BGR8 image, possibly referencing memory owned by #image_owner.
+  boost::shared_ptr<const void> image_owner; ///< Keeps the memory of #image alive if the image does not own it.
+  bool is_writable;                       ///< True if #image may be modified in place although it does not own it.
+  ros::WallTime enqueue_time;             ///< Time the frame entered the pipeline.
+};
+
+/** @brief Parameters of one recording. */
+struct RecordingParameters
+{
+  RecordingParameters()
+    : path_to_output("")
+      , fps(60)
+      , add_watermark(false)
+      , watermark_opacity(0.2f)
+      , watermark_position(BOTTOM_RIGHT)
+  {
+  }
+
+  std::string path_to_output;                   ///< Path of the resulting video file.
+  EncoderParameters encoder;                    ///< Backend and codec settings of the encoder.
+  int fps;                                      ///< Frame rate of the resulting video.
+  bool add_watermark;                           ///< If true, the watermark is added to each frame.
+  boost::shared_ptr<WatermarkCache> watermarks; ///< Provides the watermark prepared for the image width.
+  float watermark_opacity;                      ///< Weight of the watermark in the blended pixels.
+  WatermarkPosition watermark_position;         ///< Corner of the image the watermark is placed in.
+};
+
+/** @brief Returns the frame rate of the requested recording - the same for the view controller and all backends.
+ *
+ * @param[in] record_params   requested recording.
+ */
+int recordingFps(const rviz_cinematographer_msgs::Record& record_params);
+
+/** @brief Sets codec, frame rate, output path and watermark flag as requested for a new recording.
+ *
+ * @param[in]     record_params     requested recording.
+ * @param[in]     compressed_codec  codec the libav backend uses for compressed recordings.
+ * @param[in,out] params            parameters of the recording - the encoder backend has to be chosen already.
+ */
+void setRecordingParameters(const rviz_cinematographer_msgs::Record& record_params,
+                            const std::string& compressed_codec,
+                            RecordingParameters& params);
+
+/** @brief Statistics of one recording. */
+struct PipelineStats
+{
+  PipelineStats()
+    : frames_written(0)
+      , bytes_copied(0)
+      , duration(0.0)
+  {
+  }
+
+  FrameQueueStats intake;           ///< Statistics of the queue feeding the workers.
+  LatencyHistogram queue_latency;   ///< Latency from entering the pipeline until a worker picks the frame up.
+  uint64_t frames_written;          ///< Number of frames written to the video.
+  uint64_t bytes_copied;            ///< Number of image bytes copied by conversion and watermarking.
+  double duration;                  ///< Seconds from the first intake until the last frame was written.
+};
+
+/** @brief Encodes frames in three stages.
+ *
+ * 1. Intake: push() numbers each frame and appends it to a bounded queue, blocking while the queue is full.
+ * 2. Workers: a pool of threads converts the frames to BGR8 and adds the watermark in parallel. Image messages that
+ *    already are BGR8 are used in place and only copied if the watermark has to be drawn into them.
+ * 3. Writer: a single thread puts the processed frames back in order and feeds them to the encoder.
+ *
+ * Workers only run ahead of the writer by at most the capacity of the intake queue, which bounds the number of
+ * frames held in memory.
+ */
+class EncodingPipeline
+{
+public:
+
+  /** @brief Constructor. Starts the worker and writer threads.
+   *
+   * @param[in] queue_capacity  number of frames the intake queue holds.
+   * @param[in] num_workers     number of worker threads; 0 selects one per core except the writer's.
+   */
+  EncodingPipeline(size_t queue_capacity, unsigned int num_workers = 0);
+  ~EncodingPipeline();
+
+  /** @brief Starts a new recording. Expects the previous recording to be finished.
+   *
+   * @param[in] params  parameters of the recording.
+   */
+  void start(const RecordingParameters& params);
+
+  /** @brief Feeds a frame into the pipeline. Blocks while the intake queue is full.
+   *
+   * @param[in] frame   frame holding either an image message or a BGR8 image.
+   * @return false if the pipeline is shutting down and the frame was rejected.
+   */
+  bool push(Frame frame);
+
+  /** @brief Waits until all pushed frames are written and closes the video.
+   *
+   * @return statistics of the finished recording.
+   */
+  PipelineStats finish();
+
+  /** @brief Returns the number of frames waiting in the intake queue. */
+  size_t queueSize() const { return intake_queue_.size(); }
+
+  /** @brief Returns the capacity of the intake queue. */
+  size_t queueCapacity() const { return intake_queue_.stats().capacity; }
+
+  /** @brief Returns the number of worker threads. */
+  unsigned int numWorkers() const { return static_cast<unsigned int>(workers_.size()); }
+
+protected:
+
+  /** @brief Converts and watermarks frames from the intake queue until it is closed. */
+  void workerLoop();
+
+  /** @brief Writes processed frames in order of their sequence numbers until the pipeline shuts down. */
+  void writerLoop();
+
+  /** @brief Converts the frame's image message to a BGR8 image.
+   *
+   * The image references the message's data if no conversion is needed.
+   *
+   * @param[in,out] frame           frame to convert.
+   * @param[out]    is_shared       true if the image references memory that must not be modified.
+   * @param[out]    bytes_copied    number of bytes copied by the conversion.
+   * @return false if the conversion failed.
+   */
+  bool convertFrame(Frame& frame, bool& is_shared, uint64_t& bytes_copied);
+
+protected:
+
+  FrameQueue<Frame> intake_queue_;
+  boost::thread_group workers_;
+  boost::thread writer_;
+
+  mutable boost::mutex mutex_;                  ///< Guards all members below.
+  boost::condition_variable reorder_changed_;   ///< Signals a change of #reordered_frames_ or #next_seq_to_write_.
+  boost::condition_variable all_written_;       ///< Signals that all pushed frames are written.
+  std::map<uint64_t, Frame> reordered_frames_;  ///< Processed frames waiting for the writer.
+  uint64_t next_seq_to_push_;
+  uint64_t next_seq_to_write_;
+  size_t reorder_window_;
+  bool shutdown_;
+
+  RecordingParameters params_;
+  boost::shared_ptr<const Watermark> watermark_;  ///< Watermark prepared for the current recording, if any.
+  EncoderPtr encoder_;                            ///< Encoder of the current recording, created on its first frame.
+
+  PipelineStats stats_;
+  ros::WallTime first_intake_time_;
+};
+
+}  // namespace video_recorder
+
+#endif // VIDEO_RECORDER_ENCODING_PIPELINE_H
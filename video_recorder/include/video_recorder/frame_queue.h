@@ -0,0 +1,237 @@
+/** @file
+ *
+ * Bounded, thread-safe single-producer/single-consumer queue used to hand frames from the image callback to the
+ * encoding thread.
+ *
+ * @author Jan Razlaw
+ */
+
+#ifndef VIDEO_RECORDER_FRAME_QUEUE_H
+#define VIDEO_RECORDER_FRAME_QUEUE_H
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace video_recorder
+{
+
+/** @brief Statistics of a FrameQueue. */
+struct FrameQueueStats
+{
+  FrameQueueStats()
+    : depth(0)
+      , high_water_mark(0)
+      , capacity(0)
+      , pushed(0)
+      , blocked_pushes(0)
+  {
+  }
+
+  size_t depth;             ///< Number of elements currently queued.
+  size_t high_water_mark;   ///< Largest depth observed since the last reset.
+  size_t capacity;          ///< Maximum number of elements the queue holds.
+  uint64_t pushed;          ///< Number of elements pushed since the last reset.
+  uint64_t blocked_pushes;  ///< Number of pushes that had to wait for free space.
+};
+
+/** @brief Fixed-capacity ring buffer guarded by a mutex.
+ *
+ * A push on a full queue blocks until the consumer frees a slot, so frames are never dropped or overwritten.
+ * A pop on an empty queue blocks until the producer pushes, so the consumer wakes up as soon as there is work.
+ * An element counts as pending from push() until the consumer calls taskDone() for it, which allows to wait
+ * for the consumer to actually finish processing the last element.
+ */
+template<typename T>
+class FrameQueue
+{
+public:
+
+  /** @brief Constructor.
+   *
+   * @param[in] capacity    maximum number of queued elements.
+   */
+  explicit FrameQueue(size_t capacity)
+    : ring_(std::max<size_t>(1, capacity))
+      , head_(0)
+      , size_(0)
+      , in_progress_(0)
+      , closed_(false)
+  {
+    stats_.capacity = ring_.size();
+  }
+
+  /** @brief Changes the capacity. Queued elements are kept as long as they fit.
+   *
+   * @param[in] capacity    maximum number of queued elements.
+   */
+  void setCapacity(size_t capacity)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::vector<T> ring(std::max<size_t>(1, capacity));
+    size_t kept = std::min(size_, ring.size());
+    for(size_t i = 0; i < kept; ++i)
+      ring[i] = std::move(ring_[(head_ + i) % ring_.size()]);
+    ring_.swap(ring);
+    head_ = 0;
+    size_ = kept;
+    stats_.capacity = ring_.size();
+    not_full_.notify_all();
+  }
+
+  /** @brief Appends an element, blocking while the queue is full.
+   *
+   * @param[in] element     element to append.
+   * @return false if the queue was closed and the element was not queued.
+   */
+  bool push(T element)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if(size_ == ring_.size() && !closed_)
+    {
+      stats_.blocked_pushes++;
+      while(size_ == ring_.size() && !closed_)
+        not_full_.wait(lock);
+    }
+
+    if(closed_)
+      return false;
+
+    ring_[(head_ + size_) % ring_.size()] = std::move(element);
+    size_++;
+    stats_.pushed++;
+    stats_.high_water_mark = std::max(stats_.high_water_mark, size_);
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /** @brief Removes the oldest element, blocking while the queue is empty.
+   *
+   * The element stays pending until taskDone() is called.
+   *
+   * @param[out] element    the removed element.
+   * @return false if the queue was closed and is empty.
+   */
+  bool pop(T& element)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    while(size_ == 0 && !closed_)
+      not_empty_.wait(lock);
+
+    if(size_ == 0)
+      return false;
+
+    popFront(element);
+    return true;
+  }
+
+  /** @brief Removes the oldest element without blocking.
+   *
+   * The element stays pending until taskDone() is called.
+   *
+   * @param[out] element    the removed element.
+   * @return false if the queue was empty.
+   */
+  bool tryPop(T& element)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if(size_ == 0)
+      return false;
+
+    popFront(element);
+    return true;
+  }
+
+  /** @brief Marks an element obtained by a pop as fully processed. */
+  void taskDone()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if(in_progress_ > 0)
+      in_progress_--;
+    if(size_ + in_progress_ == 0)
+      drained_.notify_all();
+  }
+
+  /** @brief Blocks until all pushed elements were popped and marked as done, or the queue was closed. */
+  void waitUntilDrained()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    while(size_ + in_progress_ > 0 && !closed_)
+      drained_.wait(lock);
+  }
+
+  /** @brief Returns the number of elements that are queued or still being processed. */
+  size_t pending() const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return size_ + in_progress_;
+  }
+
+  /** @brief Returns the number of queued elements. */
+  size_t size() const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return size_;
+  }
+
+  /** @brief Wakes up all waiting threads and rejects future pushes. Queued elements can still be popped. */
+  void close()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    closed_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+    drained_.notify_all();
+  }
+
+  /** @brief Returns a snapshot of the queue statistics. */
+  FrameQueueStats stats() const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    FrameQueueStats stats = stats_;
+    stats.depth = size_;
+    return stats;
+  }
+
+  /** @brief Resets the counters and the high-water mark of the statistics. */
+  void resetStats()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stats_ = FrameQueueStats();
+    stats_.capacity = ring_.size();
+    stats_.high_water_mark = size_;
+  }
+
+private:
+
+  /** @brief Moves the oldest element out of the ring. Expects the mutex to be locked and the queue not to be empty. */
+  void popFront(T& element)
+  {
+    element = std::move(ring_[head_]);
+    ring_[head_] = T();
+    head_ = (head_ + 1) % ring_.size();
+    size_--;
+    in_progress_++;
+    not_full_.notify_one();
+  }
+
+  mutable boost::mutex mutex_;
+  boost::condition_variable not_full_;
+  boost::condition_variable not_empty_;
+  boost::condition_variable drained_;
+
+  std::vector<T> ring_;
+  size_t head_;
+  size_t size_;
+  size_t in_progress_;
+  bool closed_;
+
+  FrameQueueStats stats_;
+};
+
+}  // namespace video_recorder
+
+#endif // VIDEO_RECORDER_FRAME_QUEUE_H
@@ -0,0 +1,169 @@
+/** @file
+ *
+ * Ring of raw BGR8 frames in a preallocated, memory-mapped file that survives a crash of the recorder.
+ *
+ * @author Jan Razlaw
+ */
+
+#ifndef VIDEO_RECORDER_FRAME_SPOOL_H
+#define VIDEO_RECORDER_FRAME_SPOOL_H
+
+#include <stdint.h>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <cv.hpp>
+
+namespace video_recorder
+{
+
+/** @brief Header at the beginning of a spool file. */
+struct SpoolHeader
+{
+  uint64_t magic;           ///< Identifies spool files.
+  uint32_t version;         ///< Version of the file layout.
+  uint32_t index_offset;    ///< Offset of the slot index in bytes.
+  uint64_t data_offset;     ///< Offset of the first slot in bytes.
+  uint64_t slot_count;      ///< Number of frames the ring holds.
+  uint64_t slot_bytes;      ///< Size of one slot in bytes.
+  int32_t width;            ///< Width of all frames.
+  int32_t height;           ///< Height of all frames.
+  int32_t fps;              ///< Frame rate of the recording.
+  int32_t reserved;
+  uint64_t write_index;     ///< Number of frames appended since the file was created.
+  uint64_t release_index;   ///< Number of frames that were fully consumed.
+};
+
+/** @brief Entry of the slot index. */
+struct SpoolSlot
+{
+  uint64_t index;           ///< Index of the frame held by the slot.
+  uint32_t state;           ///< FREE, WRITTEN or CONSUMED.
+  uint32_t reserved;
+};
+
+/** @brief Ring of raw BGR8 frames in a memory-mapped file.
+ *
+ * The file is preallocated for a fixed number of frames of one size. append() copies a frame into the next free slot
+ * and blocks while all slots hold frames that were not consumed yet, so capturing can run ahead of encoding by the
+ * size of the ring without growing the memory of the process. read() returns the oldest unread frame in place. Its
+ * slot is reused once the lease returned with it is destroyed, which may happen out of order.
+ *
+ * A frame is published in the header only after its pixels and index entry are in the file. Since the file is
+ * mapped shared, frames that were appended but not consumed are still in the file after the process died and can be
+ * read again by opening the file. Thread-safe, but the spool has to outlive all leases.
+ */
+class FrameSpool
+{
+public:
+
+  FrameSpool();
+  ~FrameSpool();
+
+  /** @brief Creates the spool file, overwriting an existing one.
+   *
+   * Waits until all frames of the previous file were consumed.
+   *
+   * @param[in] path        path of the spool file.
+   * @param[in] frame_size  size of all frames.
+   * @param[in] max_bytes   size of the file; at least two frames are held.
+   * @param[in] fps         frame rate stored for later readers.
+   * @return false if the file could not be created.
+   */
+  bool create(const std::string& path, const cv::Size& frame_size, size_t max_bytes, int fps);
+
+  /** @brief Opens an existing spool file to read the frames that were not consumed yet.
+   *
+   * @param[in] path    path of the spool file.
+   * @return false if the file is no valid spool file.
+   */
+  bool open(const std::string& path);
+
+  /** @brief Returns true if a spool file is mapped. */
+  bool isOpen() const;
+
+  /** @brief Returns the size of the frames in the spool file. */
+  cv::Size frameSize() const;
+
+  /** @brief Returns the frame rate stored in the spool file. */
+  int fps() const;
+
+  /** @brief Returns the number of frames the ring holds. */
+  size_t capacity() const;
+
+  /** @brief Returns the number of frames that were appended but not read yet. */
+  size_t unread() const;
+
+  /** @brief Copies the frame into the next free slot, blocking while the ring is full.
+   *
+   * @param[in] image   BGR8 image of the size the file was created for.
+   * @return false if the spool was closed or the image does not fit.
+   */
+  bool append(const cv::Mat& image);
+
+  /** @brief Returns the oldest unread frame.
+   *
+   * @param[out] image      BGR8 image referencing the slot in the file.
+   * @param[out] lease      frees the slot once it is destroyed - keep it as long as the image is used.
+   * @param[in]  blocking   if true, waits until a frame is appended or the spool is closed, even if no file is
+   *                        mapped yet.
+   * @return false if no frame is available.
+   */
+  bool read(cv::Mat& image, boost::shared_ptr<const void>& lease, bool blocking = true);
+
+  /** @brief Returns an unread frame without reading it.
+   *
+   * Meant for offline passes over an opened spool file that nobody appends to - the image is only valid as long as
+   * the frame is not consumed.
+   *
+   * @param[in]  offset    position of the frame relative to the oldest unread frame.
+   * @param[out] image     BGR8 image referencing the slot in the file.
+   * @return false if there is no such frame.
+   */
+  bool peek(size_t offset, cv::Mat& image);
+
+  /** @brief Blocks until all appended frames were read or the spool was closed. */
+  void waitUntilRead();
+
+  /** @brief Wakes up all waiting threads and rejects further appends and blocking reads. */
+  void close();
+
+private:
+
+  /** @brief Marks the frame as consumed and frees all consumed slots at the tail of the ring.
+   *
+   * @param[in] index       index of the frame.
+   * @param[in] generation  generation of the mapping the frame was read from.
+   */
+  void release(uint64_t index, uint64_t generation);
+
+  /** @brief Maps the file. Expects the mutex to be locked. */
+  bool map(int fd, size_t file_bytes);
+
+  /** @brief Unmaps the file. Expects the mutex to be locked. */
+  void unmap();
+
+  SpoolSlot& slot(uint64_t index) { return index_[index % header_->slot_count]; }
+  unsigned char* slotData(uint64_t index) { return data_ + (index % header_->slot_count) * header_->slot_bytes; }
+
+  boost::mutex append_mutex_;           ///< Serializes appends.
+  mutable boost::mutex mutex_;          ///< Guards all members below.
+  boost::condition_variable changed_;   ///< Signals appended, read or released frames and closing.
+
+  unsigned char* mapping_;
+  size_t mapping_bytes_;
+  SpoolHeader* header_;
+  SpoolSlot* index_;
+  unsigned char* data_;
+
+  uint64_t read_index_;                 ///< Index of the next frame returned by read().
+  uint64_t generation_;                 ///< Incremented whenever a file is mapped, invalidates older leases.
+  bool closed_;
+};
+
+}  // namespace video_recorder
+
+#endif // VIDEO_RECORDER_FRAME_SPOOL_H
@@ -0,0 +1,89 @@
+/** @file
+ *
+ * Encoder backend writing each frame to a numbered image file.
+ *
+ * @author Jan Razlaw
+ */
+
+#ifndef VIDEO_RECORDER_IMAGE_SEQUENCE_ENCODER_H
+#define VIDEO_RECORDER_IMAGE_SEQUENCE_ENCODER_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include <video_recorder/encoder.h>
+#include <video_recorder/frame_queue.h>
+
+namespace video_recorder
+{
+
+/** @brief Writes each frame as numbered PNG, TIFF or raw BGR8 file using a pool of writer threads.
+ *
+ * The frames are written to a directory named after the output path without its extension, e.g. frames of
+ * /tmp/video.avi end up in /tmp/video/frame_000000.png. A sequence.yaml next to the frames stores their size,
+ * format and frame rate, which is needed to read the raw files.
+ *
+ * write() hands the frame to the pool and only blocks if the frames waiting to be written exceed the in-flight
+ * memory budget, so frames are never dropped.
+ */
+class ImageSequenceEncoder : public Encoder
+{
+public:
+
+  /** @brief Constructor. Starts the writer threads.
+   *
+   * @param[in] params  image format, compression level, memory budget and number of writer threads.
+   */
+  explicit ImageSequenceEncoder(const EncoderParameters& params);
+  virtual ~ImageSequenceEncoder();
+
+  virtual bool open(const std::string& path, int fps, const cv::Size& size);
+  virtual bool write(const cv::Mat& image, const boost::shared_ptr<const void>& image_owner);
+  virtual void close();
+  virtual bool isOpened() const;
+
+protected:
+
+  /** @brief An image waiting to be written. */
+  struct Job
+  {
+    Job()
+      : index(0)
+    {
+    }
+
+    uint64_t index;
+    cv::Mat image;
+    boost::shared_ptr<const void> image_owner;
+  };
+
+  /** @brief Writes the images of the job queue until it is closed. */
+  void writerLoop();
+
+  /** @brief Writes the image of the job to its file.
+   *
+   * @param[in] job     the job.
+   * @return false if the file could not be written.
+   */
+  bool writeImage(const Job& job);
+
+  EncoderParameters params_;
+  std::string format_;              ///< "png", "tiff" or "raw".
+  std::string extension_;           ///< File extension of the images, "bgr" for raw ones.
+  std::vector<int> imwrite_params_;
+
+  FrameQueue<Job> jobs_;
+  boost::thread_group writers_;
+
+  mutable boost::mutex mutex_;  ///< Guards the members below.
+  std::string directory_;
+  bool is_open_;
+  uint64_t next_index_;
+  uint64_t failed_writes_;
+};
+
+}  // namespace video_recorder
+
+#endif // VIDEO_RECORDER_IMAGE_SEQUENCE_ENCODER_H
@@ -0,0 +1,125 @@
+/** @file
+ *
+ * Histogram with logarithmic buckets to summarize latencies of the recording pipeline.
+ *
+ * @author Jan Razlaw
+ */
+
+#ifndef VIDEO_RECORDER_LATENCY_HISTOGRAM_H
+#define VIDEO_RECORDER_LATENCY_HISTOGRAM_H
+
+#include <cstdint>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+namespace video_recorder
+{
+
+/** @brief Counts latencies in power-of-two microsecond buckets.
+ *
+ * Bucket i holds latencies in [2^(i-1), 2^i) microseconds, bucket 0 holds latencies below one microsecond and the
+ * last bucket collects everything above. Not thread-safe.
+ */
+class LatencyHistogram
+{
+public:
+
+  /** @brief Constructor.
+   *
+   * @param[in] num_buckets     number of buckets; 24 buckets cover latencies up to about 8 seconds.
+   */
+  explicit LatencyHistogram(size_t num_buckets = 24)
+    : buckets_(std::max<size_t>(2, num_buckets), 0)
+      , count_(0)
+      , sum_us_(0.0)
+      , max_us_(0.0)
+  {
+  }
+
+  /** @brief Adds a latency.
+   *
+   * @param[in] seconds     latency in seconds.
+   */
+  void add(double seconds)
+  {
+    double us = std::max(0.0, seconds * 1e6);
+    size_t bucket = 0;
+    while(bucket + 1 < buckets_.size() && us >= static_cast<double>(uint64_t(1) << bucket))
+      bucket++;
+
+    buckets_[bucket]++;
+    count_++;
+    sum_us_ += us;
+    max_us_ = std::max(max_us_, us);
+  }
+
+  /** @brief Removes all latencies. */
+  void reset()
+  {
+    std::fill(buckets_.begin(), buckets_.end(), 0);
+    count_ = 0;
+    sum_us_ = 0.0;
+    max_us_ = 0.0;
+  }
+
+  /** @brief Returns the number of added latencies. */
+  uint64_t count() const { return count_; }
+
+  /** @brief Returns an upper bound in seconds for the given quantile, e.g. 0.99. */
+  double quantile(double q) const
+  {
+    if(count_ == 0)
+      return 0.0;
+
+    uint64_t target = static_cast<uint64_t>(std::max(1.0, q * count_ + 0.5));
+    uint64_t seen = 0;
+    for(size_t i = 0; i < buckets_.size(); ++i)
+    {
+      seen += buckets_[i];
+      if(seen >= target)
+        return std::min(max_us_, static_cast<double>(uint64_t(1) << i)) * 1e-6;
+    }
+    return max_us_ * 1e-6;
+  }
+
+  /** @brief Returns a one-line summary followed by one line per non-empty bucket. */
+  std::string toString() const
+  {
+    std::ostringstream out;
+    out << "n=" << count_;
+    if(count_ == 0)
+      return out.str();
+
+    out << " mean=" << sum_us_ / count_ * 1e-3 << "ms"
+        << " p50<=" << quantile(0.5) * 1e3 << "ms"
+        << " p99<=" << quantile(0.99) * 1e3 << "ms"
+        << " max=" << max_us_ * 1e-3 << "ms";
+
+    for(size_t i = 0; i < buckets_.size(); ++i)
+    {
+      if(buckets_[i] == 0)
+        continue;
+      double lower_us = i == 0 ? 0.0 : static_cast<double>(uint64_t(1) << (i - 1));
+      out << "\n  [" << lower_us * 1e-3 << "ms, ";
+      if(i + 1 < buckets_.size())
+        out << static_cast<double>(uint64_t(1) << i) * 1e-3 << "ms)";
+      else
+        out << "inf)";
+      out << " : " << buckets_[i];
+    }
+    return out.str();
+  }
+
+private:
+
+  std::vector<uint64_t> buckets_;
+  uint64_t count_;
+  double sum_us_;
+  double max_us_;
+};
+
+}  // namespace video_recorder
+
+#endif // VIDEO_RECORDER_LATENCY_HISTOGRAM_H
@@ -0,0 +1,87 @@
+/** @file
+ *
+ * Encoder backend using libavcodec and libavformat.
+ *
+ * @author Jan Razlaw
+ */
+
+#ifndef VIDEO_RECORDER_LIBAV_ENCODER_H
+#define VIDEO_RECORDER_LIBAV_ENCODER_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <video_recorder/encoder.h>
+
+struct AVCodecContext;
+struct AVFormatContext;
+struct AVFrame;
+struct AVPacket;
+struct AVStream;
+struct SwsContext;
+
+namespace video_recorder
+{
+
+/** @brief Writes H.264, H.265 or FFV1 videos with libavcodec.
+ *
+ * H.264 and H.265 are encoded with libx264 and libx265 in YUV 4:2:0 using the configured preset and constant rate
+ * factor. FFV1 is encoded losslessly in planar RGB. The container is deduced from the file extension.
+ */
+class LibavEncoder : public Encoder
+{
+public:
+
+  /** @brief Constructor.
+   *
+   * @param[in] params  codec, preset, constant rate factor, GOP size and thread count of the encoder.
+   */
+  explicit LibavEncoder(const EncoderParameters& params);
+  virtual ~LibavEncoder();
+
+  virtual bool open(const std::string& path, int fps, const cv::Size& size);
+  virtual bool write(const cv::Mat& image, const boost::shared_ptr<const void>& image_owner);
+  virtual void close();
+  virtual bool isOpened() const;
+
+protected:
+
+  /** @brief Sends the frame to the encoder and writes all packets it returns.
+   *
+   * @param[in] frame   the frame to encode or NULL to flush the encoder.
+   * @return false if encoding or writing failed.
+   */
+  bool encode(AVFrame* frame);
+
+  /** @brief Frees all libav resources without writing anything. */
+  void release();
+
+  EncoderParameters params_;
+  cv::Size size_;
+
+  AVFormatContext* format_context_;
+  AVCodecContext* codec_context_;
+  AVStream* stream_;
+  AVFrame* frame_;
+  AVPacket* packet_;
+  SwsContext* sws_context_;
+  int64_t next_pts_;
+  bool is_header_written_;
+};
+
+/** @brief Concatenates videos written by LibavEncoder with identical settings without re-encoding them.
+ *
+ * @param[in] parts         paths of the videos in playback order.
+ * @param[in] frame_counts  number of frames of each video.
+ * @param[in] fps           frame rate of the videos.
+ * @param[in] path          path of the resulting video; the container is deduced from the file extension.
+ * @return false if a video could not be read or the result could not be written.
+ */
+bool concatenateVideos(const std::vector<std::string>& parts,
+                       const std::vector<uint64_t>& frame_counts,
+                       int fps,
+                       const std::string& path);
+
+}  // namespace video_recorder
+
+#endif // VIDEO_RECORDER_LIBAV_ENCODER_H
@@ -0,0 +1,41 @@
+/** @file
+ *
+ * Encoder backend using OpenCV's video writer.
+ *
+ * @author Jan Razlaw
+ */
+
+#ifndef VIDEO_RECORDER_OPENCV_ENCODER_H
+#define VIDEO_RECORDER_OPENCV_ENCODER_H
+
+#include <video_recorder/encoder.h>
+
+namespace video_recorder
+{
+
+/** @brief Writes videos with cv::VideoWriter using a fourcc codec like DIVX or PIM1. */
+class OpenCVEncoder : public Encoder
+{
+public:
+
+  /** @brief Constructor.
+   *
+   * @param[in] fourcc  fourcc of the codec.
+   */
+  explicit OpenCVEncoder(int fourcc);
+  virtual ~OpenCVEncoder();
+
+  virtual bool open(const std::string& path, int fps, const cv::Size& size);
+  virtual bool write(const cv::Mat& image, const boost::shared_ptr<const void>& image_owner);
+  virtual void close();
+  virtual bool isOpened() const;
+
+protected:
+
+  int fourcc_;
+  cv::VideoWriter output_video_;
+};
+
+}  // namespace video_recorder
+
+#endif // VIDEO_RECORDER_OPENCV_ENCODER_H
@@ -0,0 +1,183 @@
+/** @file
+ *
+ * Ring of raw BGR8 frames in POSIX shared memory to pass frames between processes without copying them.
+ *
+ * @author Jan Razlaw
+ */
+
+#ifndef VIDEO_RECORDER_SHARED_FRAME_RING_H
+#define VIDEO_RECORDER_SHARED_FRAME_RING_H
+
+#include <stdint.h>
+#include <string>
+
+#include <semaphore.h>
+
+#include <ros/ros.h>
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cv.hpp>
+
+namespace video_recorder
+{
+
+/** @brief Header at the beginning of the shared memory segment. */
+struct SharedFrameHeader
+{
+  uint64_t magic;           ///< Identifies the segment.
+  uint32_t version;         ///< Version of the layout.
+  uint32_t slot_count;      ///< Number of frames the ring holds.
+  uint64_t slot_bytes;      ///< Maximum size of one frame in bytes.
+  uint64_t index_offset;    ///< Offset of the slot index in bytes.
+  uint64_t data_offset;     ///< Offset of the first slot in bytes.
+  int32_t reader_pid;       ///< Process that created the segment and reads from it.
+  uint32_t is_closed;       ///< Set once the reader unmapped the segment - the semaphores are left intact.
+  sem_t written_frames;     ///< Counts frames that were written but not read yet.
+  sem_t free_slots;         ///< Counts slots that can be written.
+  uint64_t write_index;     ///< Sequence number of the next frame written.
+  uint64_t release_index;   ///< Sequence number of the oldest frame that is still in use.
+};
+
+/** @brief Entry of the slot index describing the frame in a slot. */
+struct SharedFrameSlot
+{
+  uint64_t seq;             ///< Sequence number of the frame.
+  uint32_t width;           ///< Width of the frame.
+  uint32_t height;          ///< Height of the frame.
+  uint32_t state;           ///< FREE, WRITTEN or CONSUMED - only touched by the reader.
+  uint32_t frame_seq;       ///< Index of the frame in its recording, given by the writer.
+  uint64_t stamp;           ///< Time stamp of the frame in nanoseconds.
+};
+
+/** @brief Single-producer, single-consumer ring of BGR8 frames in a POSIX shared memory segment.
+ *
+ * The reading process creates the segment with a fixed number of slots that each hold a frame up to a maximum size.
+ * The writing process opens it, renders or copies a frame directly into the slot returned by beginWrite() and
+ * publishes it with endWrite(). read() returns the frames in order of their sequence numbers, referencing the
+ * segment. A slot is reused once the lease returned with its frame is destroyed, which may happen out of order.
+ *
+ * Process-shared semaphores in the header count written frames and free slots, so both sides block while there
+ * is nothing to do - the writer can run ahead of the reader by the size of the ring. Thread-safe on the reading
+ * side. Leases keep the ring alive, so a reading ring has to be owned by a boost::shared_ptr. Writing is meant for
+ * a single thread.
+ */
+class SharedFrameRing : public boost::enable_shared_from_this<SharedFrameRing>
+{
+public:
+
+  SharedFrameRing();
+  ~SharedFrameRing();
+
+  /** @brief Creates the segment as reader, replacing a stale one of the same name.
+   *
+   * The memory of the segment is allocated up front, so writing into it can't fail later on a full file system.
+   *
+   * @param[in] name              name of the segment, starting with a slash.
+   * @param[in] max_bytes         size of the segment; at least two frames are held.
+   * @param[in] max_frame_bytes   maximum size of one frame in bytes.
+   * @return false if the segment could not be created or is used by another running reader.
+   */
+  bool create(const std::string& name, size_t max_bytes, size_t max_frame_bytes);
+
+  /** @brief Opens an existing segment as writer.
+   *
+   * @param[in] name    name of the segment, starting with a slash.
+   * @return false if there is no valid segment of that name.
+   */
+  bool open(const std::string& name);
+
+  /** @brief Returns true if a segment is mapped. */
+  bool isOpen() const { return header_ != NULL; }
+
+  /** @brief Returns true if the process that created the segment is still running and didn't close it. */
+  bool isReaderAlive() const;
+
+  /** @brief Returns the number of frames the ring holds. */
+  size_t capacity() const;
+
+  /** @brief Returns the maximum size of one frame in bytes. */
+  size_t maxFrameBytes() const;
+
+  /** @brief Returns the number of frames written since the segment was created. */
+  uint64_t written() const;
+
+  /** @brief Returns the number of frames that were written but not read yet. */
+  size_t unread() const;
+
+  /** @brief Waits for a free slot and returns its memory to write a frame into.
+   *
+   * @param[in] width     width of the frame.
+   * @param[in] height    height of the frame.
+   * @param[in] timeout   maximum time to wait for a free slot.
+   * @return memory for height rows of width * 3 bytes, or NULL if the frame is too large or no slot was freed in
+   *         time.
+   */
+  unsigned char* beginWrite(unsigned int width, unsigned int height, const ros::WallDuration& timeout);
+
+  /** @brief Publishes the frame written into the memory returned by beginWrite().
+   *
+   * @param[in] stamp       time stamp of the frame.
+   * @param[in] frame_seq   index of the frame in its recording.
+   */
+  void endWrite(const ros::Time& stamp, uint32_t frame_seq);
+
+  /** @brief Gives the slot returned by beginWrite() back without publishing a frame. */
+  void cancelWrite();
+
+  /** @brief Returns the next frame, blocking until one is written or the ring is closed.
+   *
+   * The ring has to be owned by a boost::shared_ptr - each lease holds a reference to it.
+   *
+   * @param[out] image  BGR8 image referencing the slot in the segment.
+   * @param[out] lease  frees the slot once it is destroyed - keep it as long as the image is used.
+   * @param[out] frame_seq  index of the frame in its recording, as given to endWrite().
+   * @return false if the ring was closed.
+   */
+  bool read(cv::Mat& image, boost::shared_ptr<const void>& lease, uint32_t& frame_seq);
+
+  /** @brief Wakes up a blocked read() and rejects further reads. */
+  void close();
+
+private:
+
+  /** @brief Marks the frame as consumed and frees all consumed slots at the tail of the ring.
+   *
+   * @param[in] seq     sequence number of the frame.
+   */
+  void release(uint64_t seq);
+
+  /** @brief Maps the segment. */
+  bool map(int fd, size_t segment_bytes);
+
+  /** @brief Unmaps the segment and removes it if it was created by this instance.
+   *
+   * The semaphores are not destroyed, as the writer may still wait on them - it notices the closed segment instead.
+   */
+  void unmap();
+
+  SharedFrameSlot& slot(uint64_t seq) { return index_[seq % header_->slot_count]; }
+  unsigned char* slotData(uint64_t seq) { return data_ + (seq % header_->slot_count) * header_->slot_bytes; }
+
+  mutable boost::mutex mutex_;      ///< Guards #closed_ and serializes releases of the reader.
+
+  std::string name_;
+  bool is_owner_;                   ///< True if the segment was created by this instance.
+  unsigned char* mapping_;
+  size_t mapping_bytes_;
+  SharedFrameHeader* header_;
+  SharedFrameSlot* index_;
+  unsigned char* data_;
+
+  uint64_t read_index_;             ///< Sequence number of the next frame returned by read().
+  unsigned int write_width_;        ///< Size of the frame between beginWrite() and endWrite().
+  unsigned int write_height_;
+  bool is_writing_;
+  bool closed_;
+};
+
+}  // namespace video_recorder
+
+#endif // VIDEO_RECORDER_SHARED_FRAME_RING_H
@@ -8,28 +8,37 @@
 #ifndef VIDEO_RECORDER_H
 #define VIDEO_RECORDER_H
 
-#include <queue>
+#include <cerrno>
+#include <cstdio>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <nodelet/nodelet.h>
 
 #include <ros/subscriber.h>
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <ros/package.h>
 
 #include <rviz_cinematographer_msgs/Record.h>
 #include <rviz_cinematographer_msgs/Finished.h>
-#include <rviz_cinematographer_msgs/Wait.h>
+#include <rviz_cinematographer_msgs/FrameAck.h>
+#include <rviz_cinematographer_msgs/ViewImage.h>
 
 #include <sensor_msgs/Image.h>
 
 #include <boost/thread.hpp>
+#include <boost/make_shared.hpp>
 
 #include <cv.hpp>
 
 #include <image_transport/image_transport.h>
 #include <cv_bridge/cv_bridge.h>
 
+#include <video_recorder/encoding_pipeline.h>
+#include <video_recorder/frame_spool.h>
+#include <video_recorder/shared_frame_ring.h>
+
 namespace video_recorder
 {
 
@@ -38,6 +47,7 @@ class VideoRecorderNodelet : public nodelet::Nodelet
 public:
 
   VideoRecorderNodelet();
+  virtual ~VideoRecorderNodelet();
 
 protected:
 
@@ -46,7 +56,7 @@ protected:
    */
   virtual void onInit();
 
-  /** @brief Sets requested recording parameters and initializes a thread to process incoming images.
+  /** @brief Sets requested recording parameters and starts a new recording in the encoding pipeline.
    *
    * @params[in] record_params  specifies that a record should be made and the parameters that should be used.
    */
@@ -54,37 +64,111 @@ protected:
 
   /** @brief Awaits a message indicating that the image stream ended to stop recording.
    * 
-   * Waits until image_queue is processed, releases video writer and publishes that the recording is finished.
+   * Waits until the encoding pipeline wrote all images, closes the video and publishes that the recording is finished.
+   * Called by a separate spinner, so images keep arriving on the global callback queue while it waits.
    *
    * @params[in] rendering_finished  true if image stream ended.
    */
   void renderingFinishedCallback(const rviz_cinematographer_msgs::Finished::ConstPtr& rendering_finished);
 
-  /** @brief Stores subscribed images in queue and publishes a message if queue is too large.
+  /** @brief Feeds subscribed images into the encoding pipeline and acknowledges each consumed image.
    * 
-   * If queue's size exceeds max_queue_size, the duration it takes to process most of the queue is computed and 
-   * published. This message can be used by the source of the image stream to wait for the estimated duration.
+   * If spooling is enabled, the image is copied into the spool file instead and a separate thread feeds the pipeline.
+   * If the queue is full, the callback blocks until a worker frees a slot. The acknowledgement carries the image's
+   * index in the recording and grants the source of the image stream max_queue_size images beyond it, which the
+   * subscriber queue can hold without dropping any. Images of another than the current recording are dropped.
+   *
+   * @params[in] view_image  subscribed image with its index in the recording.
+   */
+  void imageCallback(const rviz_cinematographer_msgs::ViewImage::ConstPtr& view_image);
+
+  /** @brief Copies the image into the spool file, blocking while the spool is full.
    *
    * @params[in] input_image  subscribed image.
    */
-  void imageCallback(const sensor_msgs::ImageConstPtr& input_image);
+  void spoolImage(const sensor_msgs::ImageConstPtr& input_image);
 
-  /** @brief Feeds images from queue to video writer, optionally adding a watermark. */
-  void processImages();
+  /** @brief Copies the image into the spool file, blocking while the spool is full.
+   *
+   * Creates the spool file on the first image or if the image size changed.
+   *
+   * @params[in] image  BGR8 image.
+   */
+  void spoolImage(const cv::Mat& image);
 
-  /** @brief Resizes watermark to be at most half as wide as the input images.
-   * 
-   * @params[in,out]    watermark       the watermark being resized.
-   * @params[in]        image_width     the width of the input images.
+  /** @brief Forwards a frame in order of the frame indices given by the view controller.
+   *
+   * Frames with an index that was already forwarded are dropped. Frames missing before the given one are counted as
+   * dropped and filled in according to ~gap_fill, so the timeline of the video stays exact.
+   *
+   * @params[in] frame      frame holding either an image message or a BGR8 image.
+   * @params[in] frame_seq  index of the frame in the recording.
+   * @return false if the pipeline is shutting down.
    */
-  void resizeWatermark(cv::Mat& watermark, const int image_width);
+  bool forwardInOrder(Frame frame, uint32_t frame_seq);
 
-  /** @brief Adds watermark to the image.
-   * 
-   * @params[in,out]    image       the image being watermarked.
-   * @params[in]        watermark   the watermark.
+  /** @brief Copies the frame into the spool file if enabled or pushes it into the encoding pipeline.
+   *
+   * @params[in] frame  frame holding either an image message or a BGR8 image.
+   * @return false if the pipeline is shutting down.
+   */
+  bool forwardFrame(Frame frame);
+
+  /** @brief Forwards frames in place of missing ones - copies of the last frame or blends towards the next one.
+   *
+   * Expects #sequence_mutex_ to be locked.
+   *
+   * @params[in] missing      number of missing frames.
+   * @params[in] next_frame   frame following the gap, or NULL if the gap is at the end of the recording.
+   */
+  void fillGap(uint32_t missing, const Frame* next_frame);
+
+  /** @brief Waits for the rest of the frames, fills frames missing at the end and releases the last frame.
+   *
+   * The finished message may overtake the last images on their topic, so it's only the frame count that marks the
+   * end of the stream. Frames that don't arrive within a few seconds are considered lost.
+   *
+   * @params[in] frame_count  number of frames the view controller rendered, 0 if unknown.
    */
-  void addWatermark(cv::Mat& image, const cv::Mat& watermark);
+  void finishFrameSequence(uint32_t frame_count);
+
+  /** @brief Feeds the frames of the spool file into the encoding pipeline until the spool is closed. */
+  void spoolReaderLoop();
+
+  /** @brief Feeds the frames written into shared memory into the spool or the encoding pipeline until the ring is
+   * closed.
+   */
+  void sharedFrameReaderLoop();
+
+  /** @brief Creates the shared memory segment the view controller writes frames into, if enabled.
+   *
+   * @param[in] private_nh  node handle to read the shared memory parameters from.
+   */
+  void initSharedFrames(ros::NodeHandle& private_nh);
+
+  /** @brief Opens the spool directory and moves frames left by an interrupted recording aside.
+   *
+   * @param[in] private_nh  node handle to read the spool parameters from.
+   */
+  void initSpool(ros::NodeHandle& private_nh);
+
+  /** @brief Reads the backend and settings of the encoder.
+   *
+   * @param[in] private_nh  node handle to read the encoder parameters from.
+   */
+  void loadEncoderParameters(ros::NodeHandle& private_nh);
+
+  /** @brief Loads the watermark once and prepares it for the widths expected to be recorded.
+   *
+   * @param[in] private_nh  node handle to read the watermark parameters from.
+   */
+  void loadWatermark(ros::NodeHandle& private_nh);
+
+  /** @brief Prints the statistics of a finished recording.
+   *
+   * @params[in] stats  statistics of the recording.
+   */
+  void logStats(const PipelineStats& stats);
 
 protected:
 
@@ -92,26 +176,48 @@ protected:
 
   ros::Subscriber record_params_sub_;
   ros::Subscriber rendering_finished_sub_;
+  ros::CallbackQueue rendering_finished_queue_; ///< Serves #rendering_finished_sub_ while it waits for the last images.
+  ros::AsyncSpinner rendering_finished_spinner_;
 
-  image_transport::Subscriber image_sub_;
-  std::queue<cv_bridge::CvImagePtr> image_queue_;
+  ros::Subscriber image_sub_;
   int max_queue_size_;
-  ros::WallDuration process_one_image_duration_;
-
-  boost::shared_ptr<boost::thread> process_images_thread_;
+  int num_workers_;
+  std::string compressed_codec_;
+
+  boost::shared_ptr<EncodingPipeline> pipeline_;
+
+  std::string spool_directory_;
+  int spool_size_mb_;
+  boost::shared_ptr<FrameSpool> spool_;         ///< Spool file between the image callback and the pipeline, if enabled.
+  boost::thread spool_reader_;
+
+  std::string shm_name_;
+  int shm_size_mb_;
+  int shm_max_width_;
+  int shm_max_height_;
+  boost::shared_ptr<SharedFrameRing> shared_frames_;  ///< Frames written by the view controller, if enabled.
+  boost::thread shared_frame_reader_;
+
+  boost::mutex forward_mutex_;                  ///< Guards the counters below.
+  boost::condition_variable frame_forwarded_;   ///< Signals that a reader forwarded a frame.
+  uint64_t spooled_frames_;
+  uint64_t forwarded_frames_;                   ///< Number of spooled frames pushed into the pipeline.
+  uint64_t shared_frames_forwarded_;            ///< Number of shared memory frames spooled or pushed into the pipeline.
+  boost::shared_ptr<WatermarkCache> watermark_cache_;
+
+  std::string gap_fill_;                        ///< Fills missing frames with "duplicate", "interpolate" or "none".
+  boost::mutex sequence_mutex_;                 ///< Guards the frame sequence state below and orders forwarding.
+  boost::condition_variable frame_seq_advanced_; ///< Signals that #next_frame_seq_ increased.
+  uint32_t next_frame_seq_;                     ///< Index of the next frame expected from the view controller.
+  uint32_t dropped_frames_;                     ///< Number of missing frames in the current recording.
+  uint32_t late_frames_;                        ///< Number of duplicate or late frames dropped in the current recording.
+  Frame last_frame_;                            ///< Latest frame forwarded, kept to fill gaps.
+  uint32_t recording_id_;                       ///< Identifies the current recording in frame acknowledgements.
 
   ros::Publisher record_finished_pub_;
-  ros::Publisher wait_pub_;
-
-  cv::VideoWriter output_video_;
-  std::string path_to_output_;
-  int codec_;
-  int target_fps_;
-  int recorded_frames_counter_;
-  bool add_watermark_;
-  cv::Mat original_watermark_;
-  cv::Mat resized_watermark_;
-  bool is_watermark_resized_;
+  ros::Publisher frame_ack_pub_;
+
+  RecordingParameters recording_params_;
 };
 
 }  // namespace video_recorder
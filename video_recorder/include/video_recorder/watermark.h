@@ -0,0 +1,172 @@
+/** @file
+ *
+ * Watermark prepared once per recording and blended into each frame with SIMD instructions.
+ *
+ * @author Jan Razlaw
+ */
+
+#ifndef VIDEO_RECORDER_WATERMARK_H
+#define VIDEO_RECORDER_WATERMARK_H
+
+#include <cstddef>
+#include <map>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cv.hpp>
+
+namespace video_recorder
+{
+
+/** @brief Blends a premultiplied overlay into a row of interleaved pixels.
+ *
+ * Computes dst[i] = dst[i] * inverse_weight[i] / 255 + premultiplied[i] for n bytes, rounding the division exactly.
+ * Uses AVX2 or SSE2 if the CPU supports it.
+ *
+ * @param[in,out] dst               bytes being blended.
+ * @param[in]     premultiplied     overlay bytes already multiplied by their weight.
+ * @param[in]     inverse_weight    255 minus the weight of the overlay for each byte.
+ * @param[in]     n                 number of bytes.
+ */
+void blendPremultipliedRow(unsigned char* dst,
+                           const unsigned char* premultiplied,
+                           const unsigned char* inverse_weight,
+                           size_t n);
+
+/** @brief Scalar reference implementation of blendPremultipliedRow(). Produces identical results. */
+void blendPremultipliedRowScalar(unsigned char* dst,
+                                 const unsigned char* premultiplied,
+                                 const unsigned char* inverse_weight,
+                                 size_t n);
+
+/** @brief SSE2 implementation of blendPremultipliedRow(). Only call it if blendSupportsSSE2() returns true. */
+void blendPremultipliedRowSSE2(unsigned char* dst,
+                               const unsigned char* premultiplied,
+                               const unsigned char* inverse_weight,
+                               size_t n);
+
+/** @brief AVX2 implementation of blendPremultipliedRow(). Only call it if blendSupportsAVX2() returns true. */
+void blendPremultipliedRowAVX2(unsigned char* dst,
+                               const unsigned char* premultiplied,
+                               const unsigned char* inverse_weight,
+                               size_t n);
+
+/** @brief Returns true if blendPremultipliedRowSSE2() was built for and runs on this CPU. */
+bool blendSupportsSSE2();
+
+/** @brief Returns true if blendPremultipliedRowAVX2() was built for and runs on this CPU. */
+bool blendSupportsAVX2();
+
+/** @brief Returns the name of the instruction set used by blendPremultipliedRow(). */
+const char* blendInstructionSet();
+
+/** @brief Corner of the image the watermark is placed in. */
+enum WatermarkPosition
+{
+  BOTTOM_RIGHT = 0,
+  BOTTOM_LEFT,
+  TOP_RIGHT,
+  TOP_LEFT,
+};
+
+/** @brief Converts a position name like "bottom_right" to a WatermarkPosition.
+ *
+ * @param[in]  name        name of the position.
+ * @param[out] position    the position, unchanged if the name is unknown.
+ * @return false if the name is unknown.
+ */
+bool watermarkPositionFromString(const std::string& name, WatermarkPosition& position);
+
+/** @brief A watermark resized for a specific image width and premultiplied with its opacity.
+ *
+ * Pixels that are transparent in the original watermark leave the image untouched, all other pixels are blended
+ * with the given opacity. Fully transparent borders are cropped so that only the visible part is blended.
+ */
+class Watermark
+{
+public:
+
+  /** @brief Constructs an empty watermark that does not change images. */
+  Watermark();
+
+  /** @brief Prepares the watermark for images of the given width.
+   *
+   * @param[in] original_watermark  BGRA watermark in its original size.
+   * @param[in] image_width         width of the images the watermark is added to.
+   * @param[in] opacity             weight of the watermark in the blended pixels in [0, 1].
+   * @param[in] position            corner of the image the watermark is placed in.
+   */
+  Watermark(const cv::Mat& original_watermark,
+            int image_width,
+            float opacity = 0.2f,
+            WatermarkPosition position = BOTTOM_RIGHT);
+
+  /** @brief Returns true if the watermark does not change images. */
+  bool empty() const { return premultiplied_.empty(); }
+
+  /** @brief Returns the size of the resized watermark before cropping. */
+  cv::Size size() const { return size_; }
+
+  /** @brief Returns the size of the blended part of the watermark. */
+  cv::Size croppedSize() const { return premultiplied_.size(); }
+
+  /** @brief Adds the watermark to the image.
+   *
+   * @param[in,out] image           BGR8 image being watermarked.
+   * @param[in]     force_scalar    if true, the scalar implementation is used - for benchmarking.
+   */
+  void apply(cv::Mat& image, bool force_scalar = false) const;
+
+private:
+
+  cv::Mat premultiplied_;    ///< BGR watermark multiplied by the per pixel weight.
+  cv::Mat inverse_weight_;   ///< 255 minus the per pixel weight, replicated for each of the three channels.
+  cv::Size size_;            ///< Size of the resized watermark before cropping.
+  cv::Point crop_offset_;    ///< Position of the cropped part within the resized watermark.
+  WatermarkPosition position_;
+};
+
+/** @brief Loads the watermark once and keeps prepared watermarks for all requested widths, positions and opacities.
+ *
+ * Thread-safe.
+ */
+class WatermarkCache
+{
+public:
+
+  WatermarkCache();
+
+  /** @brief Loads the original watermark and drops all prepared watermarks.
+   *
+   * @param[in] path    path to a BGRA image.
+   * @return false if the file could not be loaded as BGRA image.
+   */
+  bool load(const std::string& path);
+
+  /** @brief Returns true if no watermark is loaded. */
+  bool empty() const;
+
+  /** @brief Returns the watermark prepared for the given parameters, preparing it if not cached yet.
+   *
+   * @param[in] image_width     width of the images the watermark is added to.
+   * @param[in] opacity         weight of the watermark in the blended pixels in [0, 1].
+   * @param[in] position        corner of the image the watermark is placed in.
+   * @return the prepared watermark or an empty pointer if no watermark is loaded.
+   */
+  boost::shared_ptr<const Watermark> get(int image_width, float opacity, WatermarkPosition position);
+
+private:
+
+  /** @brief Width, quantized opacity and position. */
+  typedef std::pair<std::pair<int, int>, int> Key;
+
+  mutable boost::mutex mutex_;
+  cv::Mat original_watermark_;
+  std::map<Key, boost::shared_ptr<const Watermark> > prepared_watermarks_;
+};
+
+}  // namespace video_recorder
+
+#endif // VIDEO_RECORDER_WATERMARK_H
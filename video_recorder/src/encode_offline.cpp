@@ -0,0 +1,481 @@
+/** @file
+ *
+ * Encodes frames of a spool file or of a bag offline, in parallel chunks that are concatenated afterwards.
+ *
+ * Usage: encode_offline <input.spool|spool_directory|input.bag> <output> [options]
+ *
+ * @author Jan Razlaw
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include <boost/thread.hpp>
+#include <boost/scoped_array.hpp>
+
+#include <ros/ros.h>
+#include <ros/package.h>
+
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+
+#include <sensor_msgs/Image.h>
+
+#include <rviz_cinematographer_msgs/ViewImage.h>
+#include <cv_bridge/cv_bridge.h>
+
+#include "video_recorder/encoder.h"
+#include "video_recorder/frame_spool.h"
+#include "video_recorder/watermark.h"
+#ifdef VIDEO_RECORDER_HAVE_LIBAV
+#include "video_recorder/libav_encoder.h"
+#endif
+
+using namespace video_recorder;
+
+/** @brief Options of the offline encoding. */
+struct Options
+{
+  Options()
+    : topic("/rviz/view_image")
+      , fps(0)
+      , jobs(0)
+      , add_watermark(false)
+      , watermark_opacity(0.2f)
+      , watermark_position(BOTTOM_RIGHT)
+  {
+    encoder.backend = isLibavAvailable() ? "libav" : "opencv";
+  }
+
+  std::string input;
+  std::string output;
+  std::string topic;
+  int fps;
+  int jobs;
+  EncoderParameters encoder;
+  bool add_watermark;
+  std::string watermark_path;
+  float watermark_opacity;
+  WatermarkPosition watermark_position;
+};
+
+/** @brief Provides the frames of one chunk of the input in order. */
+class ChunkReader
+{
+public:
+  virtual ~ChunkReader() {}
+
+  /** @brief Returns the next frame of the chunk.
+   *
+   * @param[out] image          BGR8 image.
+   * @param[out] image_owner    keeps the memory of the image alive if the image does not own it.
+   * @return false if the chunk has no more frames.
+   */
+  virtual bool next(cv::Mat& image, boost::shared_ptr<const void>& image_owner) = 0;
+};
+
+/** @brief Reads a range of unread frames of an opened spool file in place. */
+class SpoolChunkReader : public ChunkReader
+{
+public:
+  SpoolChunkReader(FrameSpool& spool, size_t begin, size_t end)
+    : spool_(spool)
+      , current_(begin)
+      , end_(end)
+  {
+  }
+
+  virtual bool next(cv::Mat& image, boost::shared_ptr<const void>& image_owner)
+  {
+    image_owner.reset();
+    return current_ < end_ && spool_.peek(current_++, image);
+  }
+
+private:
+  FrameSpool& spool_;
+  size_t current_;
+  size_t end_;
+};
+
+/** @brief Reads a range of the messages of a topic of a bag, given by their index on the topic. */
+class BagChunkReader : public ChunkReader
+{
+public:
+  BagChunkReader(const std::string& path, const std::string& topic, size_t begin, size_t end)
+    : index_(0)
+      , end_(end)
+  {
+    // every chunk opens its own bag since bags are not thread-safe
+    bag_.open(path, rosbag::bagmode::Read);
+    view_.reset(new rosbag::View(bag_, rosbag::TopicQuery(topic)));
+    // skipping only walks the bag's index - the messages are not read
+    for(current_ = view_->begin(); current_ != view_->end() && index_ < begin; ++current_)
+      ++index_;
+  }
+
+  virtual bool next(cv::Mat& image, boost::shared_ptr<const void>& image_owner)
+  {
+    for(; current_ != view_->end() && index_ < end_; ++current_, ++index_)
+    {
+      // the view controller publishes its images wrapped with their index - other image topics hold plain images
+      sensor_msgs::ImageConstPtr message;
+      rviz_cinematographer_msgs::ViewImage::ConstPtr view_image =
+        current_->instantiate<rviz_cinematographer_msgs::ViewImage>();
+      if(view_image)
+        message = sensor_msgs::ImageConstPtr(view_image, &view_image->image);
+      else
+        message = current_->instantiate<sensor_msgs::Image>();
+      if(!message)
+        continue;
+
+      try
+      {
+        cv_bridge::CvImageConstPtr cv_image = cv_bridge::toCvShare(message, sensor_msgs::image_encodings::BGR8);
+        image = cv_image->image;
+        image_owner = cv_image;
+      }
+      catch(cv_bridge::Exception& e)
+      {
+        ROS_ERROR("Failed to convert sensor_msgs::Image to cv_bridge::CvImage : cv_bridge exception: %s", e.what());
+        continue;
+      }
+
+      ++current_;
+      ++index_;
+      return true;
+    }
+    return false;
+  }
+
+private:
+  rosbag::Bag bag_;
+  boost::shared_ptr<rosbag::View> view_;
+  rosbag::View::iterator current_;
+  size_t index_;                    ///< Index of #current_ among the messages of the topic.
+  size_t end_;
+};
+
+/** @brief Encodes all frames of a chunk into one video.
+ *
+ * @param[in]  reader           provides the frames of the chunk.
+ * @param[in]  options          encoder and watermark options.
+ * @param[in]  watermarks       the loaded watermark.
+ * @param[in]  path             path of the video.
+ * @param[out] frames_written   number of encoded frames.
+ * @param[out] is_ok            false if the video could not be written.
+ */
+static void encodeChunk(boost::shared_ptr<ChunkReader> reader,
+                        const Options& options,
+                        WatermarkCache& watermarks,
+                        const std::string& path,
+                        uint64_t& frames_written,
+                        bool& is_ok)
+{
+  EncoderPtr encoder = createEncoder(options.encoder);
+  boost::shared_ptr<const Watermark> watermark;
+  frames_written = 0;
+  is_ok = true;
+
+  uint64_t frames_failed = 0;
+  cv::Mat image;
+  boost::shared_ptr<const void> image_owner;
+  while(reader->next(image, image_owner))
+  {
+    if(!encoder->isOpened() && !encoder->open(path, options.fps, image.size()))
+    {
+      std::cerr << "Could not open the output video " << path << std::endl;
+      is_ok = false;
+      return;
+    }
+
+    if(options.add_watermark)
+    {
+      if(!watermark)
+        watermark = watermarks.get(image.cols, options.watermark_opacity, options.watermark_position);
+      if(watermark && !watermark->empty())
+      {
+        // the input is shared with the spool file or the bag's buffer
+        image = image.clone();
+        image_owner.reset();
+        watermark->apply(image);
+      }
+    }
+
+    if(encoder->write(image, image_owner))
+      frames_written++;
+    else
+      frames_failed++;
+  }
+
+  encoder->close();
+
+  if(frames_failed > 0)
+  {
+    std::cerr << "Could not write " << frames_failed << " frames to " << path << std::endl;
+    is_ok = false;
+  }
+}
+
+static void printUsage()
+{
+  std::cerr << "Usage: encode_offline <input.spool|spool_directory|input.bag> <output> [options]" << std::endl
+            << "  --topic <name>               image topic of a bag (default /rviz/view_image)" << std::endl
+            << "  --fps <n>                    frame rate (default: from the spool file, 60 for bags)" << std::endl
+            << "  --jobs <n>                   number of chunks encoded in parallel (default: one per core)"
+            << std::endl
+            << "  --encoder <libav|opencv|images>" << std::endl
+            << "  --codec <h264|h265|ffv1>     codec of the libav encoder (default h264)" << std::endl
+            << "  --preset <name>              preset of h264 and h265 (default veryfast)" << std::endl
+            << "  --crf <n>                    constant rate factor of h264 and h265 (default 23)" << std::endl
+            << "  --gop-size <n>               maximum number of frames between keyframes" << std::endl
+            << "  --image-format <png|tiff|raw> format of the images encoder (default png)" << std::endl
+            << "  --watermark [path]           add the watermark (default: the one of video_recorder)" << std::endl
+            << "  --watermark-position <name>  bottom_right, bottom_left, top_right or top_left" << std::endl
+            << "  --watermark-opacity <value>  weight of the watermark in [0, 1] (default 0.2)" << std::endl;
+}
+
+static bool parseOptions(int argc, char** argv, Options& options)
+{
+  std::vector<std::string> positional;
+  for(int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    std::string value = has_value ? argv[i + 1] : "";
+
+    if(arg == "--watermark")
+    {
+      options.add_watermark = true;
+      // the path is optional - it is only taken after input and output were given
+      if(has_value && value.compare(0, 2, "--") != 0 && positional.size() >= 2)
+      {
+        options.watermark_path = value;
+        ++i;
+      }
+      continue;
+    }
+
+    if(arg.compare(0, 2, "--") != 0)
+    {
+      positional.push_back(arg);
+      continue;
+    }
+
+    if(!has_value)
+    {
+      std::cerr << "Missing value of " << arg << std::endl;
+      return false;
+    }
+    ++i;
+
+    if(arg == "--topic")
+      options.topic = value;
+    else if(arg == "--fps")
+      options.fps = std::atoi(value.c_str());
+    else if(arg == "--jobs")
+      options.jobs = std::atoi(value.c_str());
+    else if(arg == "--encoder")
+      options.encoder.backend = value;
+    else if(arg == "--codec")
+      options.encoder.codec = value;
+    else if(arg == "--preset")
+      options.encoder.preset = value;
+    else if(arg == "--crf")
+      options.encoder.crf = std::atoi(value.c_str());
+    else if(arg == "--gop-size")
+      options.encoder.gop_size = std::atoi(value.c_str());
+    else if(arg == "--image-format")
+      options.encoder.image_format = value;
+    else if(arg == "--watermark-opacity")
+      options.watermark_opacity = static_cast<float>(std::atof(value.c_str()));
+    else if(arg == "--watermark-position")
+    {
+      if(!watermarkPositionFromString(value, options.watermark_position))
+      {
+        std::cerr << "Unknown watermark position " << value << std::endl;
+        return false;
+      }
+    }
+    else
+    {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return false;
+    }
+  }
+
+  if(positional.size() != 2)
+    return false;
+
+  options.input = positional[0];
+  options.output = positional[1];
+  return true;
+}
+
+static bool endsWith(const std::string& text, const std::string& suffix)
+{
+  return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+  if(!parseOptions(argc, argv, options))
+  {
+    printUsage();
+    return EXIT_FAILURE;
+  }
+
+  WatermarkCache watermarks;
+  if(options.add_watermark)
+  {
+    if(options.watermark_path.empty())
+      options.watermark_path = ros::package::getPath("video_recorder") + "/watermark/watermark.png";
+    if(!watermarks.load(options.watermark_path))
+    {
+      std::cerr << "Could not load watermark " << options.watermark_path << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // libav encodes independent chunks that are concatenated without re-encoding, the images encoder writes in
+  // parallel by itself and OpenCV's videos can't be concatenated
+  size_t num_chunks = 1;
+#ifdef VIDEO_RECORDER_HAVE_LIBAV
+  if(options.encoder.backend == "libav")
+  {
+    unsigned int num_cores = std::max(1u, boost::thread::hardware_concurrency());
+    num_chunks = options.jobs > 0 ? static_cast<size_t>(options.jobs) : num_cores;
+    // one encoder thread per chunk avoids oversubscribing the cores
+    if(options.encoder.threads == 0)
+      options.encoder.threads = static_cast<int>(std::max<size_t>(1, num_cores / num_chunks));
+  }
+#endif
+
+  // split the input into chunks
+  std::vector<boost::shared_ptr<ChunkReader> > readers;
+  FrameSpool spool;
+  if(endsWith(options.input, ".bag"))
+  {
+    if(options.fps <= 0)
+      options.fps = 60;
+
+    ros::Time::init();
+    rosbag::Bag bag;
+    try
+    {
+      bag.open(options.input, rosbag::bagmode::Read);
+    }
+    catch(rosbag::BagException& e)
+    {
+      std::cerr << "Could not open bag " << options.input << ": " << e.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+    rosbag::View view(bag, rosbag::TopicQuery(options.topic));
+    if(view.size() == 0)
+    {
+      std::cerr << "No messages on " << options.topic << " in " << options.input << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    // split by message count - a time range falling into a pause of the recording would hold no frames
+    size_t num_messages = view.size();
+    num_chunks = std::min(num_chunks, num_messages);
+    for(size_t i = 0; i < num_chunks; ++i)
+      readers.push_back(boost::shared_ptr<ChunkReader>(
+        new BagChunkReader(options.input, options.topic, num_messages * i / num_chunks,
+                           num_messages * (i + 1) / num_chunks)));
+  }
+  else
+  {
+    std::string spool_path = options.input;
+    if(!endsWith(spool_path, ".spool"))
+      spool_path += "/frames.spool";
+    if(!spool.open(spool_path))
+    {
+      std::cerr << "Could not open spool file " << spool_path << std::endl;
+      return EXIT_FAILURE;
+    }
+    if(options.fps <= 0)
+      options.fps = std::max(1, spool.fps());
+
+    size_t num_frames = spool.unread();
+    if(num_frames == 0)
+    {
+      std::cerr << "No frames in " << spool_path << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    num_chunks = std::min(num_chunks, num_frames);
+    for(size_t i = 0; i < num_chunks; ++i)
+      readers.push_back(boost::shared_ptr<ChunkReader>(
+        new SpoolChunkReader(spool, num_frames * i / num_chunks, num_frames * (i + 1) / num_chunks)));
+  }
+
+  // encode the chunks in parallel
+  std::vector<std::string> parts(readers.size(), options.output);
+  if(readers.size() > 1)
+  {
+    std::string::size_type extension_begin = options.output.find_last_of('.');
+    std::string extension = extension_begin == std::string::npos ? ".mkv" : options.output.substr(extension_begin);
+    for(size_t i = 0; i < parts.size(); ++i)
+      parts[i] = options.output + ".part" + std::to_string(static_cast<unsigned long long>(i)) + extension;
+  }
+
+  std::cout << "Encoding " << options.input << " in " << readers.size() << " chunks with the " << options.encoder.backend
+            << " encoder." << std::endl;
+  ros::WallTime start = ros::WallTime::now();
+
+  std::vector<uint64_t> frame_counts(readers.size(), 0);
+  boost::scoped_array<bool> chunk_ok(new bool[readers.size()]);
+  boost::thread_group threads;
+  for(size_t i = 0; i < readers.size(); ++i)
+    threads.create_thread(boost::bind(&encodeChunk, readers[i], boost::cref(options), boost::ref(watermarks),
+                                      parts[i], boost::ref(frame_counts[i]), boost::ref(chunk_ok[i])));
+  threads.join_all();
+
+  bool is_ok = true;
+  uint64_t frames_written = 0;
+  for(size_t i = 0; i < readers.size(); ++i)
+  {
+    is_ok = is_ok && chunk_ok[i];
+    frames_written += frame_counts[i];
+  }
+
+#ifdef VIDEO_RECORDER_HAVE_LIBAV
+  if(is_ok && parts.size() > 1)
+  {
+    // a chunk without a readable frame never opened its video
+    std::vector<std::string> written_parts;
+    std::vector<uint64_t> written_frame_counts;
+    for(size_t i = 0; i < parts.size(); ++i)
+    {
+      if(frame_counts[i] == 0)
+        continue;
+      written_parts.push_back(parts[i]);
+      written_frame_counts.push_back(frame_counts[i]);
+    }
+    is_ok = !written_parts.empty() &&
+            concatenateVideos(written_parts, written_frame_counts, options.fps, options.output);
+  }
+#endif
+  if(frames_written == 0)
+  {
+    std::cerr << "No frame of " << options.input << " could be read." << std::endl;
+    is_ok = false;
+  }
+  if(parts.size() > 1)
+    for(size_t i = 0; i < parts.size(); ++i)
+      std::remove(parts[i].c_str());
+
+  double duration = (ros::WallTime::now() - start).toSec();
+  if(!is_ok)
+  {
+    std::cerr << "Encoding failed." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::cout << "Encoded " << frames_written << " frames to " << options.output << " in " << duration << "s ("
+            << (duration > 0.0 ? frames_written / duration : 0.0) << " fps)." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,52 @@
+/** @file
+ *
+ * Interface of the video encoders the encoding pipeline writes frames with.
+ *
+ * @author Jan Razlaw
+ */
+
+#include "video_recorder/encoder.h"
+
+#include <ros/console.h>
+
+#include "video_recorder/image_sequence_encoder.h"
+#include "video_recorder/opencv_encoder.h"
+#ifdef VIDEO_RECORDER_HAVE_LIBAV
+#include "video_recorder/libav_encoder.h"
+#endif
+
+namespace video_recorder
+{
+
+EncoderPtr createEncoder(const EncoderParameters& params)
+{
+  if(params.backend == "libav")
+  {
+#ifdef VIDEO_RECORDER_HAVE_LIBAV
+    return EncoderPtr(new LibavEncoder(params));
+#else
+    ROS_WARN_ONCE("video_recorder was built without libavcodec. Using the OpenCV encoder instead.");
+#endif
+  }
+  else if(params.backend == "images")
+  {
+    return EncoderPtr(new ImageSequenceEncoder(params));
+  }
+  else if(params.backend != "opencv")
+  {
+    ROS_WARN_STREAM("Unknown encoder backend " << params.backend << ". Using the OpenCV encoder instead.");
+  }
+
+  return EncoderPtr(new OpenCVEncoder(params.fourcc));
+}
+
+bool isLibavAvailable()
+{
+#ifdef VIDEO_RECORDER_HAVE_LIBAV
+  return true;
+#else
+  return false;
+#endif
+}
+
+}  // namespace video_recorder
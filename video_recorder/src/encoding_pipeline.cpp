@@ -0,0 +1,267 @@
+/** @file
+ *
+ * Multi-threaded pipeline that converts, watermarks and encodes frames into a video.
+ *
+ * @author Jan Razlaw
+ */
+
+#include "video_recorder/encoding_pipeline.h"
+
+namespace video_recorder
+{
+
+int recordingFps(const rviz_cinematographer_msgs::Record& record_params)
+{
+  int max_fps = 120;
+  if(record_params.compress == 0)
+    max_fps = 60;
+
+  return std::max(1, std::min(max_fps, (int)record_params.frames_per_second));
+}
+
+void setRecordingParameters(const rviz_cinematographer_msgs::Record& record_params,
+                            const std::string& compressed_codec,
+                            RecordingParameters& params)
+{
+  EncoderParameters& encoder = params.encoder;
+  if(encoder.backend == "libav")
+  {
+    // uncompressed recordings are encoded losslessly
+    encoder.codec = record_params.compress > 0 ? compressed_codec : "ffv1";
+  }
+  else if(record_params.compress > 0)
+    encoder.fourcc = cv::VideoWriter::fourcc('D', 'I', 'V', 'X');
+  else
+    encoder.fourcc = cv::VideoWriter::fourcc('P', 'I', 'M', '1');
+
+  // the view controller renders at the same rate
+  params.fps = recordingFps(record_params);
+
+  params.path_to_output = record_params.path_to_output;
+  params.add_watermark = record_params.add_watermark > 0;
+}
+
+EncodingPipeline::EncodingPipeline(size_t queue_capacity, unsigned int num_workers)
+  : intake_queue_(queue_capacity)
+    , next_seq_to_push_(0)
+    , next_seq_to_write_(0)
+    , reorder_window_(std::max<size_t>(1, queue_capacity))
+    , shutdown_(false)
+{
+  if(num_workers == 0)
+    num_workers = std::max(2u, boost::thread::hardware_concurrency()) - 1;
+
+  for(unsigned int i = 0; i < num_workers; ++i)
+    workers_.create_thread(boost::bind(&EncodingPipeline::workerLoop, this));
+
+  writer_ = boost::thread(boost::bind(&EncodingPipeline::writerLoop, this));
+}
+
+EncodingPipeline::~EncodingPipeline()
+{
+  intake_queue_.close();
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    shutdown_ = true;
+    reorder_changed_.notify_all();
+    all_written_.notify_all();
+  }
+  workers_.join_all();
+  writer_.join();
+
+  if(encoder_)
+    encoder_->close();
+}
+
+void EncodingPipeline::start(const RecordingParameters& params)
+{
+  bool is_recording = false;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    is_recording = next_seq_to_push_ != 0 || (encoder_ && encoder_->isOpened());
+  }
+  // close a recording that was never finished
+  if(is_recording)
+    finish();
+
+  boost::mutex::scoped_lock lock(mutex_);
+  params_ = params;
+  watermark_.reset();
+  stats_ = PipelineStats();
+  intake_queue_.resetStats();
+}
+
+bool EncodingPipeline::push(Frame frame)
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if(next_seq_to_push_ == 0)
+      first_intake_time_ = ros::WallTime::now();
+    frame.seq = next_seq_to_push_++;
+  }
+
+  frame.enqueue_time = ros::WallTime::now();
+  return intake_queue_.push(std::move(frame));
+}
+
+PipelineStats EncodingPipeline::finish()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  while(next_seq_to_write_ != next_seq_to_push_ && !shutdown_)
+    all_written_.wait(lock);
+
+  if(encoder_)
+    encoder_->close();
+  encoder_.reset();
+
+  if(next_seq_to_push_ > 0)
+    stats_.duration = (ros::WallTime::now() - first_intake_time_).toSec();
+  stats_.intake = intake_queue_.stats();
+
+  next_seq_to_push_ = 0;
+  next_seq_to_write_ = 0;
+  reorder_changed_.notify_all();
+
+  return stats_;
+}
+
+void EncodingPipeline::workerLoop()
+{
+  Frame frame;
+  // blocks until a frame arrives - returns false once the queue is closed
+  while(intake_queue_.pop(frame))
+  {
+    ros::WallTime start = ros::WallTime::now();
+
+    bool is_shared = false;
+    uint64_t bytes_copied = 0;
+    bool is_valid = convertFrame(frame, is_shared, bytes_copied);
+
+    boost::shared_ptr<const Watermark> watermark;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stats_.queue_latency.add((start - frame.enqueue_time).toSec());
+
+      if(is_valid && params_.add_watermark && params_.watermarks)
+      {
+        // look up the watermark fitting the video image size only once per recording
+        if(!watermark_)
+          watermark_ = params_.watermarks->get(frame.image.cols, params_.watermark_opacity,
+                                               params_.watermark_position);
+        watermark = watermark_;
+      }
+    }
+
+    if(watermark && !watermark->empty())
+    {
+      // copy only if the image still references the received message
+      if(is_shared)
+      {
+        frame.image = frame.image.clone();
+        frame.image_owner.reset();
+        bytes_copied += frame.image.total() * frame.image.elemSize();
+      }
+      watermark->apply(frame.image);
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      // don't run ahead of the writer too far to bound the number of frames held in memory
+      while(frame.seq >= next_seq_to_write_ + reorder_window_ && !shutdown_)
+        reorder_changed_.wait(lock);
+
+      // invalid frames are passed on without image so that the writer can skip them
+      if(!is_valid)
+        frame.image.release();
+
+      stats_.bytes_copied += bytes_copied;
+      uint64_t seq = frame.seq;
+      reordered_frames_[seq] = std::move(frame);
+      reorder_changed_.notify_all();
+    }
+
+    intake_queue_.taskDone();
+    frame = Frame();
+  }
+}
+
+void EncodingPipeline::writerLoop()
+{
+  bool open_failed = false;
+
+  boost::mutex::scoped_lock lock(mutex_);
+  while(true)
+  {
+    while(!shutdown_ && (reordered_frames_.empty() || reordered_frames_.begin()->first != next_seq_to_write_))
+      reorder_changed_.wait(lock);
+
+    if(shutdown_)
+      break;
+
+    Frame frame = std::move(reordered_frames_.begin()->second);
+    reordered_frames_.erase(reordered_frames_.begin());
+    RecordingParameters params = params_;
+    if(frame.seq == 0)
+      open_failed = false;
+    if(!encoder_ && !open_failed)
+      encoder_ = createEncoder(params.encoder);
+    EncoderPtr encoder = encoder_;
+    lock.unlock();
+
+    bool is_written = false;
+    if(!frame.image.empty())
+    {
+      cv::Size img_size(frame.image.cols, frame.image.rows);
+
+      if(encoder && !encoder->isOpened() && !open_failed)
+      {
+        if(!encoder->open(params.path_to_output, params.fps, img_size))
+        {
+          ROS_ERROR_STREAM("Could not open the output video to write file in : " << params.path_to_output);
+          open_failed = true;
+        }
+      }
+
+      if(encoder && encoder->isOpened())
+        is_written = encoder->write(frame.image, frame.image_owner);
+    }
+
+    lock.lock();
+    if(is_written)
+      stats_.frames_written++;
+    next_seq_to_write_++;
+    reorder_changed_.notify_all();
+    if(next_seq_to_write_ == next_seq_to_push_)
+      all_written_.notify_all();
+  }
+}
+
+bool EncodingPipeline::convertFrame(Frame& frame, bool& is_shared, uint64_t& bytes_copied)
+{
+  is_shared = frame.image_owner && !frame.is_writable;
+  bytes_copied = 0;
+  if(!frame.message)
+    return !frame.image.empty();
+
+  try
+  {
+    // shares the message's data if it already is BGR8 - keep the CvImage to keep the message alive
+    cv_bridge::CvImageConstPtr cv_image = cv_bridge::toCvShare(frame.message, sensor_msgs::image_encodings::BGR8);
+    frame.image = cv_image->image;
+    frame.image_owner = cv_image;
+
+    is_shared = !frame.message->data.empty() && frame.image.data == &frame.message->data[0];
+    if(!is_shared)
+      bytes_copied = frame.image.total() * frame.image.elemSize();
+  }
+  catch(cv_bridge::Exception& e)
+  {
+    ROS_ERROR("Failed to convert sensor_msgs::Image to cv_bridge::CvImage : cv_bridge exception: %s", e.what());
+    return false;
+  }
+
+  frame.message.reset();
+  return true;
+}
+
+}  // namespace video_recorder
@@ -0,0 +1,322 @@
+/** @file
+ *
+ * Ring of raw BGR8 frames in a preallocated, memory-mapped file that survives a crash of the recorder.
+ *
+ * @author Jan Razlaw
+ */
+
+#include "video_recorder/frame_spool.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+
+#include <ros/console.h>
+
+namespace video_recorder
+{
+
+static const uint64_t SPOOL_MAGIC = 0x4c4f4f5053434552ull;  // "RECSPOOL"
+static const uint32_t SPOOL_VERSION = 1;
+
+enum SlotState
+{
+  SLOT_FREE = 0,
+  SLOT_WRITTEN,
+  SLOT_CONSUMED,
+};
+
+/** @brief Releases the slot of a frame returned by FrameSpool::read() on destruction. */
+class SpoolLease
+{
+public:
+  SpoolLease(const boost::function<void()>& release)
+    : release_(release)
+  {
+  }
+
+  ~SpoolLease()
+  {
+    release_();
+  }
+
+private:
+  boost::function<void()> release_;
+};
+
+FrameSpool::FrameSpool()
+  : mapping_(NULL)
+    , mapping_bytes_(0)
+    , header_(NULL)
+    , index_(NULL)
+    , data_(NULL)
+    , read_index_(0)
+    , generation_(0)
+    , closed_(false)
+{
+}
+
+FrameSpool::~FrameSpool()
+{
+  close();
+  boost::mutex::scoped_lock lock(mutex_);
+  unmap();
+}
+
+bool FrameSpool::create(const std::string& path, const cv::Size& frame_size, size_t max_bytes, int fps)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  // slots of the old file might still be referenced by frames in the encoding pipeline
+  while(header_ && header_->release_index != header_->write_index && !closed_)
+    changed_.wait(lock);
+  if(closed_)
+    return false;
+  unmap();
+
+  uint64_t slot_bytes = static_cast<uint64_t>(frame_size.width) * frame_size.height * 3;
+  if(slot_bytes == 0)
+    return false;
+  // round slots up to whole pages so that every frame starts page-aligned
+  long page_size = sysconf(_SC_PAGESIZE);
+  slot_bytes = (slot_bytes + page_size - 1) / page_size * page_size;
+  uint64_t slot_count = std::max<uint64_t>(2, max_bytes / slot_bytes);
+
+  uint64_t index_offset = sizeof(SpoolHeader);
+  uint64_t data_offset = index_offset + slot_count * sizeof(SpoolSlot);
+  data_offset = (data_offset + page_size - 1) / page_size * page_size;
+  size_t file_bytes = data_offset + slot_count * slot_bytes;
+
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+  {
+    ROS_ERROR_STREAM("Could not create spool file " << path << ": " << strerror(errno));
+    return false;
+  }
+
+  // reserve the disk space up front so that appending never fails on a full disk
+  int error = posix_fallocate(fd, 0, static_cast<off_t>(file_bytes));
+  if(error != 0)
+  {
+    ROS_ERROR_STREAM("Could not allocate " << file_bytes << " bytes for spool file " << path << ": "
+                     << strerror(error));
+    ::close(fd);
+    return false;
+  }
+
+  bool is_mapped = map(fd, file_bytes);
+  ::close(fd);
+  if(!is_mapped)
+    return false;
+
+  index_ = reinterpret_cast<SpoolSlot*>(mapping_ + index_offset);
+  std::memset(index_, 0, slot_count * sizeof(SpoolSlot));
+  header_->version = SPOOL_VERSION;
+  header_->index_offset = static_cast<uint32_t>(index_offset);
+  header_->data_offset = data_offset;
+  header_->slot_count = slot_count;
+  header_->slot_bytes = slot_bytes;
+  header_->width = frame_size.width;
+  header_->height = frame_size.height;
+  header_->fps = fps;
+  header_->write_index = 0;
+  header_->release_index = 0;
+  data_ = mapping_ + data_offset;
+  // a valid magic marks the header as complete
+  __sync_synchronize();
+  header_->magic = SPOOL_MAGIC;
+
+  read_index_ = 0;
+  changed_.notify_all();
+  ROS_INFO_STREAM("Spooling up to " << slot_count << " frames of " << frame_size.width << "x" << frame_size.height
+                  << " to " << path << ".");
+  return true;
+}
+
+bool FrameSpool::open(const std::string& path)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  unmap();
+
+  int fd = ::open(path.c_str(), O_RDWR);
+  if(fd < 0)
+    return false;
+
+  struct stat file_stat;
+  bool is_mapped = fstat(fd, &file_stat) == 0 && static_cast<size_t>(file_stat.st_size) >= sizeof(SpoolHeader) &&
+                   map(fd, static_cast<size_t>(file_stat.st_size));
+  ::close(fd);
+  if(!is_mapped)
+    return false;
+
+  const SpoolHeader& header = *header_;
+  bool is_valid = header.magic == SPOOL_MAGIC && header.version == SPOOL_VERSION && header.slot_count > 0 &&
+                  header.index_offset + header.slot_count * sizeof(SpoolSlot) <= header.data_offset &&
+                  header.data_offset + header.slot_count * header.slot_bytes <= mapping_bytes_ &&
+                  static_cast<uint64_t>(header.width) * header.height * 3 <= header.slot_bytes &&
+                  header.release_index <= header.write_index &&
+                  header.write_index - header.release_index <= header.slot_count;
+  if(!is_valid)
+  {
+    ROS_ERROR_STREAM(path << " is no valid spool file.");
+    unmap();
+    return false;
+  }
+
+  index_ = reinterpret_cast<SpoolSlot*>(mapping_ + header.index_offset);
+  data_ = mapping_ + header.data_offset;
+  // frames that were read but not consumed before the crash are read again
+  read_index_ = header.release_index;
+  changed_.notify_all();
+  return true;
+}
+
+bool FrameSpool::isOpen() const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return header_ != NULL;
+}
+
+cv::Size FrameSpool::frameSize() const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return header_ ? cv::Size(header_->width, header_->height) : cv::Size();
+}
+
+int FrameSpool::fps() const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return header_ ? header_->fps : 0;
+}
+
+size_t FrameSpool::capacity() const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return header_ ? static_cast<size_t>(header_->slot_count) : 0;
+}
+
+size_t FrameSpool::unread() const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return header_ ? static_cast<size_t>(header_->write_index - read_index_) : 0;
+}
+
+bool FrameSpool::append(const cv::Mat& image)
+{
+  // one append at a time - the copy below runs without holding the mutex
+  boost::mutex::scoped_lock append_lock(append_mutex_);
+  boost::mutex::scoped_lock lock(mutex_);
+  while(header_ && header_->write_index - header_->release_index >= header_->slot_count && !closed_)
+    changed_.wait(lock);
+
+  if(closed_ || !header_ || image.type() != CV_8UC3 || image.cols != header_->width || image.rows != header_->height)
+    return false;
+
+  uint64_t index = header_->write_index;
+  unsigned char* data = slotData(index);
+  size_t row_bytes = static_cast<size_t>(image.cols) * 3;
+  // the slot is neither read nor released while it is not published, so copy without holding the lock
+  lock.unlock();
+  for(int row = 0; row < image.rows; ++row)
+    std::memcpy(data + row * row_bytes, image.ptr(row), row_bytes);
+  lock.lock();
+
+  slot(index).index = index;
+  slot(index).state = SLOT_WRITTEN;
+  // publish the frame only after its pixels and index entry are written
+  __sync_synchronize();
+  header_->write_index = index + 1;
+  changed_.notify_all();
+  return true;
+}
+
+bool FrameSpool::read(cv::Mat& image, boost::shared_ptr<const void>& lease, bool blocking)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  while(blocking && (!header_ || read_index_ == header_->write_index) && !closed_)
+    changed_.wait(lock);
+
+  if(!header_ || read_index_ == header_->write_index)
+    return false;
+
+  uint64_t index = read_index_++;
+  image = cv::Mat(header_->height, header_->width, CV_8UC3, slotData(index));
+  lease = boost::shared_ptr<const void>(new SpoolLease(boost::bind(&FrameSpool::release, this, index, generation_)));
+  changed_.notify_all();
+  return true;
+}
+
+bool FrameSpool::peek(size_t offset, cv::Mat& image)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  if(!header_ || offset >= header_->write_index - read_index_)
+    return false;
+
+  image = cv::Mat(header_->height, header_->width, CV_8UC3, slotData(read_index_ + offset));
+  return true;
+}
+
+void FrameSpool::waitUntilRead()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  while(header_ && read_index_ != header_->write_index && !closed_)
+    changed_.wait(lock);
+}
+
+void FrameSpool::close()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  closed_ = true;
+  changed_.notify_all();
+}
+
+void FrameSpool::release(uint64_t index, uint64_t generation)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  if(!header_ || generation != generation_ || index < header_->release_index || index >= header_->write_index)
+    return;
+
+  slot(index).state = SLOT_CONSUMED;
+  // slots are reused in ring order, so only advance over consecutive consumed frames
+  while(header_->release_index < header_->write_index && slot(header_->release_index).state == SLOT_CONSUMED)
+  {
+    slot(header_->release_index).state = SLOT_FREE;
+    header_->release_index++;
+  }
+  changed_.notify_all();
+}
+
+bool FrameSpool::map(int fd, size_t file_bytes)
+{
+  void* mapping = mmap(NULL, file_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(mapping == MAP_FAILED)
+  {
+    ROS_ERROR_STREAM("Could not map spool file: " << strerror(errno));
+    return false;
+  }
+
+  mapping_ = static_cast<unsigned char*>(mapping);
+  mapping_bytes_ = file_bytes;
+  header_ = reinterpret_cast<SpoolHeader*>(mapping_);
+  generation_++;
+  return true;
+}
+
+void FrameSpool::unmap()
+{
+  if(mapping_)
+    munmap(mapping_, mapping_bytes_);
+  mapping_ = NULL;
+  mapping_bytes_ = 0;
+  header_ = NULL;
+  index_ = NULL;
+  data_ = NULL;
+}
+
+}  // namespace video_recorder
@@ -0,0 +1,190 @@
+/** @file
+ *
+ * Encoder backend writing each frame to a numbered image file.
+ *
+ * @author Jan Razlaw
+ */
+
+#include "video_recorder/image_sequence_encoder.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <ros/console.h>
+
+namespace video_recorder
+{
+
+ImageSequenceEncoder::ImageSequenceEncoder(const EncoderParameters& params)
+  : params_(params)
+    , jobs_(1)
+    , is_open_(false)
+    , next_index_(0)
+    , failed_writes_(0)
+{
+  if(params_.image_format == "tiff" || params_.image_format == "tif")
+  {
+    format_ = "tiff";
+    extension_ = "tiff";
+  }
+  else if(params_.image_format == "raw")
+  {
+    format_ = "raw";
+    extension_ = "bgr";
+  }
+  else
+  {
+    if(params_.image_format != "png")
+      ROS_WARN_STREAM("Unknown image format " << params_.image_format << ". Writing png images.");
+    format_ = "png";
+    extension_ = "png";
+    // low levels compress fast and still save most of the space of uncompressed images
+    imwrite_params_.push_back(cv::IMWRITE_PNG_COMPRESSION);
+    imwrite_params_.push_back(std::max(0, std::min(9, params_.compression_level)));
+  }
+
+  unsigned int num_threads = params_.threads > 0 ? static_cast<unsigned int>(params_.threads)
+                                                 : std::max(1u, boost::thread::hardware_concurrency());
+  for(unsigned int i = 0; i < num_threads; ++i)
+    writers_.create_thread(boost::bind(&ImageSequenceEncoder::writerLoop, this));
+}
+
+ImageSequenceEncoder::~ImageSequenceEncoder()
+{
+  close();
+  jobs_.close();
+  writers_.join_all();
+}
+
+bool ImageSequenceEncoder::open(const std::string& path, int fps, const cv::Size& size)
+{
+  close();
+
+  // strip the extension of the video file
+  std::string directory = path;
+  std::string::size_type extension_begin = directory.find_last_of('.');
+  if(extension_begin != std::string::npos && extension_begin > 0 &&
+     directory.find('/', extension_begin) == std::string::npos)
+    directory.erase(extension_begin);
+
+  if(mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+  {
+    ROS_ERROR_STREAM("Could not create directory " << directory << " for the image sequence.");
+    return false;
+  }
+
+  cv::FileStorage info(directory + "/sequence.yaml", cv::FileStorage::WRITE);
+  if(info.isOpened())
+  {
+    info << "width" << size.width;
+    info << "height" << size.height;
+    info << "fps" << fps;
+    info << "format" << format_;
+    info << "extension" << extension_;
+    info << "encoding" << "bgr8";
+    info.release();
+  }
+
+  // bound the memory of frames waiting to be written - the writers hold one more frame each
+  size_t frame_bytes = std::max<size_t>(1, static_cast<size_t>(size.area()) * 3);
+  size_t max_frames = params_.max_in_flight_bytes / frame_bytes;
+  size_t num_writers = writers_.size();
+  jobs_.setCapacity(max_frames > num_writers ? max_frames - num_writers : 1);
+  jobs_.resetStats();
+
+  boost::mutex::scoped_lock lock(mutex_);
+  directory_ = directory;
+  next_index_ = 0;
+  failed_writes_ = 0;
+  is_open_ = true;
+  return true;
+}
+
+bool ImageSequenceEncoder::write(const cv::Mat& image, const boost::shared_ptr<const void>& image_owner)
+{
+  Job job;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if(!is_open_)
+      return false;
+    job.index = next_index_++;
+  }
+
+  // images referencing memory they don't own are only safe to keep if their owner is kept as well
+  job.image = image;
+  job.image_owner = image_owner;
+  if(!image_owner && !image.u)
+    job.image = image.clone();
+
+  // blocks while the in-flight budget is used up
+  return jobs_.push(std::move(job));
+}
+
+void ImageSequenceEncoder::close()
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if(!is_open_)
+      return;
+    is_open_ = false;
+  }
+
+  jobs_.waitUntilDrained();
+
+  FrameQueueStats stats = jobs_.stats();
+  boost::mutex::scoped_lock lock(mutex_);
+  if(failed_writes_ > 0)
+    ROS_ERROR_STREAM("Could not write " << failed_writes_ << " images to " << directory_ << ".");
+  ROS_INFO_STREAM("Wrote " << next_index_ - failed_writes_ << " images to " << directory_ << ", "
+                  << stats.blocked_pushes << " frames waited for the disk.");
+}
+
+bool ImageSequenceEncoder::isOpened() const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return is_open_;
+}
+
+void ImageSequenceEncoder::writerLoop()
+{
+  Job job;
+  while(jobs_.pop(job))
+  {
+    if(!writeImage(job))
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      failed_writes_++;
+    }
+
+    job = Job();
+    jobs_.taskDone();
+  }
+}
+
+bool ImageSequenceEncoder::writeImage(const Job& job)
+{
+  std::string directory;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    directory = directory_;
+  }
+
+  char file_name[32];
+  snprintf(file_name, sizeof(file_name), "/frame_%06llu.", static_cast<unsigned long long>(job.index));
+  std::string path = directory + file_name + extension_;
+
+  if(format_ != "raw")
+    return cv::imwrite(path, job.image, imwrite_params_);
+
+  std::ofstream file(path.c_str(), std::ios::binary);
+  size_t row_bytes = static_cast<size_t>(job.image.cols) * job.image.elemSize();
+  for(int row = 0; row < job.image.rows && file; ++row)
+    file.write(reinterpret_cast<const char*>(job.image.ptr(row)), row_bytes);
+  return static_cast<bool>(file);
+}
+
+}  // namespace video_recorder
@@ -0,0 +1,378 @@
+/** @file
+ *
+ * Encoder backend using libavcodec and libavformat.
+ *
+ * @author Jan Razlaw
+ */
+
+#include "video_recorder/libav_encoder.h"
+
+#include <algorithm>
+
+#include <ros/console.h>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+}
+
+namespace video_recorder
+{
+
+static std::string errorString(int error)
+{
+  char buffer[AV_ERROR_MAX_STRING_SIZE] = {0};
+  av_strerror(error, buffer, sizeof(buffer));
+  return std::string(buffer);
+}
+
+LibavEncoder::LibavEncoder(const EncoderParameters& params)
+  : params_(params)
+    , format_context_(NULL)
+    , codec_context_(NULL)
+    , stream_(NULL)
+    , frame_(NULL)
+    , packet_(NULL)
+    , sws_context_(NULL)
+    , next_pts_(0)
+    , is_header_written_(false)
+{
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 9, 100)
+  av_register_all();
+#endif
+}
+
+LibavEncoder::~LibavEncoder()
+{
+  close();
+}
+
+bool LibavEncoder::open(const std::string& path, int fps, const cv::Size& size)
+{
+  close();
+
+  // choose encoder and the pixel format it gets the images in
+  const char* encoder_name = NULL;
+  AVCodecID codec_id = AV_CODEC_ID_NONE;
+  AVPixelFormat pixel_format = AV_PIX_FMT_YUV420P;
+  if(params_.codec == "h264")
+  {
+    encoder_name = "libx264";
+    codec_id = AV_CODEC_ID_H264;
+  }
+  else if(params_.codec == "h265" || params_.codec == "hevc")
+  {
+    encoder_name = "libx265";
+    codec_id = AV_CODEC_ID_HEVC;
+  }
+  else if(params_.codec == "ffv1")
+  {
+    encoder_name = "ffv1";
+    codec_id = AV_CODEC_ID_FFV1;
+    // lossless
+    pixel_format = AV_PIX_FMT_GBRP;
+  }
+  else
+  {
+    ROS_ERROR_STREAM("Unknown codec " << params_.codec << ". Expected h264, h265 or ffv1.");
+    return false;
+  }
+
+  const AVCodec* codec = avcodec_find_encoder_by_name(encoder_name);
+  if(!codec)
+    codec = avcodec_find_encoder(codec_id);
+  if(!codec)
+  {
+    ROS_ERROR_STREAM("libavcodec has no encoder for " << params_.codec << ".");
+    return false;
+  }
+
+  // container is deduced from the file extension
+  avformat_alloc_output_context2(&format_context_, NULL, NULL, path.c_str());
+  if(!format_context_)
+    avformat_alloc_output_context2(&format_context_, NULL, "matroska", path.c_str());
+  if(!format_context_)
+  {
+    ROS_ERROR_STREAM("Could not create a container for " << path << ".");
+    return false;
+  }
+
+  // 4:2:0 chroma subsampling needs even dimensions - drop the last column or row like OpenCV's writer does
+  cv::Size encoded_size = size;
+  if(pixel_format == AV_PIX_FMT_YUV420P)
+  {
+    encoded_size.width &= ~1;
+    encoded_size.height &= ~1;
+    if(encoded_size != size)
+      ROS_WARN_STREAM("Cropping " << size.width << "x" << size.height << " frames to " << encoded_size.width << "x"
+                      << encoded_size.height << " for " << codec->name << ".");
+  }
+
+  codec_context_ = avcodec_alloc_context3(codec);
+  codec_context_->width = encoded_size.width;
+  codec_context_->height = encoded_size.height;
+  codec_context_->pix_fmt = pixel_format;
+  codec_context_->time_base.num = 1;
+  codec_context_->time_base.den = fps;
+  codec_context_->framerate.num = fps;
+  codec_context_->framerate.den = 1;
+  codec_context_->gop_size = params_.gop_size > 0 ? params_.gop_size : 10 * fps;
+  codec_context_->thread_count = std::max(0, params_.threads);
+  if(format_context_->oformat->flags & AVFMT_GLOBALHEADER)
+    codec_context_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+  if(codec_id == AV_CODEC_ID_FFV1)
+  {
+    // version 3 encodes slices in parallel
+    codec_context_->level = 3;
+  }
+  else
+  {
+    av_opt_set(codec_context_->priv_data, "preset", params_.preset.c_str(), 0);
+    av_opt_set(codec_context_->priv_data, "crf", std::to_string(params_.crf).c_str(), 0);
+  }
+
+  int error = avcodec_open2(codec_context_, codec, NULL);
+  if(error < 0)
+  {
+    ROS_ERROR_STREAM("Could not open encoder " << codec->name << ": " << errorString(error));
+    release();
+    return false;
+  }
+
+  stream_ = avformat_new_stream(format_context_, NULL);
+  if(!stream_)
+  {
+    ROS_ERROR("Could not create the video stream.");
+    release();
+    return false;
+  }
+  stream_->time_base = codec_context_->time_base;
+  avcodec_parameters_from_context(stream_->codecpar, codec_context_);
+
+  if(!(format_context_->oformat->flags & AVFMT_NOFILE))
+  {
+    error = avio_open(&format_context_->pb, path.c_str(), AVIO_FLAG_WRITE);
+    if(error < 0)
+    {
+      ROS_ERROR_STREAM("Could not open " << path << ": " << errorString(error));
+      release();
+      return false;
+    }
+  }
+
+  error = avformat_write_header(format_context_, NULL);
+  if(error < 0)
+  {
+    ROS_ERROR_STREAM("Could not write the header of " << path << ": " << errorString(error));
+    release();
+    return false;
+  }
+  is_header_written_ = true;
+
+  frame_ = av_frame_alloc();
+  frame_->format = pixel_format;
+  frame_->width = encoded_size.width;
+  frame_->height = encoded_size.height;
+  packet_ = av_packet_alloc();
+  // reads only the encoded part of each image
+  sws_context_ = sws_getContext(encoded_size.width, encoded_size.height, AV_PIX_FMT_BGR24,
+                                encoded_size.width, encoded_size.height, pixel_format,
+                                SWS_BILINEAR, NULL, NULL, NULL);
+  if(!packet_ || !sws_context_ || av_frame_get_buffer(frame_, 32) < 0)
+  {
+    ROS_ERROR("Could not allocate the buffers of the encoder.");
+    release();
+    return false;
+  }
+
+  size_ = size;
+  next_pts_ = 0;
+  return true;
+}
+
+bool LibavEncoder::write(const cv::Mat& image, const boost::shared_ptr<const void>& /*image_owner*/)
+{
+  if(!isOpened() || image.type() != CV_8UC3 || image.size() != size_)
+    return false;
+
+  if(av_frame_make_writable(frame_) < 0)
+    return false;
+
+  const uint8_t* source[1] = {image.data};
+  int source_stride[1] = {static_cast<int>(image.step[0])};
+  sws_scale(sws_context_, source, source_stride, 0, frame_->height, frame_->data, frame_->linesize);
+
+  frame_->pts = next_pts_++;
+  return encode(frame_);
+}
+
+void LibavEncoder::close()
+{
+  if(isOpened())
+  {
+    encode(NULL);
+    av_write_trailer(format_context_);
+  }
+  release();
+}
+
+bool LibavEncoder::isOpened() const
+{
+  return is_header_written_ && frame_ != NULL;
+}
+
+bool LibavEncoder::encode(AVFrame* frame)
+{
+  int error = avcodec_send_frame(codec_context_, frame);
+  if(error < 0)
+  {
+    ROS_ERROR_STREAM("Could not encode frame: " << errorString(error));
+    return false;
+  }
+
+  while(true)
+  {
+    error = avcodec_receive_packet(codec_context_, packet_);
+    if(error == AVERROR(EAGAIN) || error == AVERROR_EOF)
+      return true;
+    if(error < 0)
+    {
+      ROS_ERROR_STREAM("Could not encode frame: " << errorString(error));
+      return false;
+    }
+
+    av_packet_rescale_ts(packet_, codec_context_->time_base, stream_->time_base);
+    packet_->stream_index = stream_->index;
+    // takes ownership of the packet's data
+    error = av_interleaved_write_frame(format_context_, packet_);
+    if(error < 0)
+    {
+      ROS_ERROR_STREAM("Could not write packet: " << errorString(error));
+      return false;
+    }
+  }
+}
+
+void LibavEncoder::release()
+{
+  if(format_context_)
+  {
+    if(!(format_context_->oformat->flags & AVFMT_NOFILE) && format_context_->pb)
+      avio_closep(&format_context_->pb);
+    avformat_free_context(format_context_);
+    format_context_ = NULL;
+  }
+  stream_ = NULL;
+
+  avcodec_free_context(&codec_context_);
+  av_frame_free(&frame_);
+  av_packet_free(&packet_);
+
+  sws_freeContext(sws_context_);
+  sws_context_ = NULL;
+
+  is_header_written_ = false;
+}
+
+bool concatenateVideos(const std::vector<std::string>& parts,
+                       const std::vector<uint64_t>& frame_counts,
+                       int fps,
+                       const std::string& path)
+{
+  AVFormatContext* output = NULL;
+  AVStream* output_stream = NULL;
+  AVPacket* packet = av_packet_alloc();
+  AVRational frame_time_base = {1, fps};
+  int64_t first_frame = 0;
+  bool is_ok = packet != NULL && parts.size() == frame_counts.size();
+
+  for(size_t i = 0; i < parts.size() && is_ok; ++i)
+  {
+    AVFormatContext* input = NULL;
+    int error = avformat_open_input(&input, parts[i].c_str(), NULL, NULL);
+    if(error >= 0)
+      error = avformat_find_stream_info(input, NULL);
+    int stream_index = error >= 0 ? av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0) : error;
+    if(stream_index < 0)
+    {
+      ROS_ERROR_STREAM("Could not read video " << parts[i] << ": " << errorString(stream_index));
+      if(input)
+        avformat_close_input(&input);
+      is_ok = false;
+      break;
+    }
+    AVStream* input_stream = input->streams[stream_index];
+
+    // the first part defines the stream of the result
+    if(!output)
+    {
+      avformat_alloc_output_context2(&output, NULL, NULL, path.c_str());
+      if(!output)
+        avformat_alloc_output_context2(&output, NULL, "matroska", path.c_str());
+      output_stream = output ? avformat_new_stream(output, NULL) : NULL;
+      if(output_stream)
+      {
+        avcodec_parameters_copy(output_stream->codecpar, input_stream->codecpar);
+        output_stream->codecpar->codec_tag = 0;
+        output_stream->time_base = input_stream->time_base;
+        error = 0;
+        if(!(output->oformat->flags & AVFMT_NOFILE))
+          error = avio_open(&output->pb, path.c_str(), AVIO_FLAG_WRITE);
+        if(error >= 0)
+          error = avformat_write_header(output, NULL);
+      }
+      if(!output_stream || error < 0)
+      {
+        ROS_ERROR_STREAM("Could not create video " << path << ": " << errorString(error));
+        avformat_close_input(&input);
+        is_ok = false;
+        break;
+      }
+    }
+
+    // all parts share the encoder delay, so shifting by the preceding frames keeps the timestamps increasing
+    int64_t offset = av_rescale_q(first_frame, frame_time_base, output_stream->time_base);
+    while(av_read_frame(input, packet) >= 0)
+    {
+      if(packet->stream_index == stream_index)
+      {
+        av_packet_rescale_ts(packet, input_stream->time_base, output_stream->time_base);
+        if(packet->pts != AV_NOPTS_VALUE)
+          packet->pts += offset;
+        if(packet->dts != AV_NOPTS_VALUE)
+          packet->dts += offset;
+        packet->stream_index = output_stream->index;
+        packet->pos = -1;
+
+        error = av_interleaved_write_frame(output, packet);
+        if(error < 0)
+        {
+          ROS_ERROR_STREAM("Could not write packet to " << path << ": " << errorString(error));
+          is_ok = false;
+          break;
+        }
+      }
+      av_packet_unref(packet);
+    }
+
+    avformat_close_input(&input);
+    first_frame += static_cast<int64_t>(frame_counts[i]);
+  }
+
+  if(output)
+  {
+    if(is_ok)
+      av_write_trailer(output);
+    if(!(output->oformat->flags & AVFMT_NOFILE) && output->pb)
+      avio_closep(&output->pb);
+    avformat_free_context(output);
+  }
+  av_packet_free(&packet);
+  return is_ok;
+}
+
+}  // namespace video_recorder
@@ -0,0 +1,49 @@
+/** @file
+ *
+ * Encoder backend using OpenCV's video writer.
+ *
+ * @author Jan Razlaw
+ */
+
+#include "video_recorder/opencv_encoder.h"
+
+namespace video_recorder
+{
+
+OpenCVEncoder::OpenCVEncoder(int fourcc)
+  : fourcc_(fourcc)
+{
+}
+
+OpenCVEncoder::~OpenCVEncoder()
+{
+  close();
+}
+
+bool OpenCVEncoder::open(const std::string& path, int fps, const cv::Size& size)
+{
+  close();
+  return output_video_.open(path, fourcc_, fps, size, true);
+}
+
+bool OpenCVEncoder::write(const cv::Mat& image, const boost::shared_ptr<const void>& /*image_owner*/)
+{
+  if(!output_video_.isOpened())
+    return false;
+
+  output_video_.write(image);
+  return true;
+}
+
+void OpenCVEncoder::close()
+{
+  if(output_video_.isOpened())
+    output_video_.release();
+}
+
+bool OpenCVEncoder::isOpened() const
+{
+  return output_video_.isOpened();
+}
+
+}  // namespace video_recorder
@@ -0,0 +1,346 @@
+/** @file
+ *
+ * Ring of raw BGR8 frames in POSIX shared memory to pass frames between processes without copying them.
+ *
+ * @author Jan Razlaw
+ */
+
+#include "video_recorder/shared_frame_ring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+
+namespace video_recorder
+{
+
+static const uint64_t SHARED_FRAMES_MAGIC = 0x53454d4152465652ull;  // "RVFRAMES"
+static const uint32_t SHARED_FRAMES_VERSION = 3;
+
+enum SlotState
+{
+  SLOT_FREE = 0,
+  SLOT_WRITTEN,
+  SLOT_CONSUMED,
+};
+
+/** @brief Waits on the semaphore until it is decremented or the timeout passed.
+ *
+ * @return false on timeout.
+ */
+static bool waitFor(sem_t* semaphore, const ros::WallDuration& timeout)
+{
+  timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  int64_t nsec = deadline.tv_nsec + timeout.toNSec();
+  deadline.tv_sec += static_cast<time_t>(nsec / 1000000000);
+  deadline.tv_nsec = static_cast<long>(nsec % 1000000000);
+
+  int result;
+  while((result = sem_timedwait(semaphore, &deadline)) != 0 && errno == EINTR)
+    ;
+  return result == 0;
+}
+
+SharedFrameRing::SharedFrameRing()
+  : is_owner_(false)
+    , mapping_(NULL)
+    , mapping_bytes_(0)
+    , header_(NULL)
+    , index_(NULL)
+    , data_(NULL)
+    , read_index_(0)
+    , write_width_(0)
+    , write_height_(0)
+    , is_writing_(false)
+    , closed_(false)
+{
+}
+
+SharedFrameRing::~SharedFrameRing()
+{
+  close();
+  unmap();
+}
+
+bool SharedFrameRing::create(const std::string& name, size_t max_bytes, size_t max_frame_bytes)
+{
+  unmap();
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  uint64_t slot_bytes = (std::max<uint64_t>(1, max_frame_bytes) + page_size - 1) / page_size * page_size;
+  uint64_t slot_count = std::max<uint64_t>(2, max_bytes / slot_bytes);
+
+  uint64_t index_offset = sizeof(SharedFrameHeader);
+  uint64_t data_offset = index_offset + slot_count * sizeof(SharedFrameSlot);
+  data_offset = (data_offset + page_size - 1) / page_size * page_size;
+  size_t segment_bytes = data_offset + slot_count * slot_bytes;
+
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(fd < 0 && errno == EEXIST)
+  {
+    // a segment left by a crashed recorder is of no use to anyone - one of a running recorder is not taken over
+    SharedFrameRing existing;
+    if(existing.open(name) && existing.isReaderAlive())
+    {
+      ROS_ERROR_STREAM("Shared memory segment " << name << " is in use by process " << existing.header_->reader_pid
+                       << ".");
+      return false;
+    }
+
+    shm_unlink(name.c_str());
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  }
+
+  if(fd < 0)
+  {
+    ROS_ERROR_STREAM("Could not create shared memory segment " << name << ": " << strerror(errno));
+    return false;
+  }
+
+  // ftruncate reserves no pages on tmpfs - a write into a page that doesn't fit would raise SIGBUS
+  int error = posix_fallocate(fd, 0, static_cast<off_t>(segment_bytes));
+  if(error != 0)
+  {
+    ROS_ERROR_STREAM("Could not allocate " << segment_bytes << " bytes of shared memory for " << name << ": "
+                     << strerror(error));
+    ::close(fd);
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  bool is_mapped = map(fd, segment_bytes);
+  ::close(fd);
+  if(!is_mapped)
+  {
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  name_ = name;
+  is_owner_ = true;
+  header_->version = SHARED_FRAMES_VERSION;
+  header_->slot_count = static_cast<uint32_t>(slot_count);
+  header_->slot_bytes = slot_bytes;
+  header_->index_offset = index_offset;
+  header_->data_offset = data_offset;
+  header_->reader_pid = static_cast<int32_t>(getpid());
+  header_->is_closed = 0;
+  header_->write_index = 0;
+  header_->release_index = 0;
+  sem_init(&header_->written_frames, 1, 0);
+  sem_init(&header_->free_slots, 1, static_cast<unsigned int>(slot_count));
+  index_ = reinterpret_cast<SharedFrameSlot*>(mapping_ + index_offset);
+  data_ = mapping_ + data_offset;
+  // a valid magic marks the header as complete
+  __sync_synchronize();
+  header_->magic = SHARED_FRAMES_MAGIC;
+
+  read_index_ = 0;
+  ROS_INFO_STREAM("Receiving up to " << slot_count << " frames of up to " << slot_bytes / (1024 * 1024)
+                  << " MB through shared memory segment " << name << ".");
+  return true;
+}
+
+bool SharedFrameRing::open(const std::string& name)
+{
+  unmap();
+
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if(fd < 0)
+    return false;
+
+  struct stat segment_stat;
+  bool is_mapped = fstat(fd, &segment_stat) == 0 &&
+                   static_cast<size_t>(segment_stat.st_size) >= sizeof(SharedFrameHeader) &&
+                   map(fd, static_cast<size_t>(segment_stat.st_size));
+  ::close(fd);
+  if(!is_mapped)
+    return false;
+
+  const SharedFrameHeader& header = *header_;
+  bool is_valid = header.magic == SHARED_FRAMES_MAGIC && header.version == SHARED_FRAMES_VERSION &&
+                  header.slot_count > 0 &&
+                  header.index_offset + header.slot_count * sizeof(SharedFrameSlot) <= header.data_offset &&
+                  header.data_offset + header.slot_count * header.slot_bytes <= mapping_bytes_;
+  if(!is_valid)
+  {
+    ROS_ERROR_STREAM(name << " is no valid shared frame segment.");
+    unmap();
+    return false;
+  }
+
+  name_ = name;
+  index_ = reinterpret_cast<SharedFrameSlot*>(mapping_ + header.index_offset);
+  data_ = mapping_ + header.data_offset;
+  return true;
+}
+
+bool SharedFrameRing::isReaderAlive() const
+{
+  if(!header_ || __atomic_load_n(&header_->is_closed, __ATOMIC_ACQUIRE) != 0)
+    return false;
+  return kill(static_cast<pid_t>(header_->reader_pid), 0) == 0 || errno == EPERM;
+}
+
+size_t SharedFrameRing::capacity() const
+{
+  return header_ ? static_cast<size_t>(header_->slot_count) : 0;
+}
+
+size_t SharedFrameRing::maxFrameBytes() const
+{
+  return header_ ? static_cast<size_t>(header_->slot_bytes) : 0;
+}
+
+uint64_t SharedFrameRing::written() const
+{
+  return header_ ? __atomic_load_n(&header_->write_index, __ATOMIC_ACQUIRE) : 0;
+}
+
+size_t SharedFrameRing::unread() const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return header_ ? static_cast<size_t>(written() - read_index_) : 0;
+}
+
+unsigned char* SharedFrameRing::beginWrite(unsigned int width, unsigned int height, const ros::WallDuration& timeout)
+{
+  if(!header_ || is_writing_ || static_cast<uint64_t>(width) * height * 3 > header_->slot_bytes)
+    return NULL;
+
+  // blocks while the reader holds all slots
+  if(!waitFor(&header_->free_slots, timeout))
+    return NULL;
+
+  // the reader wakes up a waiting writer when it closes the segment
+  if(__atomic_load_n(&header_->is_closed, __ATOMIC_ACQUIRE) != 0)
+    return NULL;
+
+  write_width_ = width;
+  write_height_ = height;
+  is_writing_ = true;
+  return slotData(header_->write_index);
+}
+
+void SharedFrameRing::endWrite(const ros::Time& stamp, uint32_t frame_seq)
+{
+  uint64_t seq = header_->write_index;
+  SharedFrameSlot& written_slot = slot(seq);
+  written_slot.seq = seq;
+  written_slot.width = write_width_;
+  written_slot.height = write_height_;
+  written_slot.frame_seq = frame_seq;
+  written_slot.stamp = stamp.toNSec();
+
+  // publish the frame only after its pixels and index entry are written
+  __atomic_store_n(&header_->write_index, seq + 1, __ATOMIC_RELEASE);
+  sem_post(&header_->written_frames);
+  is_writing_ = false;
+}
+
+void SharedFrameRing::cancelWrite()
+{
+  if(!is_writing_)
+    return;
+  sem_post(&header_->free_slots);
+  is_writing_ = false;
+}
+
+bool SharedFrameRing::read(cv::Mat& image, boost::shared_ptr<const void>& lease, uint32_t& frame_seq)
+{
+  if(!header_)
+    return false;
+
+  // wake up regularly to notice that the ring was closed
+  while(!waitFor(&header_->written_frames, ros::WallDuration(0.1)))
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if(closed_)
+      return false;
+  }
+
+  uint64_t seq = 0;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    seq = read_index_++;
+    slot(seq).state = SLOT_WRITTEN;
+  }
+
+  const SharedFrameSlot& read_slot = slot(seq);
+  unsigned char* data = slotData(seq);
+  image = cv::Mat(static_cast<int>(read_slot.height), static_cast<int>(read_slot.width), CV_8UC3, data);
+  frame_seq = read_slot.frame_seq;
+  // the bound release ignores the pointer passed to the deleter - it keeps the ring mapped until the last lease is gone
+  lease = boost::shared_ptr<const void>(data, boost::bind(&SharedFrameRing::release, shared_from_this(), seq));
+  return true;
+}
+
+void SharedFrameRing::close()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  closed_ = true;
+}
+
+void SharedFrameRing::release(uint64_t seq)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  if(!header_ || seq < header_->release_index)
+    return;
+
+  slot(seq).state = SLOT_CONSUMED;
+  // slots are reused in ring order, so only advance over consecutive consumed frames
+  while(header_->release_index < read_index_ && slot(header_->release_index).state == SLOT_CONSUMED)
+  {
+    slot(header_->release_index).state = SLOT_FREE;
+    header_->release_index++;
+    sem_post(&header_->free_slots);
+  }
+}
+
+bool SharedFrameRing::map(int fd, size_t segment_bytes)
+{
+  void* mapping = mmap(NULL, segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(mapping == MAP_FAILED)
+  {
+    ROS_ERROR_STREAM("Could not map shared memory segment: " << strerror(errno));
+    return false;
+  }
+
+  mapping_ = static_cast<unsigned char*>(mapping);
+  mapping_bytes_ = segment_bytes;
+  header_ = reinterpret_cast<SharedFrameHeader*>(mapping_);
+  return true;
+}
+
+void SharedFrameRing::unmap()
+{
+  if(is_owner_ && header_)
+  {
+    // the writer may be blocked on the semaphores, so they stay intact until its mapping is gone as well
+    __atomic_store_n(&header_->is_closed, 1u, __ATOMIC_RELEASE);
+    sem_post(&header_->free_slots);
+    shm_unlink(name_.c_str());
+  }
+
+  if(mapping_)
+    munmap(mapping_, mapping_bytes_);
+  is_owner_ = false;
+  mapping_ = NULL;
+  mapping_bytes_ = 0;
+  header_ = NULL;
+  index_ = NULL;
+  data_ = NULL;
+  is_writing_ = false;
+}
+
+}  // namespace video_recorder
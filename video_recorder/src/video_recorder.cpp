@@ -10,188 +10,542 @@
 namespace video_recorder
 {
 
+// Seconds without a new frame after which the frames missing at the end of a recording are considered lost
+static const int FRAME_TIMEOUT = 5;
+
 VideoRecorderNodelet::VideoRecorderNodelet()
   : nh_("")
+    , rendering_finished_spinner_(1, &rendering_finished_queue_)
     , max_queue_size_(50)
-    , path_to_output_("")
-    , codec_(cv::VideoWriter::fourcc('D', 'I', 'V', 'X'))
-    , target_fps_(60)
-    , recorded_frames_counter_(0)
-    , add_watermark_(true)
-    , is_watermark_resized_(false)
+    , num_workers_(0)
+    , compressed_codec_("h264")
+    , spool_size_mb_(4096)
+    , shm_name_("")
+    , shm_size_mb_(1024)
+    , shm_max_width_(3840)
+    , shm_max_height_(2160)
+    , spooled_frames_(0)
+    , forwarded_frames_(0)
+    , shared_frames_forwarded_(0)
+    , gap_fill_("duplicate")
+    , next_frame_seq_(0)
+    , dropped_frames_(0)
+    , late_frames_(0)
+    , recording_id_(0)
 {
+  recording_params_.add_watermark = true;
 }
 
-void VideoRecorderNodelet::onInit()
+VideoRecorderNodelet::~VideoRecorderNodelet()
 {
-  record_finished_pub_ = nh_.advertise<rviz_cinematographer_msgs::Finished>("/video_recorder/record_finished", 1);
-  wait_pub_ = nh_.advertise<rviz_cinematographer_msgs::Wait>("/video_recorder/wait_duration", 1);
+  // a finishing recording waits for the readers and the pipeline below
+  rendering_finished_spinner_.stop();
+  rendering_finished_sub_.shutdown();
 
-  record_params_sub_ = nh_.subscribe("/rviz/record", 1, &VideoRecorderNodelet::recordParamsCallback, this);
-  rendering_finished_sub_ = nh_.subscribe("/rviz/finished_rendering_trajectory", 1,
-                                          &VideoRecorderNodelet::renderingFinishedCallback, this);
+  // stop taking frames from the view controller first - its reader feeds the spool
+  if(shared_frames_)
+  {
+    shared_frames_->close();
+    shared_frame_reader_.join();
+  }
+
+  if(spool_)
+  {
+    // the reader finishes its last push while the pipeline's workers are still running
+    spool_->close();
+    spool_reader_.join();
+  }
+
+  // the frame kept to fill gaps may reference a slot of the shared memory
+  {
+    boost::mutex::scoped_lock lock(sequence_mutex_);
+    last_frame_ = Frame();
+  }
 
-  image_transport::ImageTransport it(nh_);
-  image_sub_ = it.subscribe("/rviz/view_image", 1, &VideoRecorderNodelet::imageCallback, this);
+  // joins the pipeline's threads - releases a callback that might be blocked on a full queue
+  pipeline_.reset();
+  spool_.reset();
+  shared_frames_.reset();
 }
 
-void VideoRecorderNodelet::recordParamsCallback(const rviz_cinematographer_msgs::Record::ConstPtr& record_params)
+void VideoRecorderNodelet::onInit()
 {
-  int max_fps = 120;
-  if(record_params->compress > 0)
-    codec_ = cv::VideoWriter::fourcc('D', 'I', 'V', 'X');
-  else
+  ros::NodeHandle& private_nh = getPrivateNodeHandle();
+  private_nh.param("max_queue_size", max_queue_size_, max_queue_size_);
+  private_nh.param("num_workers", num_workers_, num_workers_);
+  max_queue_size_ = std::max(1, max_queue_size_);
+  private_nh.param("gap_fill", gap_fill_, gap_fill_);
+  if(gap_fill_ != "duplicate" && gap_fill_ != "interpolate" && gap_fill_ != "none")
   {
-    codec_ = cv::VideoWriter::fourcc('P', 'I', 'M', '1');
-    max_fps = 60;
+    NODELET_WARN_STREAM("Unknown gap fill " << gap_fill_ << ". Duplicating frames to fill gaps.");
+    gap_fill_ = "duplicate";
   }
 
-  target_fps_ = std::max(1, std::min(max_fps, (int)record_params->frames_per_second));
+  loadEncoderParameters(private_nh);
+  loadWatermark(private_nh);
+
+  pipeline_ = boost::shared_ptr<EncodingPipeline>(
+    new EncodingPipeline(static_cast<size_t>(max_queue_size_), static_cast<unsigned int>(std::max(0, num_workers_))));
+  NODELET_INFO_STREAM("Encoding pipeline uses " << pipeline_->numWorkers() << " worker threads.");
+
+  initSpool(private_nh);
+  initSharedFrames(private_nh);
+
+  record_finished_pub_ = nh_.advertise<rviz_cinematographer_msgs::Finished>("/video_recorder/record_finished", 1);
+  frame_ack_pub_ = nh_.advertise<rviz_cinematographer_msgs::FrameAck>("/video_recorder/frame_ack",
+                                                                     static_cast<uint32_t>(max_queue_size_));
+
+  record_params_sub_ = nh_.subscribe("/rviz/record", 1, &VideoRecorderNodelet::recordParamsCallback, this);
+  // finishing a recording waits for the last images, which arrive on the global queue
+  ros::SubscribeOptions rendering_finished_options =
+    ros::SubscribeOptions::create<rviz_cinematographer_msgs::Finished>(
+      "/rviz/finished_rendering_trajectory", 1,
+      boost::bind(&VideoRecorderNodelet::renderingFinishedCallback, this, _1), ros::VoidPtr(),
+      &rendering_finished_queue_);
+  rendering_finished_sub_ = nh_.subscribe(rendering_finished_options);
+  rendering_finished_spinner_.start();
+
+  // buffer incoming images in the subscriber while the callback is blocked on a full queue
+  image_sub_ = nh_.subscribe("/rviz/view_image", static_cast<uint32_t>(max_queue_size_),
+                             &VideoRecorderNodelet::imageCallback, this);
+}
 
-  path_to_output_ = record_params->path_to_output;
-  add_watermark_ = record_params->add_watermark > 0;
+void VideoRecorderNodelet::recordParamsCallback(const rviz_cinematographer_msgs::Record::ConstPtr& record_params)
+{
+  setRecordingParameters(*record_params, compressed_codec_, recording_params_);
+  recording_id_ = record_params->recording_id;
 
-  if(add_watermark_)
   {
-    // load watermark 
-    std::string path_to_watermark = ros::package::getPath("video_recorder");
-    if(path_to_watermark.empty())
-      NODELET_ERROR("Can't find path to video_recorder to load watermark.");
-    else
-    {
-      path_to_watermark += "/watermark/watermark.png";
-      original_watermark_ = cv::imread(path_to_watermark, cv::IMREAD_UNCHANGED);
-      is_watermark_resized_ = false;
-    }
+    boost::mutex::scoped_lock lock(sequence_mutex_);
+    next_frame_seq_ = 0;
+    dropped_frames_ = 0;
+    late_frames_ = 0;
+    last_frame_ = Frame();
   }
 
-  // init thread to process images if not already existing
-  if(!process_images_thread_)
-    process_images_thread_ = boost::shared_ptr<boost::thread>(
-      new boost::thread(boost::bind(&VideoRecorderNodelet::processImages, this)));
+  if(recording_params_.add_watermark && watermark_cache_->empty())
+    NODELET_WARN("No watermark loaded. Recording without watermark.");
+
+  pipeline_->start(recording_params_);
 }
 
 void
 VideoRecorderNodelet::renderingFinishedCallback(const rviz_cinematographer_msgs::Finished::ConstPtr& rendering_finished)
 {
-  ros::Rate r(30); // 30Hz
   if(rendering_finished->is_finished)
   {
-    // wait until images in queue are processed 
-    while(!image_queue_.empty())
-      r.sleep();
+    {
+      boost::mutex::scoped_lock lock(forward_mutex_);
+      // the view controller wrote all frames before it sent the message - wait until they are forwarded
+      if(shared_frames_)
+      {
+        uint64_t written_frames = shared_frames_->written();
+        while(shared_frames_forwarded_ < written_frames)
+          frame_forwarded_.wait(lock);
+      }
+
+    }
+
+    finishFrameSequence(rendering_finished->frame_count);
 
-    if(output_video_.isOpened())
-      output_video_.release();
+    {
+      boost::mutex::scoped_lock lock(forward_mutex_);
+      // wait until the reader pushed all spooled images into the pipeline
+      if(spool_)
+        while(forwarded_frames_ != spooled_frames_)
+          frame_forwarded_.wait(lock);
+    }
+
+    // wait until images in queue are processed and close the video
+    PipelineStats stats = pipeline_->finish();
+    logStats(stats);
 
     // publish that recording is finished 
     rviz_cinematographer_msgs::Finished record_finished;
     record_finished.is_finished = true;
+    record_finished.frame_count = static_cast<uint32_t>(stats.frames_written);
+    record_finished.recording_id = rendering_finished->recording_id;
+    {
+      boost::mutex::scoped_lock lock(sequence_mutex_);
+      record_finished.dropped_frames = dropped_frames_;
+    }
     record_finished_pub_.publish(record_finished);
   }
 }
 
-void VideoRecorderNodelet::imageCallback(const sensor_msgs::ImageConstPtr& input_image)
+void VideoRecorderNodelet::imageCallback(const rviz_cinematographer_msgs::ViewImage::ConstPtr& view_image)
 {
-  cv_bridge::CvImagePtr cv_image;
+  // images still queued from a previous recording would be taken for the first frames of this one
+  if(view_image->recording_id != recording_id_)
+  {
+    NODELET_WARN_STREAM("Dropping frame " << view_image->seq << " of recording " << view_image->recording_id
+                        << " received during recording " << recording_id_ << ".");
+    return;
+  }
+
+  // conversion is done by the pipeline's workers - the message is kept and only copied if necessary
+  Frame frame;
+  frame.message = sensor_msgs::ImageConstPtr(view_image, &view_image->image);
+
+  // roscpp numbers messages per publisher on its own, so the index within the recording is part of the message
+  uint32_t frame_seq = view_image->seq;
+
+  // blocks while the queue is full
+  if(!forwardInOrder(std::move(frame), frame_seq))
+    NODELET_WARN("Encoding pipeline is shutting down. Dropping image.");
+
+  // the frame left the subscriber queue - grant the view controller credit for another one
+  rviz_cinematographer_msgs::FrameAck ack;
+  ack.seq = frame_seq;
+  ack.window = static_cast<uint32_t>(max_queue_size_);
+  ack.recording_id = recording_id_;
+  frame_ack_pub_.publish(ack);
+}
+
+bool VideoRecorderNodelet::forwardInOrder(Frame frame, uint32_t frame_seq)
+{
+  // forwarding under the lock keeps the order if images arrive on the topic and in shared memory
+  boost::mutex::scoped_lock lock(sequence_mutex_);
+  if(frame_seq < next_frame_seq_)
+  {
+    NODELET_WARN_STREAM("Dropping frame " << frame_seq << " received after frame " << next_frame_seq_ - 1 << ".");
+    late_frames_++;
+    return true;
+  }
+
+  if(frame_seq > next_frame_seq_)
+  {
+    uint32_t missing = frame_seq - next_frame_seq_;
+    NODELET_WARN_STREAM("Missed " << missing << " frames before frame " << frame_seq << ".");
+    dropped_frames_ += missing;
+    fillGap(missing, &frame);
+  }
+
+  next_frame_seq_ = frame_seq + 1;
+  frame_seq_advanced_.notify_all();
+  last_frame_ = frame;
+  return forwardFrame(std::move(frame));
+}
+
+bool VideoRecorderNodelet::forwardFrame(Frame frame)
+{
+  if(!spool_)
+    return pipeline_->push(std::move(frame));
+
+  if(frame.message)
+    spoolImage(frame.message);
+  else
+    spoolImage(frame.image);
+  return true;
+}
+
+/** @brief Returns the BGR8 image of a frame, converting its image message if necessary.
+ *
+ * @return false if the conversion failed.
+ */
+static bool frameImage(const Frame& frame, cv::Mat& image)
+{
+  if(!frame.message)
+  {
+    image = frame.image;
+    return !image.empty();
+  }
+
   try
   {
-    cv_image = cv_bridge::toCvCopy(input_image, sensor_msgs::image_encodings::BGR8);
+    image = cv_bridge::toCvShare(frame.message, sensor_msgs::image_encodings::BGR8)->image;
   }
   catch(cv_bridge::Exception& e)
   {
-    NODELET_ERROR("Failed to convert sensor_msgs::Image to cv_bridge::CvImage : cv_bridge exception: %s", e.what());
+    ROS_ERROR("Failed to convert sensor_msgs::Image to cv_bridge::CvImage : cv_bridge exception: %s", e.what());
+    return false;
+  }
+  return !image.empty();
+}
+
+void VideoRecorderNodelet::fillGap(uint32_t missing, const Frame* next_frame)
+{
+  if(gap_fill_ == "none")
+    return;
+
+  // without a previous frame the gap is at the beginning of the recording - repeat the first frame received
+  bool has_last_frame = last_frame_.message || !last_frame_.image.empty();
+  if(!has_last_frame && !next_frame)
     return;
+  const Frame& previous_frame = has_last_frame ? last_frame_ : *next_frame;
+
+  cv::Mat previous_image, next_image;
+  bool interpolate = gap_fill_ == "interpolate" && has_last_frame && next_frame &&
+                     frameImage(previous_frame, previous_image) && frameImage(*next_frame, next_image) &&
+                     previous_image.size() == next_image.size();
+
+  for(uint32_t i = 1; i <= missing; ++i)
+  {
+    Frame fill;
+    if(interpolate)
+    {
+      double alpha = static_cast<double>(i) / (missing + 1);
+      cv::addWeighted(previous_image, 1.0 - alpha, next_image, alpha, 0.0, fill.image);
+    }
+    else
+    {
+      // shares the previous frame's memory - the pipeline copies it before drawing the watermark
+      fill.message = previous_frame.message;
+      fill.image = previous_frame.image;
+      fill.image_owner = previous_frame.image_owner;
+    }
+
+    if(!forwardFrame(std::move(fill)))
+      return;
+  }
+}
+
+void VideoRecorderNodelet::finishFrameSequence(uint32_t frame_count)
+{
+  boost::mutex::scoped_lock lock(sequence_mutex_);
+  while(next_frame_seq_ < frame_count)
+  {
+    // give up only if no frame arrived for a while
+    uint32_t previous_frame_seq = next_frame_seq_;
+    bool is_notified = frame_seq_advanced_.timed_wait(lock, boost::posix_time::seconds(FRAME_TIMEOUT));
+    if(!is_notified && next_frame_seq_ == previous_frame_seq)
+      break;
   }
 
-  image_queue_.push(cv_image);
+  if(frame_count > next_frame_seq_)
+  {
+    uint32_t missing = frame_count - next_frame_seq_;
+    NODELET_WARN_STREAM("Missed the last " << missing << " frames of the recording.");
+    dropped_frames_ += missing;
+    fillGap(missing, NULL);
+    next_frame_seq_ = frame_count;
+  }
+
+  if(dropped_frames_ > 0 || late_frames_ > 0)
+    NODELET_WARN_STREAM("Missed " << dropped_frames_ << " frames" << (gap_fill_ == "none" ? "" : " and filled them")
+                        << ", dropped " << late_frames_ << " duplicate or late frames.");
+
+  // the last frame may hold a slot of the shared memory
+  last_frame_ = Frame();
+}
 
-  if((int)image_queue_.size() >= max_queue_size_)
+void VideoRecorderNodelet::spoolImage(const sensor_msgs::ImageConstPtr& input_image)
+{
+  cv_bridge::CvImageConstPtr cv_image;
+  try
+  {
+    cv_image = cv_bridge::toCvShare(input_image, sensor_msgs::image_encodings::BGR8);
+  }
+  catch(cv_bridge::Exception& e)
   {
-    NODELET_DEBUG("Max queue size exceeded. Sending wait message.");
-    // publish that input has to wait until some images are processed 
-    ros::WallDuration wait_duration = process_one_image_duration_ * (max_queue_size_ - (max_queue_size_ / 5));
-    rviz_cinematographer_msgs::Wait wait_duration_msg;
-    wait_duration_msg.seconds = static_cast<float>(wait_duration.toSec());
-    wait_pub_.publish(wait_duration_msg);
+    NODELET_ERROR("Failed to convert sensor_msgs::Image to cv_bridge::CvImage : cv_bridge exception: %s", e.what());
+    return;
   }
+
+  spoolImage(cv_image->image);
 }
 
-void VideoRecorderNodelet::processImages()
+void VideoRecorderNodelet::spoolImage(const cv::Mat& image)
 {
-  ros::Rate r(30); // 30 hz
-  while(ros::ok())
+  if(spool_->frameSize() != image.size() || spool_->fps() != recording_params_.fps)
   {
-    if(!image_queue_.empty())
+    // waits until the pipeline consumed all frames of the previous spool file
+    size_t spool_bytes = static_cast<size_t>(spool_size_mb_) * 1024 * 1024;
+    if(!spool_->create(spool_directory_ + "/frames.spool", image.size(), spool_bytes, recording_params_.fps))
     {
-      ros::WallTime start = ros::WallTime::now();
+      NODELET_ERROR("Could not create the spool file. Dropping image.");
+      return;
+    }
+  }
 
-      cv_bridge::CvImagePtr cv_ptr = image_queue_.front();
+  // blocks while the spool is full
+  if(!spool_->append(image))
+  {
+    NODELET_WARN("Spool is closing. Dropping image.");
+    return;
+  }
 
-      cv::Size img_size(cv_ptr->image.cols, cv_ptr->image.rows);
+  boost::mutex::scoped_lock lock(forward_mutex_);
+  spooled_frames_++;
+}
 
-      if(!output_video_.isOpened())
-        if(!output_video_.open(path_to_output_, codec_, target_fps_, img_size, true))
-          NODELET_ERROR_STREAM("Could not open the output video to write file in : " << path_to_output_);
+void VideoRecorderNodelet::spoolReaderLoop()
+{
+  Frame frame;
+  // blocks until a frame is spooled - returns false once the spool is closed
+  while(spool_->read(frame.image, frame.image_owner))
+  {
+    // the frame references the spool file - its slot is freed once the pipeline dropped the frame
+    bool is_pushed = pipeline_->push(std::move(frame));
+    frame = Frame();
 
-      if(output_video_.isOpened())
-      {
-        if(add_watermark_)
-        {
-          // resize watermark only once per recording to better fit the video image size 
-          if(!is_watermark_resized_)
-          {
-            original_watermark_.copyTo(resized_watermark_);
-            resizeWatermark(resized_watermark_, cv_ptr->image.cols);
-            is_watermark_resized_ = true;
-          }
-
-          // add watermark 
-          addWatermark(cv_ptr->image, resized_watermark_);
-        }
-        output_video_.write(cv_ptr->image);
-      }
+    boost::mutex::scoped_lock lock(forward_mutex_);
+    forwarded_frames_++;
+    frame_forwarded_.notify_all();
+    if(!is_pushed)
+      break;
+  }
+}
 
-      image_queue_.pop();
+void VideoRecorderNodelet::sharedFrameReaderLoop()
+{
+  Frame frame;
+  uint32_t frame_seq = 0;
+  // blocks until the view controller wrote a frame - returns false once the ring is closed
+  while(shared_frames_->read(frame.image, frame.image_owner, frame_seq))
+  {
+    // the frame references the shared memory - its slot is freed once the spool copied it or the pipeline dropped it
+    bool is_pushed = forwardInOrder(std::move(frame), frame_seq);
+    frame = Frame();
 
-      process_one_image_duration_ = ros::WallTime::now() - start;
-    }
-    else
+    boost::mutex::scoped_lock lock(forward_mutex_);
+    shared_frames_forwarded_++;
+    frame_forwarded_.notify_all();
+    if(!is_pushed)
+      break;
+  }
+}
+
+void VideoRecorderNodelet::initSharedFrames(ros::NodeHandle& private_nh)
+{
+  private_nh.param("shm_name", shm_name_, shm_name_);
+  private_nh.param("shm_size_mb", shm_size_mb_, shm_size_mb_);
+  private_nh.param("shm_max_width", shm_max_width_, shm_max_width_);
+  private_nh.param("shm_max_height", shm_max_height_, shm_max_height_);
+  if(shm_name_.empty())
+    return;
+
+  // shared memory names are a single component starting with a slash
+  if(shm_name_[0] != '/')
+    shm_name_ = "/" + shm_name_;
+
+  size_t max_frame_bytes = static_cast<size_t>(std::max(1, shm_max_width_)) * std::max(1, shm_max_height_) * 3;
+  size_t max_bytes = static_cast<size_t>(std::max(1, shm_size_mb_)) * 1024 * 1024;
+  shared_frames_ = boost::make_shared<SharedFrameRing>();
+  if(!shared_frames_->create(shm_name_, max_bytes, max_frame_bytes))
+  {
+    NODELET_ERROR_STREAM("Could not create shared memory segment " << shm_name_ << ". Receiving images only on "
+                         << "/rviz/view_image.");
+    shared_frames_.reset();
+    return;
+  }
+
+  shared_frame_reader_ = boost::thread(boost::bind(&VideoRecorderNodelet::sharedFrameReaderLoop, this));
+}
+
+void VideoRecorderNodelet::initSpool(ros::NodeHandle& private_nh)
+{
+  private_nh.param("spool_directory", spool_directory_, spool_directory_);
+  private_nh.param("spool_size_mb", spool_size_mb_, spool_size_mb_);
+  spool_size_mb_ = std::max(1, spool_size_mb_);
+  if(spool_directory_.empty())
+    return;
+
+  if(mkdir(spool_directory_.c_str(), 0755) != 0 && errno != EEXIST)
+  {
+    NODELET_ERROR_STREAM("Could not create spool directory " << spool_directory_ << ". Spooling is disabled.");
+    return;
+  }
+
+  spool_ = boost::make_shared<FrameSpool>();
+
+  // keep frames of a recording that was interrupted by a crash for a later pass
+  std::string spool_path = spool_directory_ + "/frames.spool";
+  if(spool_->open(spool_path))
+  {
+    size_t unread = spool_->unread();
+    spool_ = boost::make_shared<FrameSpool>();
+    if(unread > 0)
     {
-      r.sleep();
+      std::string interrupted_path = spool_directory_ + "/interrupted_" +
+                                     std::to_string(static_cast<long long>(ros::WallTime::now().sec)) + ".spool";
+      if(rename(spool_path.c_str(), interrupted_path.c_str()) == 0)
+        NODELET_WARN_STREAM("Moved " << unread << " frames of an interrupted recording to " << interrupted_path << ".");
     }
   }
+
+  spool_reader_ = boost::thread(boost::bind(&VideoRecorderNodelet::spoolReaderLoop, this));
+  NODELET_INFO_STREAM("Spooling images to " << spool_directory_ << " using up to " << spool_size_mb_ << " MB.");
 }
 
-void VideoRecorderNodelet::resizeWatermark(cv::Mat& watermark, const int image_width)
+void VideoRecorderNodelet::loadEncoderParameters(ros::NodeHandle& private_nh)
 {
-  float watermark_resize_factor = (0.5f * image_width) / watermark.cols;
-  if(watermark_resize_factor < 1.f)
-    cv::resize(watermark, watermark, cv::Size(), watermark_resize_factor, watermark_resize_factor);
+  EncoderParameters& encoder = recording_params_.encoder;
+  private_nh.param("encoder", encoder.backend, encoder.backend);
+  if(encoder.backend == "libav" && !isLibavAvailable())
+  {
+    NODELET_WARN("video_recorder was built without libavcodec. Using the OpenCV encoder.");
+    encoder.backend = "opencv";
+  }
+
+  private_nh.param("codec", compressed_codec_, compressed_codec_);
+  private_nh.param("preset", encoder.preset, encoder.preset);
+  private_nh.param("crf", encoder.crf, encoder.crf);
+  private_nh.param("gop_size", encoder.gop_size, encoder.gop_size);
+  private_nh.param("encoder_threads", encoder.threads, encoder.threads);
+  encoder.codec = compressed_codec_;
+
+  private_nh.param("image_format", encoder.image_format, encoder.image_format);
+  private_nh.param("compression_level", encoder.compression_level, encoder.compression_level);
+  int max_in_flight_mb = static_cast<int>(encoder.max_in_flight_bytes / (1024 * 1024));
+  private_nh.param("max_in_flight_mb", max_in_flight_mb, max_in_flight_mb);
+  encoder.max_in_flight_bytes = static_cast<size_t>(std::max(1, max_in_flight_mb)) * 1024 * 1024;
+
+  if(encoder.backend == "libav")
+    NODELET_INFO_STREAM("Encoding compressed videos with " << compressed_codec_ << ", preset " << encoder.preset
+                        << ", crf " << encoder.crf << " and uncompressed videos losslessly with ffv1.");
+  else if(encoder.backend == "images")
+    NODELET_INFO_STREAM("Writing frames as " << encoder.image_format << " images.");
 }
 
-void VideoRecorderNodelet::addWatermark(cv::Mat& image, const cv::Mat& watermark)
+void VideoRecorderNodelet::loadWatermark(ros::NodeHandle& private_nh)
 {
-  int origin_watermark_row = image.rows - watermark.rows;
-  int origin_watermark_col = image.cols - watermark.cols;
-  int image_row = origin_watermark_row;
-  int image_col = origin_watermark_col;
-  float alpha = 0.8f;
-  for(int watermark_row = 0; watermark_row < watermark.rows; watermark_row++, image_row++)
+  watermark_cache_ = boost::make_shared<WatermarkCache>();
+  recording_params_.watermarks = watermark_cache_;
+
+  std::string position_name = "bottom_right";
+  private_nh.param("watermark_position", position_name, position_name);
+  if(!watermarkPositionFromString(position_name, recording_params_.watermark_position))
+    NODELET_WARN_STREAM("Unknown watermark position " << position_name << ". Using bottom_right.");
+
+  double opacity = recording_params_.watermark_opacity;
+  private_nh.param("watermark_opacity", opacity, opacity);
+  recording_params_.watermark_opacity = static_cast<float>(std::max(0.0, std::min(1.0, opacity)));
+
+  std::string path_to_watermark = ros::package::getPath("video_recorder");
+  if(path_to_watermark.empty())
   {
-    image_col = origin_watermark_col;
-    for(int watermark_col = 0; watermark_col < watermark.cols; watermark_col++, image_col++)
-    {
-      // overlay if pixel in watermark is not transparent
-      unsigned char pixel_alpha = watermark.at<cv::Vec4b>(watermark_row, watermark_col)[3];
-      if(pixel_alpha != 0)
-        for(int i = 0; i < 3; ++i)
-          image.at<cv::Vec3b>(image_row, image_col)[i] = cv::saturate_cast<uchar>(
-            alpha * image.at<cv::Vec3b>(image_row, image_col)[i] +
-            (1.f - alpha) * watermark.at<cv::Vec4b>(watermark_row, watermark_col)[i]);
+    NODELET_ERROR("Can't find path to video_recorder to load watermark.");
+    return;
+  }
+  path_to_watermark += "/watermark/watermark.png";
+  private_nh.param("watermark_path", path_to_watermark, path_to_watermark);
 
-    }
+  if(!watermark_cache_->load(path_to_watermark))
+  {
+    NODELET_ERROR_STREAM("Could not load watermark from " << path_to_watermark << ". Expected a BGRA image.");
+    return;
   }
+
+  // prepare the watermark for common image widths up front to keep it off the first recorded frame
+  std::vector<int> widths;
+  widths.push_back(1920);
+  widths.push_back(3840);
+  private_nh.param("watermark_widths", widths, widths);
+  for(int width : widths)
+    watermark_cache_->get(width, recording_params_.watermark_opacity, recording_params_.watermark_position);
+}
+
+void VideoRecorderNodelet::logStats(const PipelineStats& stats)
+{
+  NODELET_INFO_STREAM("Recorded " << stats.frames_written << " frames in " << stats.duration << "s ("
+                      << (stats.duration > 0.0 ? stats.frames_written / stats.duration : 0.0) << " fps).");
+  NODELET_INFO_STREAM("Copied " << (stats.frames_written > 0 ? stats.bytes_copied / stats.frames_written : 0)
+                      << " bytes per frame.");
+  NODELET_INFO_STREAM("Image queue: " << stats.intake.pushed << " images queued, high-water mark "
+                      << stats.intake.high_water_mark << "/" << stats.intake.capacity << ", "
+                      << stats.intake.blocked_pushes << " pushes blocked on a full queue.");
+  NODELET_INFO_STREAM("Latency from queueing to processing an image: " << stats.queue_latency.toString());
 }
 
 }
@@ -0,0 +1,340 @@
+/** @file
+ *
+ * Watermark prepared once per recording and blended into each frame with SIMD instructions.
+ *
+ * @author Jan Razlaw
+ */
+
+#include "video_recorder/watermark.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define VIDEO_RECORDER_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+namespace video_recorder
+{
+
+// exact rounded division by 255 for x in [0, 255 * 255]
+static inline unsigned int div255(unsigned int x)
+{
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+void blendPremultipliedRowScalar(unsigned char* dst,
+                                 const unsigned char* premultiplied,
+                                 const unsigned char* inverse_weight,
+                                 size_t n)
+{
+  for(size_t i = 0; i < n; ++i)
+  {
+    unsigned int blended = div255(static_cast<unsigned int>(dst[i]) * inverse_weight[i]) + premultiplied[i];
+    dst[i] = static_cast<unsigned char>(std::min(255u, blended));
+  }
+}
+
+#ifdef VIDEO_RECORDER_HAVE_X86
+
+// same as div255 on eight or sixteen 16 bit lanes
+static inline __m128i div255Epi16(__m128i x)
+{
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+void blendPremultipliedRowSSE2(unsigned char* dst,
+                               const unsigned char* premultiplied,
+                               const unsigned char* inverse_weight,
+                               size_t n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for(; i + 16 <= n; i += 16)
+  {
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+    __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(inverse_weight + i));
+    __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(premultiplied + i));
+
+    __m128i lo = div255Epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(w, zero)));
+    __m128i hi = div255Epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(w, zero)));
+
+    __m128i blended = _mm_adds_epu8(_mm_packus_epi16(lo, hi), p);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), blended);
+  }
+
+  blendPremultipliedRowScalar(dst + i, premultiplied + i, inverse_weight + i, n - i);
+}
+
+#if defined(__GNUC__)
+#define VIDEO_RECORDER_HAVE_AVX2 1
+
+__attribute__((target("avx2")))
+static inline __m256i div255Epi16AVX2(__m256i x)
+{
+  x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+void blendPremultipliedRowAVX2(unsigned char* dst,
+                               const unsigned char* premultiplied,
+                               const unsigned char* inverse_weight,
+                               size_t n)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for(; i + 32 <= n; i += 32)
+  {
+    __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+    __m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(inverse_weight + i));
+    __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(premultiplied + i));
+
+    // unpack and pack both work within 128 bit lanes, so the byte order is preserved
+    __m256i lo = div255Epi16AVX2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(w, zero)));
+    __m256i hi = div255Epi16AVX2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(w, zero)));
+
+    __m256i blended = _mm256_adds_epu8(_mm256_packus_epi16(lo, hi), p);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), blended);
+  }
+
+  blendPremultipliedRowSSE2(dst + i, premultiplied + i, inverse_weight + i, n - i);
+}
+
+static bool cpuSupportsAVX2()
+{
+  static const bool supports_avx2 = __builtin_cpu_supports("avx2");
+  return supports_avx2;
+}
+#endif
+
+#endif
+
+#if !defined(VIDEO_RECORDER_HAVE_X86)
+void blendPremultipliedRowSSE2(unsigned char* dst,
+                               const unsigned char* premultiplied,
+                               const unsigned char* inverse_weight,
+                               size_t n)
+{
+  blendPremultipliedRowScalar(dst, premultiplied, inverse_weight, n);
+}
+#endif
+
+#if !defined(VIDEO_RECORDER_HAVE_AVX2)
+void blendPremultipliedRowAVX2(unsigned char* dst,
+                               const unsigned char* premultiplied,
+                               const unsigned char* inverse_weight,
+                               size_t n)
+{
+  blendPremultipliedRowSSE2(dst, premultiplied, inverse_weight, n);
+}
+#endif
+
+bool blendSupportsSSE2()
+{
+#if defined(VIDEO_RECORDER_HAVE_X86)
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool blendSupportsAVX2()
+{
+#if defined(VIDEO_RECORDER_HAVE_AVX2)
+  return cpuSupportsAVX2();
+#else
+  return false;
+#endif
+}
+
+void blendPremultipliedRow(unsigned char* dst,
+                           const unsigned char* premultiplied,
+                           const unsigned char* inverse_weight,
+                           size_t n)
+{
+#if defined(VIDEO_RECORDER_HAVE_AVX2)
+  if(cpuSupportsAVX2())
+  {
+    blendPremultipliedRowAVX2(dst, premultiplied, inverse_weight, n);
+    return;
+  }
+#endif
+#if defined(VIDEO_RECORDER_HAVE_X86)
+  blendPremultipliedRowSSE2(dst, premultiplied, inverse_weight, n);
+#else
+  blendPremultipliedRowScalar(dst, premultiplied, inverse_weight, n);
+#endif
+}
+
+const char* blendInstructionSet()
+{
+#if defined(VIDEO_RECORDER_HAVE_AVX2)
+  if(cpuSupportsAVX2())
+    return "AVX2";
+#endif
+#if defined(VIDEO_RECORDER_HAVE_X86)
+  return "SSE2";
+#else
+  return "scalar";
+#endif
+}
+
+bool watermarkPositionFromString(const std::string& name, WatermarkPosition& position)
+{
+  if(name == "bottom_right")
+    position = BOTTOM_RIGHT;
+  else if(name == "bottom_left")
+    position = BOTTOM_LEFT;
+  else if(name == "top_right")
+    position = TOP_RIGHT;
+  else if(name == "top_left")
+    position = TOP_LEFT;
+  else
+    return false;
+  return true;
+}
+
+Watermark::Watermark()
+  : position_(BOTTOM_RIGHT)
+{
+}
+
+Watermark::Watermark(const cv::Mat& original_watermark, int image_width, float opacity, WatermarkPosition position)
+  : position_(position)
+{
+  if(original_watermark.empty() || original_watermark.type() != CV_8UC4 || image_width <= 0)
+    return;
+
+  // resize watermark to be at most half as wide as the images
+  cv::Mat resized_watermark = original_watermark;
+  float watermark_resize_factor = (0.5f * image_width) / original_watermark.cols;
+  if(watermark_resize_factor < 1.f)
+    cv::resize(original_watermark, resized_watermark, cv::Size(), watermark_resize_factor, watermark_resize_factor);
+  size_ = resized_watermark.size();
+
+  // crop fully transparent borders
+  int min_row = resized_watermark.rows, max_row = -1;
+  int min_col = resized_watermark.cols, max_col = -1;
+  for(int row = 0; row < resized_watermark.rows; ++row)
+  {
+    const cv::Vec4b* watermark_row = resized_watermark.ptr<cv::Vec4b>(row);
+    for(int col = 0; col < resized_watermark.cols; ++col)
+    {
+      if(watermark_row[col][3] != 0)
+      {
+        min_row = std::min(min_row, row);
+        max_row = std::max(max_row, row);
+        min_col = std::min(min_col, col);
+        max_col = std::max(max_col, col);
+      }
+    }
+  }
+  if(max_row < 0)
+    return;
+  crop_offset_ = cv::Point(min_col, min_row);
+  cv::Mat cropped_watermark = resized_watermark(cv::Rect(min_col, min_row, max_col - min_col + 1, max_row - min_row + 1));
+
+  unsigned int weight = static_cast<unsigned int>(std::max(0.f, std::min(1.f, opacity)) * 255.f + 0.5f);
+  if(weight == 0)
+    return;
+
+  premultiplied_.create(cropped_watermark.rows, cropped_watermark.cols, CV_8UC3);
+  inverse_weight_.create(cropped_watermark.rows, cropped_watermark.cols, CV_8UC3);
+  for(int row = 0; row < cropped_watermark.rows; ++row)
+  {
+    const cv::Vec4b* watermark_row = cropped_watermark.ptr<cv::Vec4b>(row);
+    cv::Vec3b* premultiplied_row = premultiplied_.ptr<cv::Vec3b>(row);
+    cv::Vec3b* inverse_weight_row = inverse_weight_.ptr<cv::Vec3b>(row);
+    for(int col = 0; col < cropped_watermark.cols; ++col)
+    {
+      // overlay only if pixel in watermark is not transparent
+      unsigned int pixel_weight = watermark_row[col][3] != 0 ? weight : 0;
+      for(int i = 0; i < 3; ++i)
+      {
+        premultiplied_row[col][i] = static_cast<unsigned char>(div255(watermark_row[col][i] * pixel_weight));
+        inverse_weight_row[col][i] = static_cast<unsigned char>(255 - pixel_weight);
+      }
+    }
+  }
+}
+
+void Watermark::apply(cv::Mat& image, bool force_scalar) const
+{
+  if(empty() || image.type() != CV_8UC3)
+    return;
+
+  // origin of the uncropped watermark in the image
+  int origin_col = (position_ == BOTTOM_RIGHT || position_ == TOP_RIGHT) ? image.cols - size_.width : 0;
+  int origin_row = (position_ == BOTTOM_RIGHT || position_ == BOTTOM_LEFT) ? image.rows - size_.height : 0;
+
+  // clip the cropped watermark at the image borders
+  int first_col = origin_col + crop_offset_.x;
+  int first_row = origin_row + crop_offset_.y;
+  int begin_col = std::max(0, first_col);
+  int begin_row = std::max(0, first_row);
+  int end_col = std::min(image.cols, first_col + premultiplied_.cols);
+  int end_row = std::min(image.rows, first_row + premultiplied_.rows);
+  if(begin_col >= end_col || begin_row >= end_row)
+    return;
+
+  size_t num_bytes = 3 * static_cast<size_t>(end_col - begin_col);
+  for(int image_row = begin_row; image_row < end_row; ++image_row)
+  {
+    int watermark_row = image_row - first_row;
+    int watermark_col = begin_col - first_col;
+    unsigned char* dst = image.ptr<unsigned char>(image_row) + 3 * begin_col;
+    const unsigned char* premultiplied = premultiplied_.ptr<unsigned char>(watermark_row) + 3 * watermark_col;
+    const unsigned char* inverse_weight = inverse_weight_.ptr<unsigned char>(watermark_row) + 3 * watermark_col;
+
+    if(force_scalar)
+      blendPremultipliedRowScalar(dst, premultiplied, inverse_weight, num_bytes);
+    else
+      blendPremultipliedRow(dst, premultiplied, inverse_weight, num_bytes);
+  }
+}
+
+WatermarkCache::WatermarkCache()
+{
+}
+
+bool WatermarkCache::load(const std::string& path)
+{
+  cv::Mat original_watermark = cv::imread(path, cv::IMREAD_UNCHANGED);
+
+  boost::mutex::scoped_lock lock(mutex_);
+  prepared_watermarks_.clear();
+  if(original_watermark.empty() || original_watermark.type() != CV_8UC4)
+  {
+    original_watermark_.release();
+    return false;
+  }
+
+  original_watermark_ = original_watermark;
+  return true;
+}
+
+bool WatermarkCache::empty() const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return original_watermark_.empty();
+}
+
+boost::shared_ptr<const Watermark> WatermarkCache::get(int image_width, float opacity, WatermarkPosition position)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  if(original_watermark_.empty())
+    return boost::shared_ptr<const Watermark>();
+
+  int quantized_opacity = static_cast<int>(std::max(0.f, std::min(1.f, opacity)) * 255.f + 0.5f);
+  Key key(std::make_pair(image_width, quantized_opacity), static_cast<int>(position));
+
+  boost::shared_ptr<const Watermark>& watermark = prepared_watermarks_[key];
+  if(!watermark)
+    watermark = boost::shared_ptr<const Watermark>(new Watermark(original_watermark_, image_width, opacity, position));
+  return watermark;
+}
+
+}  // namespace video_recorder
@@ -0,0 +1,112 @@
+/** @file
+ *
+ * Measures the per-frame cost of adding the watermark at 1080p and 4K.
+ *
+ * Usage: watermark_benchmark [path_to_watermark.png] [iterations]
+ *
+ * @author Jan Razlaw
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+
+#include <cv.hpp>
+
+#include "video_recorder/watermark.h"
+
+using namespace video_recorder;
+
+/** @brief Per-pixel float implementation the premultiplied blend replaced - used as baseline. */
+static void addWatermarkPerPixel(cv::Mat& image, const cv::Mat& watermark)
+{
+  int origin_watermark_row = image.rows - watermark.rows;
+  int origin_watermark_col = image.cols - watermark.cols;
+  int image_row = origin_watermark_row;
+  int image_col = origin_watermark_col;
+  float alpha = 0.8f;
+  for(int watermark_row = 0; watermark_row < watermark.rows; watermark_row++, image_row++)
+  {
+    image_col = origin_watermark_col;
+    for(int watermark_col = 0; watermark_col < watermark.cols; watermark_col++, image_col++)
+    {
+      // overlay if pixel in watermark is not transparent
+      unsigned char pixel_alpha = watermark.at<cv::Vec4b>(watermark_row, watermark_col)[3];
+      if(pixel_alpha != 0)
+        for(int i = 0; i < 3; ++i)
+          image.at<cv::Vec3b>(image_row, image_col)[i] = cv::saturate_cast<uchar>(
+            alpha * image.at<cv::Vec3b>(image_row, image_col)[i] +
+            (1.f - alpha) * watermark.at<cv::Vec4b>(watermark_row, watermark_col)[i]);
+    }
+  }
+}
+
+/** @brief Returns the average duration in milliseconds of a call to function. */
+template<typename Function>
+static double measure(Function function, int iterations)
+{
+  // warm up caches
+  function();
+
+  double start = static_cast<double>(cv::getTickCount());
+  for(int i = 0; i < iterations; ++i)
+    function();
+  return (static_cast<double>(cv::getTickCount()) - start) / cv::getTickFrequency() * 1000.0 / iterations;
+}
+
+int main(int argc, char** argv)
+{
+  cv::Mat original_watermark;
+  if(argc > 1)
+    original_watermark = cv::imread(argv[1], cv::IMREAD_UNCHANGED);
+  int iterations = argc > 2 ? std::max(1, std::atoi(argv[2])) : 200;
+
+  if(original_watermark.empty())
+  {
+    // synthetic watermark with transparent and opaque pixels
+    original_watermark = cv::Mat(600, 2400, CV_8UC4);
+    cv::randu(original_watermark, cv::Scalar::all(0), cv::Scalar::all(256));
+    if(argc > 1)
+      std::cerr << "Could not load " << argv[1] << ", using a synthetic watermark." << std::endl;
+  }
+  else if(original_watermark.type() != CV_8UC4)
+  {
+    std::cerr << "Watermark has to be a BGRA image." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::cout << "Blend kernel: " << blendInstructionSet() << ", " << iterations << " iterations" << std::endl;
+
+  const cv::Size resolutions[] = {cv::Size(1920, 1080), cv::Size(3840, 2160)};
+  for(const cv::Size& resolution : resolutions)
+  {
+    cv::Mat image(resolution, CV_8UC3);
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+
+    // the baseline resized the watermark once per recording as well
+    cv::Mat resized_watermark = original_watermark.clone();
+    float watermark_resize_factor = (0.5f * image.cols) / resized_watermark.cols;
+    if(watermark_resize_factor < 1.f)
+      cv::resize(resized_watermark, resized_watermark, cv::Size(), watermark_resize_factor, watermark_resize_factor);
+
+    Watermark watermark(original_watermark, image.cols);
+
+    double per_pixel_ms = measure([&]() { addWatermarkPerPixel(image, resized_watermark); }, iterations);
+    double scalar_ms = measure([&]() { watermark.apply(image, true); }, iterations);
+    double simd_ms = measure([&]() { watermark.apply(image); }, iterations);
+    double prepare_ms = measure([&]() { Watermark prepared(original_watermark, image.cols); }, 10);
+
+    std::cout << std::fixed << std::setprecision(3)
+              << resolution.width << "x" << resolution.height
+              << " (watermark " << watermark.size().width << "x" << watermark.size().height
+              << ", blended " << watermark.croppedSize().width << "x" << watermark.croppedSize().height << ")"
+              << std::endl
+              << "  per pixel float : " << per_pixel_ms << " ms/frame" << std::endl
+              << "  scalar blend    : " << scalar_ms << " ms/frame" << std::endl
+              << "  " << std::left << std::setw(16) << blendInstructionSet() << std::right
+              << ": " << simd_ms << " ms/frame (" << per_pixel_ms / simd_ms << "x)" << std::endl
+              << "  preparation     : " << prepare_ms << " ms/recording" << std::endl;
+  }
+
+  return EXIT_SUCCESS;
+}
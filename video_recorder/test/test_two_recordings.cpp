@@ -0,0 +1,142 @@
+/** @file
+ *
+ * Records two videos back to back and checks that the recorder numbers the frames of both from zero.
+ *
+ * @author Jan Razlaw
+ */
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/image_encodings.h>
+
+#include <rviz_cinematographer_msgs/Finished.h>
+#include <rviz_cinematographer_msgs/FrameAck.h>
+#include <rviz_cinematographer_msgs/Record.h>
+#include <rviz_cinematographer_msgs/ViewImage.h>
+
+static const int FPS = 30;
+static const uint32_t FRAME_COUNT = 20;
+
+/** @brief Publishes the frames of a recording like the view controller and collects the recorder's answers. */
+class TwoRecordingsTest : public ::testing::Test
+{
+protected:
+
+  void SetUp()
+  {
+    record_pub_ = nh_.advertise<rviz_cinematographer_msgs::Record>("/rviz/record", 1, true);
+    finished_pub_ = nh_.advertise<rviz_cinematographer_msgs::Finished>("/rviz/finished_rendering_trajectory", 1);
+    image_pub_ = nh_.advertise<rviz_cinematographer_msgs::ViewImage>("/rviz/view_image", FRAME_COUNT);
+    ack_sub_ = nh_.subscribe("/video_recorder/frame_ack", FRAME_COUNT, &TwoRecordingsTest::ackCallback, this);
+    record_finished_sub_ = nh_.subscribe("/video_recorder/record_finished", 1,
+                                         &TwoRecordingsTest::recordFinishedCallback, this);
+
+    ASSERT_TRUE(waitFor([this]() { return finished_pub_.getNumSubscribers() > 0 &&
+                                          image_pub_.getNumSubscribers() > 0 &&
+                                          ack_sub_.getNumPublishers() > 0 &&
+                                          record_finished_sub_.getNumPublishers() > 0; }));
+  }
+
+  void ackCallback(const rviz_cinematographer_msgs::FrameAck::ConstPtr& ack)
+  {
+    acks_.push_back(*ack);
+  }
+
+  void recordFinishedCallback(const rviz_cinematographer_msgs::Finished::ConstPtr& record_finished)
+  {
+    record_finished_ = record_finished;
+  }
+
+  /** @brief Spins until the condition holds, returns false after a timeout. */
+  template<typename Condition>
+  bool waitFor(Condition condition, double timeout = 10.0)
+  {
+    ros::WallTime end = ros::WallTime::now() + ros::WallDuration(timeout);
+    while(!condition() && ros::ok() && ros::WallTime::now() < end)
+    {
+      ros::spinOnce();
+      ros::WallDuration(0.01).sleep();
+    }
+    return condition();
+  }
+
+  /** @brief Records a video of FRAME_COUNT frames and checks the acknowledgements and the result. */
+  void record(uint32_t recording_id)
+  {
+    acks_.clear();
+    record_finished_.reset();
+
+    rviz_cinematographer_msgs::Record record_params;
+    record_params.do_record = true;
+    record_params.path_to_output = "/tmp/video_recorder_test_" + std::to_string(recording_id) + ".avi";
+    record_params.frames_per_second = FPS;
+    record_params.compress = true;
+    record_params.add_watermark = false;
+    record_params.recording_id = recording_id;
+    record_pub_.publish(record_params);
+    // the parameters and the images arrive on different connections
+    ros::WallDuration(0.5).sleep();
+
+    for(uint32_t frame_seq = 0; frame_seq < FRAME_COUNT; frame_seq++)
+    {
+      rviz_cinematographer_msgs::ViewImage view_image;
+      view_image.seq = frame_seq;
+      view_image.recording_id = recording_id;
+      sensor_msgs::Image& image = view_image.image;
+      image.header.stamp = ros::Time::now();
+      image.width = 64;
+      image.height = 48;
+      image.encoding = sensor_msgs::image_encodings::BGR8;
+      image.step = image.width * 3;
+      image.data.assign(image.step * image.height, static_cast<uint8_t>(frame_seq));
+      image_pub_.publish(view_image);
+    }
+
+    ASSERT_TRUE(waitFor([this]() { return acks_.size() >= FRAME_COUNT; }));
+    for(size_t i = 0; i < acks_.size(); i++)
+    {
+      EXPECT_EQ(recording_id, acks_[i].recording_id);
+      EXPECT_EQ(i, acks_[i].seq);
+    }
+
+    rviz_cinematographer_msgs::Finished rendering_finished;
+    rendering_finished.is_finished = true;
+    rendering_finished.frame_count = FRAME_COUNT;
+    rendering_finished.recording_id = recording_id;
+    finished_pub_.publish(rendering_finished);
+
+    ASSERT_TRUE(waitFor([this]() { return static_cast<bool>(record_finished_); }, 30.0));
+    EXPECT_EQ(FRAME_COUNT, record_finished_->frame_count);
+    EXPECT_EQ(0u, record_finished_->dropped_frames);
+    EXPECT_EQ(recording_id, record_finished_->recording_id);
+  }
+
+  ros::NodeHandle nh_;
+  ros::Publisher record_pub_;
+  ros::Publisher finished_pub_;
+  ros::Publisher image_pub_;
+  ros::Subscriber ack_sub_;
+  ros::Subscriber record_finished_sub_;
+
+  std::vector<rviz_cinematographer_msgs::FrameAck> acks_;
+  rviz_cinematographer_msgs::Finished::ConstPtr record_finished_;
+};
+
+// roscpp keeps counting header.seq across recordings - the second one has to start at frame zero nevertheless
+TEST_F(TwoRecordingsTest, backToBack)
+{
+  record(1);
+  record(2);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  ros::init(argc, argv, "test_two_recordings");
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,143 @@
+/** @file
+ *
+ * Checks that the SIMD blend kernels and the watermark produce the same bytes as the scalar reference.
+ *
+ * @author Jan Razlaw
+ */
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "video_recorder/watermark.h"
+
+using namespace video_recorder;
+
+typedef void (*BlendRow)(unsigned char*, const unsigned char*, const unsigned char*, size_t);
+
+/** @brief Blends random rows of all lengths up to a few vectors with the given kernel and the scalar reference.
+ *
+ * The rows start one byte into their buffers so that the loads are unaligned.
+ */
+static void expectSameAsScalar(BlendRow blend_row)
+{
+  cv::RNG rng(42);
+  for(size_t n = 0; n <= 200; ++n)
+  {
+    std::vector<unsigned char> dst(n + 1), premultiplied(n + 1), inverse_weight(n + 1);
+    for(size_t i = 0; i <= n; ++i)
+    {
+      dst[i] = rng.uniform(0, 256);
+      inverse_weight[i] = rng.uniform(0, 256);
+      // mostly what a watermark produces, sometimes saturating
+      premultiplied[i] = rng.uniform(0, 4) == 0 ? rng.uniform(0, 256) : rng.uniform(0, 256 - inverse_weight[i]);
+    }
+
+    std::vector<unsigned char> expected = dst;
+    blendPremultipliedRowScalar(&expected[1], &premultiplied[1], &inverse_weight[1], n);
+    blend_row(&dst[1], &premultiplied[1], &inverse_weight[1], n);
+
+    ASSERT_EQ(expected, dst) << "row of " << n << " bytes";
+  }
+}
+
+TEST(BlendPremultipliedRow, sse2MatchesScalar)
+{
+  if(!blendSupportsSSE2())
+  {
+    std::cout << "SSE2 is not supported - skipping." << std::endl;
+    return;
+  }
+  expectSameAsScalar(&blendPremultipliedRowSSE2);
+}
+
+TEST(BlendPremultipliedRow, avx2MatchesScalar)
+{
+  if(!blendSupportsAVX2())
+  {
+    std::cout << "AVX2 is not supported - skipping." << std::endl;
+    return;
+  }
+  expectSameAsScalar(&blendPremultipliedRowAVX2);
+}
+
+TEST(BlendPremultipliedRow, dispatchMatchesScalar)
+{
+  expectSameAsScalar(&blendPremultipliedRow);
+}
+
+/** @brief Random BGRA watermark with a fully transparent border and scattered transparent pixels. */
+static cv::Mat randomWatermark(int width, int height)
+{
+  cv::RNG rng(7);
+  cv::Mat watermark(height, width, CV_8UC4, cv::Scalar::all(0));
+  for(int row = 3; row < height - 5; ++row)
+  {
+    for(int col = 4; col < width - 2; ++col)
+    {
+      cv::Vec4b& pixel = watermark.at<cv::Vec4b>(row, col);
+      for(int i = 0; i < 3; ++i)
+        pixel[i] = rng.uniform(0, 256);
+      pixel[3] = rng.uniform(0, 3) == 0 ? 0 : rng.uniform(1, 256);
+    }
+  }
+  return watermark;
+}
+
+/** @brief Applies the watermark with the SIMD kernels and with the scalar reference to the same random image. */
+static void expectSameAsScalar(const Watermark& watermark, int image_width, int image_height)
+{
+  cv::Mat image(image_height, image_width, CV_8UC3);
+  cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+
+  cv::Mat expected = image.clone();
+  watermark.apply(expected, true);
+  cv::Mat blended = image.clone();
+  watermark.apply(blended);
+
+  EXPECT_EQ(0, cv::norm(expected, blended, cv::NORM_INF)) << image_width << "x" << image_height << " image";
+  EXPECT_NE(0, cv::norm(image, blended, cv::NORM_INF)) << image_width << "x" << image_height << " image";
+}
+
+TEST(Watermark, everyPositionMatchesScalar)
+{
+  const WatermarkPosition positions[] = { BOTTOM_RIGHT, BOTTOM_LEFT, TOP_RIGHT, TOP_LEFT };
+  cv::Mat original_watermark = randomWatermark(123, 77);
+
+  for(WatermarkPosition position : positions)
+  {
+    SCOPED_TRACE(position);
+
+    // odd widths leave a remainder after the SIMD loop in every row
+    Watermark watermark(original_watermark, 301, 0.3f, position);
+    ASSERT_FALSE(watermark.empty());
+    expectSameAsScalar(watermark, 301, 211);
+  }
+}
+
+TEST(Watermark, clippedMatchesScalar)
+{
+  const WatermarkPosition positions[] = { BOTTOM_RIGHT, BOTTOM_LEFT, TOP_RIGHT, TOP_LEFT };
+  cv::Mat original_watermark = randomWatermark(123, 77);
+
+  for(WatermarkPosition position : positions)
+  {
+    SCOPED_TRACE(position);
+
+    Watermark watermark(original_watermark, 301, 0.7f, position);
+    ASSERT_FALSE(watermark.empty());
+
+    // lower than the watermark - clipped at the top or bottom
+    expectSameAsScalar(watermark, 301, 23);
+    // narrower than the watermark - clipped at the left or right
+    expectSameAsScalar(watermark, 45, 211);
+    // both
+    expectSameAsScalar(watermark, 37, 19);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}